@@ -5,9 +5,22 @@
 #include <algorithm>
 #include "typedefs.h"
 #include "string_utils.h"
+#include "fd_cache.h"
+#include "memory_store.h"
+#include "posting_chunks.h"
+#include "bson_templates.h"
 #include <iostream>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <vector>
 #include <bsoncxx/json.hpp>
 #include <mongocxx/client.hpp>
@@ -28,6 +41,39 @@ using bsoncxx::builder::basic::kvp;
 using bsoncxx::builder::basic::sub_array;
 
 
+// Metadata on one store endpoint (--store): chunks of posting lists of tags hashed to it and records
+// of files whose inode range is mapped to it, entries of exact tag sets are spread by their hash.
+// The first shard also keeps the catalog: tags, closures and intents of mutations which span shards.
+typedef struct shard_t {
+    std::string uri{};
+    mongocxx::client client{};
+    mongocxx::database db{};
+    mongocxx::collection tagToInode{};
+    mongocxx::collection inodeToTag{};
+    mongocxx::collection inodetoFilename{};
+    mongocxx::collection inodeToTime{};
+    mongocxx::collection inodeToValue{};
+    mongocxx::collection tagSetToInode{};
+} shard_t;
+
+// mutation queued for group commit, written by update_one or update_many
+typedef struct commit_op_t {
+    size_t shard = 0;
+    std::string collection{};                                             // name in db of shard
+    bool many = false;
+    bool upsert = false;
+    bsoncxx::document::value filter;
+    bsoncxx::document::value update;
+} commit_op_t;
+
+typedef struct commit_stats_t {
+    num_t batches = 0;
+    num_t operations = 0;
+    num_t largest = 0;                                                    // operations in the biggest batch
+    num_t failed = 0;                                                     // batches
+} commit_stats_t;
+
+
 class TagFS {
 private:
     // fields in collections
@@ -39,68 +85,259 @@ private:
     const std::string PUSH     = "$push";
     const std::string PULL     = "$pull";
     const std::string IN       = "$in";
+    const std::string OR       = "$or";
+    const std::string MOD      = "$mod";
+    const std::string ADD_TO_SET = "$addToSet";
     const std::string TAGS     = "tags";
     const std::string FILENAME = "filename";
     const std::string GROUP    = "group";
+    const std::string PARENTS  = "parents";
+    const std::string CHILDREN = "children";
+    const std::string CLOSURES = "closures";
+    const std::string INC      = "$inc";
+    const std::string FILES    = "files";
+    const std::string BYTES    = "bytes";
+    const std::string MTIME    = "mtime";
+    const std::string GTE      = "$gte";
+    const std::string LT       = "$lt";
+    const std::string LOWER_FILENAME = "lfilename";
+    const std::string LTE      = "$lte";
+    const std::string TAG_ID   = "tag";
+    const std::string CHUNK    = "chunk";
+    const std::string FIRST    = "first";
+    const std::string LAST     = "last";
+    const std::string COUNT    = "count";
+    const std::string DATA     = "data";
+    const std::string GT       = "$gt";
+    const std::string INODE    = "inode";
+    const std::string KEY      = "key";
+    const std::string VALUE    = "value";
+    const std::string NUMBER   = "number";
+    const std::string FROM     = "from";
+    const std::string TO       = "to";
+    const std::string STORES   = "stores";
+    const std::string NEXT     = "next";
+    const std::string MAX      = "$max";
+
+    // filters and options used by most calls, built once
+    const int64_filter byId{_ID};
+    const int64_filter byTag{TAG_ID};
+    const int64_filter byInode{INODE};
+    mongocxx::options::find idsOnly{};                                    // projection of _id
+    mongocxx::options::find chunkOrder{};                                 // chunks of posting list in order
+    mongocxx::options::update upsert{};
 
     // helpers structures for interaction with db
     mongocxx::instance instance{}; // This should be done only once.
-    mongocxx::uri uri{"mongodb://localhost:27017"};
-    mongocxx::client client;
-    mongocxx::database db;
+    std::string db_name{};
+    std::vector<shard_t> shards{};
+    mongocxx::database db;                                                // of the first shard
 
-    // collections in DB
+    // catalog collections, on the first shard
     mongocxx::collection tags;
-    mongocxx::collection tagToInode;
-    mongocxx::collection inodeToTag;
-    mongocxx::collection inodetoFilename;
+    mongocxx::collection tagClosure;
+    mongocxx::collection intents;
+
+    size_t tagShardIndex(num_t tagId) const;
+    size_t inodeShardIndex(num_t inode) const;
+    shard_t &tagShard(num_t tagId);                                       // shard of posting list
+    shard_t &inodeShard(num_t inode);                                     // shard of records of file
+    std::map<size_t, numvec> inodesByShard(const numvec &inodes);
+    std::map<size_t, numvec> tagsByShard(const numvec &tagIds);
+    void shardsCheckLayout();                                             // exits if stores differ from creation
+
+    // calls f(shard, index) for given shards in parallel, the first one on calling thread; results in order
+    template<typename F>
+    auto scatter(const std::vector<size_t> &indexes, F f) -> std::vector<decltype(f(shards[0], size_t{}))> {
+        std::vector<std::future<decltype(f(shards[0], size_t{}))>> pending;
+        for (size_t k = 1; k < indexes.size(); k++) {
+            pending.push_back(std::async(std::launch::async, [this, &f, index = indexes[k]]() {
+                return f(shards[index], index);
+            }));
+        }
+        std::vector<decltype(f(shards[0], size_t{}))> result;
+        if (!indexes.empty())
+            result.push_back(f(shards[indexes.front()], indexes.front()));
+        for (auto &future: pending) {
+            result.push_back(future.get());
+        }
+        return result;
+    }
+    template<typename F>
+    auto scatterAll(F f) {
+        std::vector<size_t> indexes(shards.size());
+        for (size_t k = 0; k < indexes.size(); k++)
+            indexes[k] = k;
+        return scatter(indexes, f);
+    }
+
+    // mutation of file which spans shards: target state is written to catalog first, and replayed
+    // on initialize if the process dies before everything is written
+    bool intentsNeeded() const;
+    int intentBegin(num_t inode, const numvec &fromTagIds, const numvec &toTagIds, const std::string &filename = {});
+    void intentEnd(num_t inode);
+    void intentsRecover();
+
+    // ephemeral file system keeps metadata in memory instead of db
+    bool memory = false;
+    MemoryStore mem{};
 
     std::hash<std::string> hasher;
+    std::unordered_map<std::string, num_t> tagIdCache{};                  // names of existing tags only
+    bool tagIdTaken(num_t tagId);
+    void tagIdCacheSet(const std::string &tagname, num_t tagId);
+    tag_t tagFromDocument(const bsoncxx::document::view &view);
     inline int collectionDelete(mongocxx::collection &collection, num_t id);
+    inline bsoncxx::document::value idsIn(const numvec &ids);
+    numvec tagRelatives(num_t tagId, const std::string &relation);
+    int tagClosureDelete(num_t tagId);                                    // also from closures of members
+    void inodetoFilenameIndexNames();
+    void tagSetToInodeBuild();                                            // entries of files made before the index
+    num_t exactFileInode(const tagvec &tags);                             // -1 if path is not complete tag set of file
+    numvec orderedScan(const inodeset &inodes, const query_order_t &order, size_t limit);
+    num_t filesCountCached = 0;                                           // estimate for plans of ordered listings
+    std::chrono::steady_clock::time_point filesCountAt{};
+    num_t filesCountEstimate();                                           // filesCount at most once in a while
+
+    // chunks of posting lists are rewritten by compactor thread too, which has own connection
+    std::mutex postingsMutex{};
+    std::condition_variable compactionWakeup{};
+    std::set<num_t> postingsToCompact{};                                  // tags with too big or small chunks
+    bool compactionStop = false;
+    std::thread compactor{};
+    std::vector<posting_chunk_t> postingChunks(mongocxx::collection &collection, num_t tagId);
+    bsoncxx::document::value postingChunkFields(const numvec &sorted);    // everything but tag and chunk
+    bsoncxx::document::value postingChunkDocument(num_t tagId, num_t chunk, const numvec &sorted);
+    numvec postingChunkInodes(const bsoncxx::document::view &view);
+    void postingChunkInodes(const bsoncxx::document::view &view, numvec &out);   // appends to out
+    int tagToInodePatch(num_t tagId, const numvec &add, const numvec &remove);   // touches only chunks of inodes
+    int postingChunksPatch(mongocxx::collection &collection, num_t tagId, const numvec &add, const numvec &remove,
+                           bool &compact);                                // compact set if chunks went out of bounds
+    int postingChunksReplace(mongocxx::collection &collection, num_t tagId, const numvec &sorted);
+    int tagToInodeCompact(mongocxx::collection &collection, num_t tagId); // splits and merges chunks out of bounds
+    inodeset tagToInodeIntersectIn(mongocxx::collection &collection, num_t tagId, const inodeset &candidates);
+    void tagToInodeChunkOld();                                            // posting lists of one document each
+    int tagClosurePatch(num_t closureId, const numvec &add, const numvec &remove);
+    void tagClosureChunkOld();                                            // closures of one document each
+    void compactionLoop();
+
+    // mutations which next requests don't read back (stats of tags, mtimes) are queued and
+    // written by committer thread in batches, with own connection; request waits for them after the lock
+    std::mutex commitMutex{};
+    std::condition_variable commitWakeup{};
+    std::condition_variable commitDone{};
+    std::deque<commit_op_t> commitQueue{};
+    num_t commitEnqueued = 0;                                             // tickets of queued mutations, in order
+    num_t commitCommitted = 0;                                            // the last ticket written
+    num_t commitFlushTo = 0;                                              // batches up to it don't wait for window
+    std::map<num_t, num_t> commitFailed{};                                // first to last ticket of failed batches
+    commit_stats_t commitStats{};
+    std::chrono::microseconds commitWindow{0};
+    size_t commitBatch = 1;
+    bool commitStop = false;
+    std::thread committer{};
+    int commitWrite(commit_op_t op);                                      // queued if committer runs, else at once
+    void commitFlush();                                                   // before queued data is read or rewritten
+    void commitLoop();
+
+    // caches are invalidated by changes which other processes make, from change stream of every shard
+    std::atomic<bool> watchStop{false};
+    std::mutex watchMutex{};
+    std::condition_variable watchWakeup{};
+    std::vector<std::thread> watchers{};
+    void watchLoop(size_t index);
+    bool watchApply(const bsoncxx::document::view &event);               // false if stream has to be reopened
 
 
 public:
     std::string fs_files_dir{};
+    FdCache fdCache{};
+    std::mutex apiMutex{};                                                // taken by users of TagFS from other threads
 
     TagFS();
     int dropFS();
-    void initialize(std::string &fs_files_dir);
-    std::pair<tagvec, int> parseTags(const char *path);
+    void initialize(std::string &fs_files_dir, bool inMemory = false, num_t bytesLimit = 0,
+                    const strvec &stores = {});                           // uris of shards, localhost if none
+    bool isEphemeral() const;
+    int dataResize(num_t oldSize, num_t newSize);                         // -1 and ENOSPC if over memory limit
+    int dataReserve(int fd, num_t end);                                   // resize of open file up to end
+    std::pair<tagvec, int> parseTags(const char *path, pathvec *components = nullptr); // components of path if asked
+    resolved_t resolve(const char *path, bool dirInodes = false);         // files of directory only if asked
     num_t getFileInode(tagvec &tags);
+    num_t getFileSize(num_t inode);                                       // 0 if error
     std::string getFileRealPath(tagvec &tags);
     inodeset getInodesFromTags(tagvec &tags);
-    num_t getNewInode();
+    numvec orderInodes(const inodeset &inodes, const query_order_t &order); // the first limit of files, in order
+    num_t getNewInode();                                                  // -1 and errno if error
     int createNewFileMetaData(tagvec &tags, num_t newInode);
     int deleteFileMetaData(tagvec &tags, num_t fileInode);
     int deleteRegularTags(tagvec &tags);
-    int createRegularTags(strvec &tagNames);
+    int createRegularTags(const pathvec &tagNames);
+    bool hasVirtualTags(const tagvec &tags);
     int renameFileTag(num_t inode, const std::string &oldTagName, const std::string &newTagName);
-    std::pair<tagvec, int> prepareFileCreation(const char *path);
+    int renameRegularTag(const std::string &oldTagName, const std::string &newTagName); // -1 and errno if error
+    int retagFile(num_t inode, const tagvec &newTags);                    // changes only tags which differ
+    std::pair<tagvec, int> prepareFileCreation(const char *path, pathvec *components = nullptr);
+    int checkFS(bool repair);                                             // number of problems found, -1 if error
+    int dumpFS(const std::string &archive, bool withData);               // archive "-" is stdout, -1 if error
+    int restoreFS(const std::string &archive);                            // into empty file system, -1 if error
+    void startCompaction();                                               // after daemonization
+    void stopCompaction();
+    void startCommitter(num_t windowMicros, num_t batchMax);              // after daemonization, none if window is 0
+    void stopCommitter();                                                 // writes what is queued
+    int commitWait();                                                     // for mutations of calling thread, -1 and EIO if failed
+    commit_stats_t commitStatistics();
+    void startWatching();                                                 // after daemonization, with mongo backend
+    void stopWatching();
 
 public:
 ////////////////////////////////////////////  tags collection manipulation  ///////////////////////////////////////////
 
-    num_t tagNameToTagid(const std::string& tagname);
+    num_t tagNameToTagid(const std::string& tagname);                     // id new tag would get if none has the name
     int tagsAdd(tag_t tag);                                               // -1 if error else 0
     int tagsUpdate(num_t tagId, tag_t newTag);                            // -1 if error else 0
     tag_t tagsGet(num_t tagId);                                           // {} if error
+    tag_t tagsGetByName(const std::string &tagname);                      // {} if error
+    std::pmr::map<std::string_view, tag_t> tagsGetByNames(pathvec tagnames);   // existing only, keyed by given views
+    std::unordered_map<num_t, tag_t> tagsGetMany(const numvec &tagIds);   // existing only
     int tagsDelete(num_t tagId);                                          // -1 if error else 0
+    int tagsRename(num_t tagId, const std::string &newName);              // -1 if error else 0
+    int tagStatsUpdate(const numvec &tagIds, num_t files, num_t bytes);   // -1 if error else 0
+    tag_stat_t tagStatsGet(num_t tagId);                                  // {} if error
+    tag_stat_t tagSetStats(tagvec &tags);                                 // upper bound for more than one tag
+    num_t filesCount();
+    std::map<std::string, num_t> tagFacets(const tagvec &pathTags, const inodeset &inodes); // regular tags to files
+
+////////////////////////////////////////////  tags hierarchy manipulation  ///////////////////////////////////////////
+    int setTagParents(const std::string &tagName, const strvec &parentNames); // -1 and errno if error else 0
+    numvec tagDescendants(num_t tagId);
+    numvec tagAncestors(num_t tagId);
+    numvec tagInodesGet(const tag_t &tag);                                // own inodes with inodes of descendants
+    int tagClosureRefresh(num_t tagId);                                   // (de)materialize union posting list
+    int tagClosureAddInode(const tag_t &tag, num_t inode);
+    int tagClosureRemoveInode(const numvec &closureIds, num_t inode);
+    numvec tagClosureGet(num_t tagId);
 
 //////////////////////////////////////////  tagToInodes collection manipulation  /////////////////////////////////////////////
     strvec tagNamesByTagType(num_t type);
 
     int tagToInodeInsert(num_t tagId, num_t inodes);
     int tagToInodeUpdate(num_t tagId, const numvec &inodes);
-    numvec tagToInodeGet(num_t tagId);
+    numvec tagToInodeGet(num_t tagId);                                    // sorted
+    std::unordered_map<num_t, numvec> tagToInodeGetMany(const numvec &tagIds);
+    inodeset tagToInodeIntersect(num_t tagId, const inodeset &candidates); // reads only chunks in range of candidates
+    inodeset tagToInodeIntersectMany(const numvec &tagIds, const inodeset &candidates); // shards in parallel
     int tagToInodeDelete(num_t tagId);
     int tagToInodeAddInode(num_t tagId, num_t inode);
     int tagToInodeDeleteInodes(const numvec &inodes);
+    int tagToInodeMoveInode(num_t inode, const numvec &fromTagIds, const numvec &toTagIds);
     bool tagToInodeFind(num_t tagId); // just check if it exists
 
 //////////////////////////////////////////  InodeToTag collection manipulation  /////////////////////////////////////////////
     int inodeToTagInsert(num_t inode, num_t tagsIds);
     int inodeToTagUpdate(num_t inode, const numvec &tagsIds);
     numvec inodeToTagGet(num_t inode);
+    std::unordered_map<num_t, numvec> inodeToTagGetMany(const numvec &inodes);
     int inodeToTagDelete(num_t inode);
     int inodeToTagAddTagId(num_t inode, num_t tagid);
     int inodeToTagDeleteTags(const numvec &tagIds);
@@ -110,10 +347,33 @@ public:
     int inodetoFilenameInsert(num_t inode, const std::string &filename);
     int inodetoFilenameUpdate(num_t inode, const std::string &filename);
     std::string inodetoFilenameGet(num_t inode);
+    std::unordered_map<num_t, std::string> inodetoFilenameGetMany(const numvec &inodes);
+    numvec inodetoFilenameFind(const std::string &pattern);               // exact name or prefix ending with *
     int inodetoFilenameDelete(num_t inode);
 
+//////////////////////////////////////////  InodeToTime collection manipulation  /////////////////////////////////////////////
+    int inodeToTimeUpdate(num_t inode, num_t mtime);                      // inserts if absent
+    int inodeToTimeDelete(num_t inode);
+    std::unordered_map<num_t, num_t> inodeToTimeGetMany(const numvec &inodes);   // files without record are missing
+    numvec inodeToTimeRange(num_t from, num_t to, const numvec &candidates = {}); // all inodes if no candidates
+    int inodeToTimeRefresh(num_t inode);                                  // takes mtime of backing file
+
+//////////////////////////////////////////  InodeToValue collection manipulation  /////////////////////////////////////////////
+    int inodeToValueSet(num_t inode, const std::string &key, const tag_value_t &value); // inserts if absent
+    int inodeToValueDelete(num_t inode, const std::string &key = {});    // all keys if empty, 0 if none
+    std::map<std::string, std::string> inodeToValueGet(num_t inode);      // key to value text
+    numvec inodeToValueRange(const value_range_t &range, const numvec &candidates = {}); // all inodes if no candidates
+    bool inodeToValueKeyExists(const std::string &key);
+
+//////////////////////////////////////////  TagSetToInode collection manipulation  /////////////////////////////////////////////
+    num_t tagSetToInodeGet(const numvec &tagIds);                         // file having exactly the tags, -1 if none
+    int tagSetToInodeSet(num_t inode, const numvec &tagIds);
+    int tagSetToInodeDelete(num_t inode, const numvec &tagIds);           // only if entry still points to inode
+
     num_t new_inode_counter = 0;
+    num_t new_inode_end = 0;                                              // end of inodes reserved in store
     num_t getMaximumInode();
+    int inodeCounterInit(num_t maximum);                                  // counter in store is at least maximum
 };
 
 extern TagFS tagFS;
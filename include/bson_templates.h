@@ -0,0 +1,36 @@
+#ifndef UCUTAG_PROJECT_BSON_TEMPLATES_H
+#define UCUTAG_PROJECT_BSON_TEMPLATES_H
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <bsoncxx/document/view.hpp>
+#include <bsoncxx/document/element.hpp>
+#include <bsoncxx/array/view.hpp>
+#include "typedefs.h"
+
+#define BSON_TEMPLATE_KEY_MAX 32
+
+// Filter {key: int64} encoded once. Point lookups copy it to the stack and patch the value in place,
+// instead of building bson on heap field by field. View is valid while the copy lives, so it is
+// passed to driver calls directly and never kept by models of bulk writes.
+class int64_filter {
+private:
+    std::array<uint8_t, 4 + 1 + BSON_TEMPLATE_KEY_MAX + 1 + 8 + 1> data{};
+    uint32_t size = 0;
+    uint32_t valueOffset = 0;
+
+public:
+    explicit int64_filter(std::string_view key);
+    int64_filter operator()(num_t value) const;                           // copy with the value
+    bsoncxx::document::view view() const;
+};
+
+// array of int64 written straight into buffer of caller, which keeps its capacity between calls.
+// View is valid until the buffer is written again: arrays alive at the same time need own buffers
+bsoncxx::array::view encodeInt64Array(const numvec &values, std::vector<uint8_t> &buffer);
+// appends int64 elements of array to out, reading raw bson; nothing if element is missing
+void decodeInt64Array(const bsoncxx::document::element &element, numvec &out);
+
+#endif //UCUTAG_PROJECT_BSON_TEMPLATES_H
@@ -0,0 +1,44 @@
+#ifndef UCUTAG_PROJECT_FD_CACHE_H
+#define UCUTAG_PROJECT_FD_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "typedefs.h"
+
+#define FD_CACHE_CAPACITY 1024
+
+// Owns descriptor, closes it when the last user is gone
+typedef struct fd_holder {
+    int fd = -1;
+    explicit fd_holder(int fd) : fd(fd) {}
+    fd_holder(const fd_holder &) = delete;
+    fd_holder &operator=(const fd_holder &) = delete;
+    ~fd_holder();
+} fd_holder;
+
+typedef std::shared_ptr<fd_holder> fdptr;
+
+
+// Bounded LRU cache of O_PATH descriptors of backing files, keyed by inode.
+// Also holds descriptor of files directory, so that backing files are never resolved through cwd.
+class FdCache {
+private:
+    fdptr dir{};
+    size_t capacity;
+    std::list<std::pair<num_t, fdptr>> lru{};
+    std::unordered_map<num_t, std::list<std::pair<num_t, fdptr>>::iterator> index{};
+    std::mutex mutex{};
+
+public:
+    explicit FdCache(size_t capacity = FD_CACHE_CAPACITY);
+    int openDir(const std::string &files_dir);                           // -1 and errno if error else 0
+    int dirFd() const;
+    fdptr get(num_t inode);                                              // nullptr and errno if error
+    void forget(num_t inode);                                            // backing file was removed or replaced
+    void clear();
+};
+
+#endif //UCUTAG_PROJECT_FD_CACHE_H
@@ -0,0 +1,77 @@
+#ifndef UCUTAG_PROJECT_IO_ENGINE_H
+#define UCUTAG_PROJECT_IO_ENGINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef UCUTAG_IO_URING
+#include <liburing.h>
+#endif
+
+#define IO_ENGINE_ENTRIES 256
+#define IO_ENGINE_FILES 64                  // registered descriptors of open files
+#define IO_ENGINE_BUFFERS 32                // registered buffers
+#define IO_ENGINE_BUFFER_SIZE (128 * 1024)
+
+
+// Backing files I/O. With io_uring requests of concurrent callers are submitted in batches,
+// without it (not compiled in, or kernel refuses to set up ring) plain syscalls are used.
+// All methods behave like corresponding syscalls: -1 and errno if error.
+class IoEngine {
+private:
+    bool running = false;
+
+#ifdef UCUTAG_IO_URING
+    typedef struct io_request {
+        std::function<void(struct io_uring_sqe *)> prepare;
+        std::promise<int> result;
+    } io_request;
+
+    struct io_uring ring{};
+    std::mutex mutex{};
+    std::deque<io_request *> pending{};
+    bool submitting = false;
+    std::condition_variable idle{};         // notified when submitting ends
+    std::thread reaper{};
+
+    bool files_registered = false;
+    std::vector<int> files{};               // descriptor in every slot, -1 if slot is free
+    std::vector<char> buffers_memory{};
+    std::vector<int> free_buffers{};        // indexes of registered buffers
+
+    int submit(std::function<void(struct io_uring_sqe *)> prepare);
+    void reap();
+    int acquireBuffer();
+    void releaseBuffer(int index);
+    char *buffer(int index);
+#endif
+
+public:
+    IoEngine() = default;
+    IoEngine(const IoEngine &) = delete;
+    IoEngine &operator=(const IoEngine &) = delete;
+    ~IoEngine();
+
+    int start();                            // must be called after daemonization, -1 if fallback is used
+    void stop();
+    bool available() const;
+
+    int registerFile(int fd);               // slot of registered descriptor, -1 if none is free
+    void unregisterFile(int slot);
+
+    ssize_t read(int fd, int slot, void *buf, size_t size, off_t offset);
+    ssize_t write(int fd, int slot, const void *buf, size_t size, off_t offset);
+    int fsync(int fd, int slot, bool datasync);
+    int stat(int dirfd, const char *path, int flags, struct stat *stbuf);
+};
+
+extern IoEngine ioEngine;
+
+#endif //UCUTAG_PROJECT_IO_ENGINE_H
@@ -0,0 +1,55 @@
+#ifndef UCUTAG_PROJECT_MEMORY_STORE_H
+#define UCUTAG_PROJECT_MEMORY_STORE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "typedefs.h"
+
+
+// Metadata of ephemeral (--backend=memory) file system: the same collections as in db,
+// kept in hash maps of the mount process and lost on unmount.
+// Data of files is in tmpfs, optionally limited in total size.
+class MemoryStore {
+public:
+    std::unordered_map<num_t, tag_t> tags{};
+    std::unordered_map<std::string, num_t> tagNames{};     // name to id, like index of tags collection
+    std::unordered_map<num_t, inodeset> tagToInode{};
+    std::unordered_map<num_t, numvec> inodeToTag{};
+    std::unordered_map<num_t, std::string> inodetoFilename{};   // use filenameSet, it keeps indexes
+    std::unordered_map<num_t, inodeset> tagClosure{};
+    std::unordered_map<num_t, num_t> tagSetToInode{};      // hash of complete tag set of file to its inode
+
+    num_t bytesLimit = 0;                                   // 0 if unlimited
+    num_t bytesUsed = 0;
+
+    int timeUpdate(num_t inode, num_t mtime);
+    int timeDelete(num_t inode);
+    num_t timeGet(num_t inode);                             // -1 if there is none
+    numvec timeRange(num_t from, num_t to, const numvec &candidates);
+
+    void filenameSet(num_t inode, const std::string &filename);
+    void filenameDelete(num_t inode);
+    numvec filenameFind(const std::string &filename, bool prefix);         // prefix is lowercase
+
+    int valueSet(num_t inode, const std::string &key, const tag_value_t &value);
+    int valueDelete(num_t inode, const std::string &key);                 // all keys if empty, 0 if none
+    std::map<std::string, std::string> valueGet(num_t inode);             // key to value text
+    numvec valueRange(const value_range_t &range, const numvec &candidates);
+    bool valueKeyExists(const std::string &key);
+
+    int resize(num_t oldSize, num_t newSize);               // -1 and ENOSPC if limit is exceeded
+
+private:
+    std::unordered_map<num_t, num_t> inodeToTime{};
+    std::set<std::pair<num_t, num_t>> timeIndex{};          // (mtime, inode) for range queries
+    std::set<std::pair<std::string, num_t>> filenameIndex{};      // (filename, inode)
+    std::set<std::pair<std::string, num_t>> lowerFilenameIndex{}; // (lowercase filename, inode)
+    std::unordered_map<num_t, std::map<std::string, tag_value_t>> inodeToValue{};
+    std::unordered_map<std::string, std::set<std::pair<double, num_t>>> numberIndex{};    // by key, numbers only
+    std::unordered_map<std::string, std::set<std::pair<std::string, num_t>>> textIndex{}; // by key, all values
+};
+
+#endif //UCUTAG_PROJECT_MEMORY_STORE_H
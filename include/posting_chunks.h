@@ -0,0 +1,31 @@
+#ifndef UCUTAG_PROJECT_POSTING_CHUNKS_H
+#define UCUTAG_PROJECT_POSTING_CHUNKS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "typedefs.h"
+
+#define POSTING_CHUNK_SIZE 4096                         // inodes in chunk written by append or compaction
+#define POSTING_CHUNK_MAX (2 * POSTING_CHUNK_SIZE)      // bigger chunks are split by compaction
+#define POSTING_CHUNK_MIN (POSTING_CHUNK_SIZE / 4)      // smaller chunks are merged with next one by compaction
+
+// Posting list of tag is stored as chunks of sorted inodes, keyed by (tag, chunk).
+// Chunk is numbered by the least inode it may hold, and holds inodes up to number of next chunk,
+// the first chunk also holds all inodes below its number. So chunks are split and merged
+// without renumbering the others.
+typedef struct posting_chunk_t {
+    num_t chunk = 0;
+    num_t first = -1;                                   // -1 if chunk is empty
+    num_t last = -1;
+    num_t count = 0;
+} posting_chunk_t;
+
+std::string encodePostings(const numvec &sorted);       // varint deltas of sorted non-negative inodes
+numvec decodePostings(const uint8_t *data, size_t size);
+void decodePostings(const uint8_t *data, size_t size, numvec &out);         // appends to out
+void mergePostings(numvec &sorted, const numvec &add, const numvec &remove);   // keeps it sorted and unique
+std::vector<numvec> splitPostings(const numvec &sorted, size_t chunkSize);     // at least one, maybe empty, piece
+size_t postingChunkOf(const std::vector<posting_chunk_t> &chunks, num_t inode); // index of chunk to hold inode
+
+#endif //UCUTAG_PROJECT_POSTING_CHUNKS_H
@@ -0,0 +1,38 @@
+#ifndef UCUTAG_PROJECT_QUERY_SERVICE_H
+#define UCUTAG_PROJECT_QUERY_SERVICE_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include "TagFS.h"
+
+#define COMMITS_REQUEST "@commits"
+
+// Unix socket of mounted file system answering queries without VFS, on --query-socket.
+// Request is a line with path of tag directory, e.g. "/photos/jpeg". Response is a line per file:
+//     inode \t size \t mtime \t filename
+// and an empty line after the last one, or one line "error \t errno \t message".
+// Backslashes and newlines of filenames are escaped as \\ and \n.
+// Request "@commits" is answered by statistics of group commit instead:
+//     commits \t batches \t mutations \t largest batch \t failed batches
+// Connection may send many requests; connections are served one after another.
+class QueryService {
+private:
+    TagFS *tagFS = nullptr;
+    std::string socketPath{};
+    int listenFd = -1;
+    std::atomic<int> clientFd{-1};                                          // connection being served
+    std::atomic<bool> stopping{false};
+    std::thread server{};
+
+    void serve();
+    void serveClient(int fd);
+    int answer(int fd, const std::string &path);                            // -1 if client is gone
+
+public:
+    ~QueryService();
+    int start(TagFS &fs, const std::string &path);                         // -1 and errno if error else 0
+    void stop();
+};
+
+#endif //UCUTAG_PROJECT_QUERY_SERVICE_H
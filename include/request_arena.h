@@ -0,0 +1,22 @@
+#ifndef UCUTAG_PROJECT_REQUEST_ARENA_H
+#define UCUTAG_PROJECT_REQUEST_ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+#define REQUEST_ARENA_SIZE (64 * 1024)
+
+// Temporaries of one request (FUSE handler or query) come from monotonic arena of its thread,
+// which is released at once when the outermost scope ends. Outside of scope the heap is used,
+// so that users of the library which never open one do not grow the arena forever.
+class RequestScope {
+public:
+    RequestScope();
+    ~RequestScope();
+    RequestScope(const RequestScope &) = delete;
+    RequestScope &operator=(const RequestScope &) = delete;
+};
+
+std::pmr::memory_resource *requestArena();
+
+#endif //UCUTAG_PROJECT_REQUEST_ARENA_H
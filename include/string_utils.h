@@ -3,10 +3,39 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include <memory_resource>
 #include "typedefs.h"
+#include "request_arena.h"
+
+// virtual tags selecting files by modification time: @mtime:2024, @mtime:2024-03, @mtime>=2024-03-01, @mtime>-7d
+#define TIME_TAG_PREFIX "@mtime"
+// virtual directory of files found by name: @name/<filename>, or case insensitive @name/<prefix>*
+#define NAME_DIR "@name"
+#define NAME_PREFIX_WILDCARD '*'
+// virtual tags ordering files of directory: @sort=mtime, @sort=name, '-' before key for descending order,
+// and @limit=100 to list only the first files
+#define SORT_TAG_PREFIX "@sort="
+#define LIMIT_TAG_PREFIX "@limit="
+#define ORDER_KEY_MTIME "mtime"
+#define ORDER_KEY_NAME "name"
+// virtual file of tag directory: how many of its files every tag listed in it leads to
+#define FACETS_FILE "@facets"
+
+// components of path viewing it, in arena of request; valid while path and request last
+typedef std::pmr::vector<std::string_view> pathvec;
 
 strvec split(const std::string &str, const std::string &delim);
+pathvec splitPath(std::string_view path);                              // no empty components
 void fillTagStat(struct stat *stbuf);
+bool parseTimeTag(std::string_view name, num_t &from, num_t &to);      // [from, to) in seconds
+bool parseOrderTag(std::string_view name, query_order_t &order);        // sets modifier of name in order
+bool isValueKey(std::string_view key);                                 // key of typed tags
+tag_value_t parseTagValue(const std::string &text);
+bool parseValueTag(std::string_view name, value_range_t &range);
+bool valueInRange(const tag_value_t &value, const value_range_t &range);
+std::string toLower(const std::string &str);                           // ASCII letters only
+std::string prefixUpperBound(const std::string &prefix);                // least string greater than all with prefix, "" if none
 // const std::hash<std::string> hasher;
 
 #endif //UCUTAG_PROJECT_STRING_UTILS_H
@@ -0,0 +1,43 @@
+#ifndef UCUTAG_PROJECT_TAG_QUERY_H
+#define UCUTAG_PROJECT_TAG_QUERY_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "TagFS.h"
+
+// Number of files returned by one call of TagQuery::next by default
+#define QUERY_BATCH_SIZE 1024
+
+// file of query result
+typedef struct query_entry_t {
+    num_t inode = -1;
+    std::string filename{};
+    struct stat st{};               // of backing file, zeroed if it is missing
+} query_entry_t;
+
+
+// Files of tag directory, read without VFS: path is resolved once with the same planner as
+// readdir, then names and stats are fetched in batches. Files come in order of inodes,
+// or of @sort and up to @limit if path has them, e.g. "/raw/@sort=-mtime/@limit=100".
+// Given mutex is held only while TagFS is used, so that other threads may interleave.
+class TagQuery {
+private:
+    TagFS &tagFS;
+    std::mutex *lock;
+    tagvec queryTags{};
+    numvec inodes{};
+    size_t position = 0;
+    int error = 0;
+
+public:
+    TagQuery(TagFS &tagFS, const std::string &path, std::mutex *lock = nullptr);
+    int status() const;                                     // 0, or errno if some tag does not exist
+    const tagvec &tags() const;                             // tags of path
+    size_t size() const;                                    // number of files
+    bool done() const;
+    std::vector<query_entry_t> next(size_t count = QUERY_BATCH_SIZE);   // empty if done
+};
+
+#endif //UCUTAG_PROJECT_TAG_QUERY_H
@@ -20,7 +20,10 @@ static int ucutag_link(const char *from, const char *to);
 static int ucutag_chmod(const char *path, mode_t mode);
 static int ucutag_chown(const char *path, uid_t uid, gid_t gid);
 static int ucutag_truncate(const char *path, off_t size);
+static int ucutag_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 static int ucutag_open(const char *path, struct fuse_file_info *fi);
+static int ucutag_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
+static int ucutag_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
 static int ucutag_read(const char *path, char *buf, size_t size, off_t offset,
                     struct fuse_file_info *fi);
 static int ucutag_read_buf(const char *path, struct fuse_bufvec **bufp,
@@ -34,7 +37,12 @@ static int ucutag_flush(const char *path, struct fuse_file_info *fi);
 static int ucutag_release(const char *path, struct fuse_file_info *fi);
 static int ucutag_fsync(const char *path, int isdatasync,
                      struct fuse_file_info *fi);
+static int ucutag_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+static int ucutag_getxattr(const char *path, const char *name, char *value, size_t size);
+static int ucutag_listxattr(const char *path, char *list, size_t size);
+static int ucutag_removexattr(const char *path, const char *name);
 static int ucutag_flock(const char *path, struct fuse_file_info *fi, int op);
+static int ucutag_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
 void *ucutag_init(struct fuse_conn_info *conn);
 int ucutag_utimens(const char *, const struct timespec tv[2]);
 void ucutag_destroy(void *userdata);
@@ -11,13 +11,28 @@
 
 #define TAG_TYPE_REGULAR 0
 #define TAG_TYPE_FILE 1
+#define TAG_TYPE_TIME 2         // virtual, not stored in tags collection
+#define TAG_TYPE_NAME 3         // virtual, files found by name in filename index
+#define TAG_TYPE_VALUE 4        // virtual, files found by key=value in value index
+#define TAG_TYPE_ORDER 5        // virtual, @sort= and @limit= modifiers of listing, select nothing
 
 typedef ssize_t num_t;
 
 
+typedef struct tag_stat_t {
+    num_t files = 0;                // number of tagged files
+    num_t bytes = 0;                // total size of tagged files
+    num_t mtime = 0;                // last time tagged files or their sizes changed
+} tag_stat_t;
+
+
 typedef struct tag_t {
     num_t type = TAG_TYPE_REGULAR;
     std::string name{};
+    std::vector<num_t> parents{};   // ids of tags implied by this one
+    std::vector<num_t> children{};  // ids of tags implying this one
+    std::vector<num_t> closures{};  // ids of materialized ancestors (self included) which posting lists contain ours
+    tag_stat_t stats{};
 
     // for storing in hash map
     bool operator==(const tag_t &other) const {
@@ -34,8 +49,6 @@ struct std::hash<tag_t> {
 };
 
 
-enum { FILE_NAME, TAG_NAME, TIME} tagType;
-
 // vector serialization
 template <class T>
 std::ostream& operator<<(std::ostream& os, const std::vector<T>& v) {
@@ -73,4 +86,43 @@ typedef std::vector<std::string> strvec;
 typedef std::unordered_set<num_t> inodeset;
 typedef std::vector<num_t> numvec;
 
+
+// value of typed tag key=value, number if the whole text parses as one
+typedef struct tag_value_t {
+    bool numeric = false;
+    double number = 0;
+    std::string text{};
+} tag_value_t;
+
+// typed tag of path: key=value, key>=value (also >, <=, <), or key=[from..to] with inclusive bounds
+typedef struct value_range_t {
+    std::string key{};
+    tag_value_t from{};
+    tag_value_t to{};
+    bool hasFrom = false;
+    bool hasTo = false;
+    bool fromOpen = false;          // bound itself is excluded
+    bool toOpen = false;
+    bool numeric = true;            // compares numbers, else texts
+} value_range_t;
+
+
+// modifiers of path: files are listed by key, only the first ones if there is limit
+typedef struct query_order_t {
+    std::string key{};              // "mtime" or "name", empty if order is not asked for
+    bool descending = false;
+    num_t limit = -1;               // -1 if all files
+} query_order_t;
+
+
+// path looked up once for everything handler needs
+typedef struct resolved_t {
+    tagvec tags{};                  // prefix of existing tags if status is -1
+    inodeset inodes{};              // files having all the tags
+    numvec ordered{};               // the same files in order of modifiers, if isOrdered
+    bool isOrdered = false;         // path of directory has @sort or @limit
+    num_t inode = -1;               // the only file of path, -1 if none or many
+    int status = 0;                 // -1 and errno if some tag does not exist
+} resolved_t;
+
 #endif //UCUTAG_PROJECT_TYPEDEFS_H
@@ -1,25 +1,143 @@
 #include <cstdlib>
+#include <ctime>
+#include <limits>
+#include <optional>
+#include <tuple>
 #include <filesystem>
-#include <filesystem>
+#include <map>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <mongocxx/options/bulk_write.hpp>
+#include <mongocxx/model/write.hpp>
+#include <bsoncxx/types.hpp>
+#include <bsoncxx/builder/concatenate.hpp>
 
 #include "TagFS.h"
 namespace fs = std::filesystem;
 
-std::pair<tagvec, int> TagFS::parseTags(const char *path) {
-    tagvec res{};
-    auto splitted = split(path, "/");
+// Ancestor with at least that many descendants gets materialized union posting list
+#define TAG_CLOSURE_MIN_DESCENDANTS 4
+// Maximal number of tag names which ids are remembered
+#define TAG_ID_CACHE_CAPACITY (1 << 16)
+// When the most selective tag has at most that many files, they are checked against
+// their own tag lists instead of fetching posting lists of other tags
+#define TAG_VERIFY_MAX_FILES 64
+// Store of metadata if none is given with --store
+#define STORE_DEFAULT_URI "mongodb://localhost:27017"
+// Directory with more files lists all tags with their own statistics instead of tags of its files
+#define TAG_FACETS_MAX_FILES (1 << 16)
+// Change streams return after so long without changes, to notice stop
+#define WATCH_AWAIT_MS 1000
+// and are opened again after so long if store refused them, e.g. it is not a replica set
+#define WATCH_RETRY_MS 10000
+// Consecutive inodes which records are kept by the same shard, files created together stay together
+#define SHARD_INODE_RANGE (1 << 16)
+// Inodes reserved by one request to counter in store, mounts of the same file system never share a range
+#define INODE_RESERVE (1 << 10)
+// Seconds for which total of files is kept, it chooses between scan of ordered index and fetch of keys
+#define FILES_COUNT_TTL 10
+// Records of ordered index read by one batch when first files of ordered directory are taken by its scan
+#define ORDER_SCAN_BATCH 1000
+
+static num_t elementToNum(const bsoncxx::document::element &element) {
+    if (!element)
+        return 0;
+    return element.get_int64();
+}
 
-#ifdef DEBUG
-    std::cout << "Splitted: " << splitted << std::endl;
-#endif
+// Canonical key of complete tag set of file: FNV-1a over sorted ids, so that order of path does not matter
+static num_t tagSetHash(numvec tagIds) {
+    std::sort(tagIds.begin(), tagIds.end());
+    tagIds.erase(std::unique(tagIds.begin(), tagIds.end()), tagIds.end());
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto tagId: tagIds) {
+        for (int k = 0; k < 8; k++) {
+            hash ^= (static_cast<uint64_t>(tagId) >> (8 * k)) & 0xff;
+            hash *= 1099511628211ULL;
+        }
+    }
+    return static_cast<num_t>(hash);
+}
 
-    for (auto &tagName: splitted) {
-        auto tag = tagsGet(tagNameToTagid(tagName));
-        if (tag == tag_t{}) {
-            errno = ENOENT;
-            return {res, -1};
+static bool sameTagSet(numvec a, numvec b) {
+    std::sort(a.begin(), a.end());
+    a.erase(std::unique(a.begin(), a.end()), a.end());
+    std::sort(b.begin(), b.end());
+    b.erase(std::unique(b.begin(), b.end()), b.end());
+    return a == b;
+}
+
+static numvec arrayToNumvec(const bsoncxx::document::element &element) {
+    numvec result{};
+    decodeInt64Array(element, result);
+    return result;
+}
+
+// views buffer of caller, valid until the buffer is written again
+static bsoncxx::types::b_array int64Array(const numvec &values, std::vector<uint8_t> &buffer) {
+    return {encodeInt64Array(values, buffer)};
+}
+
+std::pair<tagvec, int> TagFS::parseTags(const char *path, pathvec *components) {
+    tagvec res{};
+    // components are views of path in arena, only names of result tags are copied, as tags outlive request
+    pathvec local{requestArena()};
+    pathvec &splitted = components ? *components : local;
+    splitted = splitPath(path);
+
+    // all components are fetched at once
+    pathvec storedNames{requestArena()};
+    storedNames.reserve(splitted.size());
+    for (size_t k = 0; k < splitted.size(); k++) {
+        num_t from, to;
+        query_order_t order;
+        if (splitted[k] == NAME_DIR)
+            k++;
+        else if (!parseTimeTag(splitted[k], from, to) && !parseOrderTag(splitted[k], order))
+            storedNames.push_back(splitted[k]);
+    }
+    auto found = tagsGetByNames(std::move(storedNames));
+
+    res.reserve(splitted.size());
+    for (size_t k = 0; k < splitted.size(); k++) {
+        auto tagName = splitted[k];
+        num_t from, to;
+        if (parseTimeTag(tagName, from, to)) {
+            res.push_back({TAG_TYPE_TIME, std::string{tagName}});
+            continue;
+        }
+        query_order_t order;
+        if (parseOrderTag(tagName, order)) {
+            res.push_back({TAG_TYPE_ORDER, std::string{tagName}});
+            continue;
+        }
+        // @name alone is the empty root of name lookups
+        if (tagName == NAME_DIR) {
+            res.push_back({TAG_TYPE_NAME, k + 1 < splitted.size() ? std::string{splitted[++k]} : std::string{}});
+            continue;
+        }
+        auto tag = found.find(tagName);
+        if (tag != found.end()) {
+            res.push_back(std::move(tag->second));
+            found.erase(tag);
+            continue;
+        }
+        // tag given twice was already moved to result
+        auto given = std::find_if(res.begin(), res.end(), [&tagName](const tag_t &previous) {
+            return (previous.type == TAG_TYPE_REGULAR || previous.type == TAG_TYPE_FILE) && previous.name == tagName;
+        });
+        if (given != res.end()) {
+            res.push_back(*given);
+            continue;
+        }
+        // typed tag only once some file has its key, so that names with '=' still can be created
+        value_range_t range;
+        if (parseValueTag(tagName, range) && inodeToValueKeyExists(range.key)) {
+            res.push_back({TAG_TYPE_VALUE, std::string{tagName}});
+            continue;
         }
-        res.push_back(tag);
+        errno = ENOENT;
+        return {res, -1};
     }
 
 #ifdef DEBUG
@@ -28,7 +146,167 @@ std::pair<tagvec, int> TagFS::parseTags(const char *path) {
     return {res, 0};
 }
 
+resolved_t TagFS::resolve(const char *path, bool dirInodes) {
+    resolved_t result{};
+    std::tie(result.tags, result.status) = parseTags(path);
+    if (result.status != 0 || result.tags.empty())
+        return result;
+    if (result.tags.back().type != TAG_TYPE_FILE && !dirInodes)
+        return result;
+    if (!dirInodes) {
+        result.inode = exactFileInode(result.tags);
+        if (result.inode != -1) {
+            result.inodes = {result.inode};
+            return result;
+        }
+    }
+
+    result.inodes = getInodesFromTags(result.tags);
+    if (dirInodes && result.tags.back().type != TAG_TYPE_FILE) {
+        query_order_t order;
+        for (const auto &tag: result.tags) {
+            if (tag.type == TAG_TYPE_ORDER)
+                parseOrderTag(tag.name, order);
+        }
+        if (!order.key.empty() || order.limit != -1) {
+            result.ordered = orderInodes(result.inodes, order);
+            result.inodes = {result.ordered.begin(), result.ordered.end()};
+            result.isOrdered = true;
+        }
+    }
+    if (result.inodes.size() == 1)
+        result.inode = *result.inodes.begin();
+    return result;
+}
+
+numvec TagFS::orderInodes(const inodeset &inodes, const query_order_t &order) {
+    size_t limit = order.limit < 0 ? inodes.size() : std::min(inodes.size(), static_cast<size_t>(order.limit));
+    numvec result;
+    result.reserve(limit);
+    // scan of index reads about files / candidates records per file taken, fetch reads a key of every candidate
+    if (!order.key.empty() && order.limit >= 0 && !memory && !inodes.empty() &&
+        static_cast<double>(filesCountEstimate()) * limit < static_cast<double>(inodes.size()) * inodes.size())
+        return orderedScan(inodes, order, limit);
+
+    // keys of all files, only the first ones are sorted; files without key come last by inode like in scan
+    auto take = [&](auto keyOf) {
+        std::vector<std::pair<decltype(keyOf(num_t{})), num_t>> keyed;
+        keyed.reserve(inodes.size());
+        for (auto inode: inodes) {
+            keyed.emplace_back(keyOf(inode), inode);
+        }
+        std::partial_sort(keyed.begin(), keyed.begin() + limit, keyed.end(), [&order](const auto &a, const auto &b) {
+            if (a.first.has_value() != b.first.has_value())
+                return a.first.has_value();
+            if (!a.first.has_value())
+                return a.second < b.second;
+            return order.descending ? b < a : a < b;
+        });
+        for (size_t k = 0; k < limit; k++) {
+            result.push_back(keyed[k].second);
+        }
+    };
+    if (order.key == ORDER_KEY_MTIME) {
+        auto times = inodeToTimeGetMany(numvec{inodes.begin(), inodes.end()});
+        take([&times](num_t inode) {
+            auto it = times.find(inode);
+            return it == times.end() ? std::optional<num_t>{} : it->second;
+        });
+    } else if (order.key == ORDER_KEY_NAME) {
+        auto names = inodetoFilenameGetMany(numvec{inodes.begin(), inodes.end()});
+        take([&names](num_t inode) {
+            auto it = names.find(inode);
+            return it == names.end() ? std::optional<std::string>{} : it->second;
+        });
+    } else {
+        take([](num_t inode) { return std::optional<num_t>{inode}; });
+    }
+    return result;
+}
+
+numvec TagFS::orderedScan(const inodeset &inodes, const query_order_t &order, size_t limit) {
+    // index of every shard is read in order from its start, and shards are merged by key,
+    // so only records up to the last file taken are read
+    bool byTime = order.key == ORDER_KEY_MTIME;
+    if (byTime)
+        commitFlush();
+    auto opts = mongocxx::options::find{};
+    opts.sort(document{} << (byTime ? MTIME : FILENAME) << (order.descending ? -1 : 1) << finalize);
+    opts.projection(document{} << (byTime ? MTIME : FILENAME) << 1 << finalize);
+    opts.batch_size(ORDER_SCAN_BATCH);
+
+    std::vector<mongocxx::cursor> cursors;
+    cursors.reserve(shards.size());
+    for (auto &shard: shards) {
+        cursors.push_back(byTime ? shard.inodeToTime.find({}, opts) : shard.inodetoFilename.find({}, opts));
+    }
+    std::vector<mongocxx::cursor::iterator> positions;
+    for (auto &cursor: cursors) {
+        positions.push_back(cursor.begin());
+    }
+
+    // the next file of directory from every shard
+    typedef struct scan_head_t {
+        num_t time = 0;
+        std::string name{};
+        num_t inode = -1;
+    } scan_head_t;
+    std::vector<scan_head_t> heads(shards.size());
+    auto advance = [&](size_t k) {
+        for (; positions[k] != cursors[k].end(); ++positions[k]) {
+            const auto &doc = *positions[k];
+            num_t inode = doc[_ID].get_int64();
+            if (!inodes.count(inode))
+                continue;
+            heads[k] = {byTime ? doc[MTIME].get_int64().value : 0,
+                        byTime ? std::string{} : doc[FILENAME].get_utf8().value.to_string(), inode};
+            ++positions[k];
+            return;
+        }
+        heads[k].inode = -1;
+    };
+    auto before = [&](const scan_head_t &a, const scan_head_t &b) {
+        bool less = byTime ? a.time < b.time : a.name < b.name;
+        bool greater = byTime ? b.time < a.time : b.name < a.name;
+        return order.descending ? greater : less;
+    };
+    for (size_t k = 0; k < shards.size(); k++) {
+        advance(k);
+    }
+
+    numvec result;
+    result.reserve(limit);
+    while (result.size() < limit) {
+        size_t best = heads.size();
+        for (size_t k = 0; k < heads.size(); k++) {
+            if (heads[k].inode != -1 && (best == heads.size() || before(heads[k], heads[best])))
+                best = k;
+        }
+        if (best == heads.size())
+            break;
+        result.push_back(heads[best].inode);
+        advance(best);
+    }
+
+    // files without record in index come after the others
+    if (result.size() < limit) {
+        inodeset taken{result.begin(), result.end()};
+        numvec rest;
+        for (auto inode: inodes) {
+            if (!taken.count(inode))
+                rest.push_back(inode);
+        }
+        std::sort(rest.begin(), rest.end());
+        rest.resize(std::min(rest.size(), limit - result.size()));
+        result.insert(result.end(), rest.begin(), rest.end());
+    }
+    return result;
+}
+
 num_t TagFS::getFileInode(tagvec& tags) {
+    num_t exact_inode = exactFileInode(tags);
+    if (exact_inode != -1)
+        return exact_inode;
     inodeset file_inode_set = getInodesFromTags(tags);
     if (file_inode_set.size() > 1) {
 #ifdef DEBUG
@@ -52,24 +330,109 @@ std::string TagFS::getFileRealPath(tagvec& tags) {
     return std::to_string(file_inode);
 }
 
+num_t TagFS::getFileSize(num_t inode) {
+    struct stat st{};
+    if (fstatat(fdCache.dirFd(), std::to_string(inode).c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return 0;
+    return st.st_size;
+}
+
 inodeset TagFS::getInodesFromTags(tagvec &tags) {
+    // intersect starting from the most selective tag, tag statistics serve as cardinality estimates;
+    // names are looked up in filename index first, own statistics of tag say nothing about
+    // its descendants, so such tags go later, time and typed tags go last to look up only already selected inodes
+    // modifiers of order select nothing
+    auto planClass = [](const tag_t *tag) {
+        if (tag->type == TAG_TYPE_ORDER)
+            return 3;
+        if (tag->type == TAG_TYPE_NAME)
+            return -1;
+        if (tag->type == TAG_TYPE_TIME || tag->type == TAG_TYPE_VALUE)
+            return 2;
+        return tag->children.empty() ? 0 : 1;
+    };
+    std::vector<const tag_t *> plan;
+    plan.reserve(tags.size());
+    for (const auto &tag: tags) {
+        plan.push_back(&tag);
+    }
+    std::stable_sort(plan.begin(), plan.end(), [&planClass](const tag_t *a, const tag_t *b) {
+        return std::make_pair(planClass(a), a->stats.files) < std::make_pair(planClass(b), b->stats.files);
+    });
+
     inodeset intersect;
     bool i = true;
-    for (const auto &tag: tags) {
-        auto inodes = tagToInodeGet(tagNameToTagid(tag.name));
-//        std::cout << "for tag " << tag.name << " found inodes " << inodes << std::endl;
+    auto intersectWith = [&intersect, &i](const numvec &inodes) {
         if (i) {
             intersect.insert(inodes.begin(), inodes.end());
             i = false;
-        } else {
-            inodeset c;
-            inodeset inodesset{inodes.begin(),  inodes.end()};
-            for (auto& inode : intersect) {
-                if (inodesset.count(inode) > 0) {
-                    c.insert(inode);
-                }
+            return;
+        }
+        inodeset c;
+        inodeset inodesset{inodes.begin(),  inodes.end()};
+        for (auto& inode : intersect) {
+            if (inodesset.count(inode) > 0) {
+                c.insert(inode);
+            }
+        }
+        intersect = std::move(c);
+    };
+
+    const tag_t *firstPlain = nullptr;
+    numvec plainIds;
+    for (const auto *tag: plan) {
+        if (planClass(tag) == -1 && (i || !intersect.empty()))
+            intersectWith(inodetoFilenameFind(tag->name));
+        if (planClass(tag) == 0) {
+            if (!firstPlain)
+                firstPlain = tag;
+            plainIds.push_back(tagNameToTagid(tag->name));
+        }
+    }
+
+    if (!plainIds.empty() && (i || !intersect.empty())) {
+        if (!i ? intersect.size() <= TAG_VERIFY_MAX_FILES
+               : plainIds.size() > 1 && firstPlain->stats.files <= TAG_VERIFY_MAX_FILES) {
+            // few candidates, e.g. files of some name, are checked by their own tag lists
+            // instead of fetching posting lists of tags
+            numvec candidates = i ? tagToInodeGet(plainIds.front()) : numvec{intersect.begin(), intersect.end()};
+            auto checked = plainIds.begin() + (i ? 1 : 0);
+            auto candidateTags = inodeToTagGetMany(candidates);
+            numvec selected;
+            for (auto inode: candidates) {
+                auto &fileTags = candidateTags[inode];
+                if (std::all_of(checked, plainIds.end(), [&fileTags](num_t tagId) {
+                    return std::count(fileTags.begin(), fileTags.end(), tagId) > 0;
+                }))
+                    selected.push_back(inode);
             }
-            intersect = std::move(c);
+            intersect.clear();
+            i = true;
+            intersectWith(selected);
+        } else {
+            // posting lists are streamed chunk by chunk, only chunks in range of candidates are read;
+            // shards narrow candidates by their own tags in parallel
+            auto rest = plainIds.begin();
+            if (i)
+                intersectWith(tagToInodeGet(*rest++));
+            if (rest != plainIds.end() && !intersect.empty())
+                intersect = tagToInodeIntersectMany(numvec{rest, plainIds.end()}, intersect);
+        }
+    }
+
+    for (const auto *tag: plan) {
+        if (!i && intersect.empty())
+            break;
+        if (planClass(tag) <= 0 || planClass(tag) == 3)
+            continue;
+        num_t from, to;
+        value_range_t range;
+        if (tag->type == TAG_TYPE_TIME && !i && parseTimeTag(tag->name, from, to)) {
+            intersectWith(inodeToTimeRange(from, to, numvec{intersect.begin(), intersect.end()}));
+        } else if (tag->type == TAG_TYPE_VALUE && !i && parseValueTag(tag->name, range)) {
+            intersectWith(inodeToValueRange(range, numvec{intersect.begin(), intersect.end()}));
+        } else {
+            intersectWith(tagInodesGet(*tag));
         }
     }
     return intersect;
@@ -77,18 +440,56 @@ inodeset TagFS::getInodesFromTags(tagvec &tags) {
 
 num_t TagFS::getNewInode() {
 //    std::cout << "GetNewInode() -> " << new_inode_counter << std::endl;
+    if (memory || new_inode_counter < new_inode_end)
+        return new_inode_counter++;
+    // other processes may create files of the same file system, ranges are taken from counter in store
+    auto opts = mongocxx::options::find_one_and_update{};
+    opts.upsert(true);
+    opts.return_document(mongocxx::options::return_document::k_after);
+    auto res = db["config"].find_one_and_update(
+            document{} << _ID << INODES << finalize,
+            document{} << INC << open_document << NEXT << num_t{INODE_RESERVE} << close_document << finalize, opts);
+    if (!res) {
+        errno = EIO;
+        return -1;
+    }
+    new_inode_end = res->view()[NEXT].get_int64();
+    new_inode_counter = new_inode_end - INODE_RESERVE;
     return new_inode_counter++;
 }
 
-std::pair<tagvec, int> TagFS::prepareFileCreation(const char *path) {
-    auto[tag_vec, status] = parseTags(path);
+int TagFS::inodeCounterInit(num_t maximum) {
+    new_inode_counter = maximum;
+    new_inode_end = maximum;
+    if (memory)
+        return 0;
+    // file systems made before the counter start it after their greatest inode
+    auto res = db["config"].update_one(document{} << _ID << INODES << finalize,
+                                       document{} << MAX << open_document << NEXT << maximum << close_document << finalize, upsert);
+    if (!res)
+        return -1;
+    return 0;
+}
+
+std::pair<tagvec, int> TagFS::prepareFileCreation(const char *path, pathvec *components) {
+    // path is split once, caller gets its components for name of new file
+    pathvec local{requestArena()};
+    pathvec &tagNames = components ? *components : local;
+    auto[tag_vec, status] = parseTags(path, &tagNames);
 
     // We failed to parse inner component of the path
-    auto tagNames = split(path, "/");
     if (!(status == 0 || tag_vec.size() == tagNames.size() - 1)) {
         errno = ENOENT;
         return {tag_vec, -errno};
     }
+    if (!tagNames.empty() && tagNames.back() == FACETS_FILE) {
+        errno = EPERM;
+        return {tag_vec, -errno};
+    }
+    if (hasVirtualTags(tag_vec)) {
+        errno = EPERM;
+        return {tag_vec, -errno};
+    }
     // Check if combination of existing tags is unique
     if (status == 0) {
         inodeset file_inode_set = getInodesFromTags(tag_vec);
@@ -110,6 +511,17 @@ int TagFS::createNewFileMetaData(tagvec &tags, num_t newInode) {
     fileTag.type = TAG_TYPE_FILE;
     tagsUpdate(tagNameToTagid(fileTag.name), fileTag);
 
+    // inode may already have tags, e.g. on link
+    auto oldTagIds = inodeToTagGet(newInode);
+    auto newTagIds = oldTagIds;
+    for (auto &tag: tags) {
+        auto tagId = tagNameToTagid(tag.name);
+        if (!std::count(newTagIds.begin(), newTagIds.end(), tagId))
+            newTagIds.push_back(tagId);
+    }
+    if (intentBegin(newInode, oldTagIds, newTagIds, fileTag.name) != 0)
+        return -1;
+
     if (inodetoFilenameGet(newInode).empty()) {
 #ifdef DEBUG
         std::cout << "performing insert" << std::endl;
@@ -120,8 +532,10 @@ int TagFS::createNewFileMetaData(tagvec &tags, num_t newInode) {
         inodetoFilenameUpdate(newInode, fileTag.name);
     }
 
+    numvec tagIds;
     for (auto &tag: tags) {
         auto tagId = tagNameToTagid(tag.name);
+        tagIds.push_back(tagId);
         if (tagToInodeFind(tagId)) {
 //            std::cout  << "tagToInodeAddInode(" << tagId << ", " << newInode << ")" << std::endl;
             tagToInodeAddInode(tagId, newInode);
@@ -131,6 +545,7 @@ int TagFS::createNewFileMetaData(tagvec &tags, num_t newInode) {
 #endif
             tagToInodeInsert(tagId, newInode);
         }
+        tagClosureAddInode(tag, newInode);
 
         if (inodeToTagFind(newInode)) {
 #ifdef DEBUG
@@ -147,6 +562,12 @@ int TagFS::createNewFileMetaData(tagvec &tags, num_t newInode) {
             inodeToTagInsert(newInode, tagId);
         }
     }
+    if (!oldTagIds.empty())
+        tagSetToInodeDelete(newInode, oldTagIds);
+    tagSetToInodeSet(newInode, newTagIds);
+    tagStatsUpdate(tagIds, 1, getFileSize(newInode));
+    inodeToTimeRefresh(newInode);
+    intentEnd(newInode);
     return 0;
 }
 
@@ -166,11 +587,16 @@ int TagFS::deleteFileMetaData(tagvec &tags, num_t fileInode) {
 #ifdef DEBUG
     std::cout << "tagNameToTagid done" << std::endl;
 #endif
+    auto fileTagIds = inodeToTagGet(fileInode);
+    if (intentBegin(fileInode, fileTagIds, {}) != 0)
+        return -1;
+    tagStatsUpdate(fileTagIds, -1, -getFileSize(fileInode));
     tagToInodeDeleteInodes({fileInode});
 #ifdef DEBUG
     std::cout << "tagToInodeDeleteInodes done" << std::endl;
 #endif
     inodeToTagDelete(fileInode);
+    tagSetToInodeDelete(fileInode, fileTagIds);
 #ifdef DEBUG
     std::cout << "inodeToTagDelete done" << std::endl;
 #endif
@@ -178,6 +604,9 @@ int TagFS::deleteFileMetaData(tagvec &tags, num_t fileInode) {
 #ifdef DEBUG
     std::cout << "inodetoFilenameDelete done" << std::endl;
 #endif
+    inodeToTimeDelete(fileInode);
+    inodeToValueDelete(fileInode);
+    intentEnd(fileInode);
     auto residualInodes = tagToInodeGet(fileTagId);
     if (residualInodes.empty()) {
         inodeToTagDeleteTags({static_cast<long>(fileTagId)});
@@ -199,21 +628,65 @@ int TagFS::deleteRegularTags(tagvec &tags) {
     }
     std::vector<num_t> tagIds;
     tagIds.reserve(tags.size());
+    // files lose deleted tags, so their complete tag sets change
+    std::unordered_map<num_t, numvec> lostTags;
+    for (auto &tag: tags) {
+        auto tagId = tagNameToTagid(tag.name);
+        for (auto inode: tagToInodeGet(tagId)) {
+            if (inode >= 0)
+                lostTags[inode].push_back(tagId);
+        }
+    }
     for (auto &tag: tags) {
         auto tagId = tagNameToTagid(tag.name);
         tagIds.push_back(tagId);
+        // detach from hierarchy: tag stops implying its parents, children stop implying it
+        if (setTagParents(tag.name, {}) != 0)
+            return -1;
+        for (auto childId: tag.children) {
+            auto child = tagsGet(childId);
+            child.parents.erase(std::remove(child.parents.begin(), child.parents.end(), tagId), child.parents.end());
+            strvec parentNames;
+            for (auto parentId: child.parents) {
+                parentNames.push_back(tagsGet(parentId).name);
+            }
+            setTagParents(child.name, parentNames);
+        }
+        tagClosureDelete(tagId);
         tagToInodeDelete(tagId);
         tagsDelete(tagId);
     }
     inodeToTagDeleteTags(tagIds);
+
+    numvec affected;
+    for (auto &[inode, lost]: lostTags) {
+        affected.push_back(inode);
+    }
+    auto fileTags = inodeToTagGetMany(affected);
+    for (auto &[inode, lost]: lostTags) {
+        auto &kept = fileTags[inode];
+        auto oldTagIds = kept;
+        oldTagIds.insert(oldTagIds.end(), lost.begin(), lost.end());
+        tagSetToInodeDelete(inode, oldTagIds);
+        if (!kept.empty())
+            tagSetToInodeSet(inode, kept);
+    }
     return 0;
 }
 
-int TagFS::createRegularTags(strvec &tagNames) {
+int TagFS::createRegularTags(const pathvec &tagNames) {
     std::vector<num_t> tagIds;
     tagIds.reserve(tagNames.size());
-    for (auto &tagName: tagNames) {
-        auto tagId = tagNameToTagid(tagName);
+    for (auto tagName: tagNames) {
+        num_t from, to;
+        value_range_t range;
+        query_order_t order;
+        if (parseTimeTag(tagName, from, to) || parseOrderTag(tagName, order) || tagName == NAME_DIR || tagName == FACETS_FILE ||
+            (parseValueTag(tagName, range) && inodeToValueKeyExists(range.key))) {
+            errno = EPERM;
+            return -1;
+        }
+        auto tagId = tagNameToTagid(std::string{tagName});
         auto tag = tagsGet(tagId);
         if (!(tag == tag_t{})) {
             errno = EEXIST;
@@ -224,12 +697,19 @@ int TagFS::createRegularTags(strvec &tagNames) {
 
     for (size_t i = 0; i < tagNames.size(); i++) {
         tagToInodeInsert(tagIds[i], -1);
-        tagsAdd({TAG_TYPE_REGULAR, tagNames[i]});
+        tagsAdd({TAG_TYPE_REGULAR, std::string{tagNames[i]}});
     }
     return 0;
 }
 
-void TagFS::initialize(std::string &files_dir) {
+bool TagFS::hasVirtualTags(const tagvec &tags) {
+    return std::any_of(tags.begin(), tags.end(), [](const tag_t &tag) {
+        return tag.type == TAG_TYPE_TIME || tag.type == TAG_TYPE_NAME || tag.type == TAG_TYPE_VALUE ||
+               tag.type == TAG_TYPE_ORDER;
+    });
+}
+
+void TagFS::initialize(std::string &files_dir, bool inMemory, num_t bytesLimit, const strvec &stores) {
     fs_files_dir = files_dir;
     if (!std::filesystem::exists(fs_files_dir)) {
         if (!std::filesystem::create_directories(fs_files_dir)) {
@@ -237,22 +717,59 @@ void TagFS::initialize(std::string &files_dir) {
             std::exit(-1);
         }
     }
-    int rc = chdir(fs_files_dir.c_str());
+    int rc = fdCache.openDir(fs_files_dir);
     if (rc < 0) {
-        std::cerr << "Unable to enter dir" << std::endl;
+        std::cerr << "Unable to open dir" << std::endl;
         std::exit(-1);
     }
+    if (inMemory) {
+        memory = true;
+        mem.bytesLimit = bytesLimit;
+        return;
+    }
     std::string mong_path = "ucutag" + fs_files_dir;
     std::replace(mong_path.begin(), mong_path.end(), '/', '_');
     std::replace(mong_path.begin(), mong_path.end(), '.', '_');
 
 
-    client = mongocxx::client(uri);
-    db = client[mong_path];
+    db_name = mong_path;
+    // every shard has the same database, clients are created in place as collections refer to them
+    strvec uris = stores.empty() ? strvec{STORE_DEFAULT_URI} : stores;
+    shards.resize(uris.size());
+    for (size_t k = 0; k < uris.size(); k++) {
+        auto &shard = shards[k];
+        shard.uri = uris[k];
+        shard.client = mongocxx::client{mongocxx::uri{shard.uri}};
+        shard.db = shard.client[db_name];
+        shard.tagToInode = shard.db["tagToInode"];
+        shard.inodeToTag = shard.db["inodeToTag"];
+        shard.inodetoFilename = shard.db["inodetoFilename"];
+        shard.inodeToTime = shard.db["inodeToTime"];
+        shard.inodeToValue = shard.db["inodeToValue"];
+        shard.tagSetToInode = shard.db["tagSetToInode"];
+    }
+    db = shards.front().db;
     tags = db["tags"];
-    tagToInode = db["tagToInode"];
-    inodeToTag = db["inodeToTag"];
-    inodetoFilename = db["inodetoFilename"];
+    tagClosure = db["tagClosure"];
+    intents = db["intents"];
+    shardsCheckLayout();
+
+    tagToInodeChunkOld();
+    tagClosureChunkOld();
+    inodetoFilenameIndexNames();
+    tagSetToInodeBuild();
+    for (auto &shard: shards) {
+        shard.tagToInode.create_index(document{} << TAG_ID << 1 << CHUNK << 1 << finalize, document{} << "unique" << true << finalize);
+        shard.inodetoFilename.create_index(document{} << FILENAME << 1 << finalize);
+        shard.inodetoFilename.create_index(document{} << LOWER_FILENAME << 1 << finalize);
+        shard.inodeToTime.create_index(document{} << MTIME << 1 << finalize);
+        shard.inodeToValue.create_index(document{} << INODE << 1 << KEY << 1 << finalize, document{} << "unique" << true << finalize);
+        shard.inodeToValue.create_index(document{} << KEY << 1 << NUMBER << 1 << finalize);
+        shard.inodeToValue.create_index(document{} << KEY << 1 << VALUE << 1 << finalize);
+    }
+    tagClosure.create_index(document{} << TAG_ID << 1 << CHUNK << 1 << finalize, document{} << "unique" << true << finalize);
+    tags.create_index(document{} << TAG_NAME << 1 << finalize, document{} << "unique" << true << finalize);
+    intentsRecover();
 }
 
 int TagFS::dropFS() {
@@ -263,207 +780,1605 @@ int TagFS::dropFS() {
         std::cerr << "Error: could not delete " << fs_files_dir << std::endl;
         return 1;
     }
-    db.drop();
+    for (auto &shard: shards) {
+        shard.db.drop();
+    }
     return 0;
 }
 
-TagFS::TagFS() {}
+TagFS::TagFS() {
+    idsOnly.projection(document{} << _ID << 1 << finalize);
+    chunkOrder.sort(document{} << CHUNK << 1 << finalize);
+    upsert.upsert(true);
+}
+
+bool TagFS::isEphemeral() const {
+    return memory;
+}
+
+int TagFS::dataResize(num_t oldSize, num_t newSize) {
+    if (!memory)
+        return 0;
+    return mem.resize(oldSize, newSize);
+}
+
+int TagFS::dataReserve(int fd, num_t end) {
+    if (!memory || mem.bytesLimit == 0)
+        return 0;
+    struct stat st{};
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if (end <= st.st_size)
+        return 0;
+    return mem.resize(st.st_size, end);
+}
 
 
 
 int TagFS::collectionDelete(mongocxx::collection &collection, num_t id) {
-    auto res = collection.delete_one(document{} << _ID << id << finalize);
+    auto res = collection.delete_one(byId(id).view());
     if (!res)
         return -1;
     return 1;
 }
 
+bsoncxx::document::value TagFS::idsIn(const numvec &ids) {
+    std::vector<uint8_t> buffer;
+    auto doc = bsoncxx::builder::basic::document{};
+    doc.append(kvp(IN, int64Array(ids, buffer)));
+    return doc.extract();
+}
 
 
-////////////////////////////////////////////  tags collection manipulation  /////////////////////////////////////////////
+////////////////////////////////////////////  shards  /////////////////////////////////////////////
 
-num_t TagFS::tagNameToTagid(const std::string &tagname) {
-    return (num_t)hasher(tagname);
+size_t TagFS::tagShardIndex(num_t tagId) const {
+    // ids are hashes of names, so tags spread evenly
+    return static_cast<uint64_t>(tagId) % shards.size();
 }
 
-int TagFS::tagsAdd(tag_t tag) {
-    auto tagId = tagNameToTagid(tag.name);
-    bsoncxx::document::value doc_value = document{} <<
-            _ID << tagId << TAG_NAME << tag.name << TAG_TYPE << tag.type << finalize;
-    auto res = tags.insert_one(doc_value.view());
-    if (!res)
-        return -1;
-    return 0;
+size_t TagFS::inodeShardIndex(num_t inode) const {
+    return (static_cast<uint64_t>(inode) / SHARD_INODE_RANGE) % shards.size();
 }
 
-int TagFS::tagsUpdate(num_t tagId, tag_t newTag) {
-    auto res_find = tags.find_one(
-            document{} << _ID << tagId << finalize);
-    if (res_find) {
-        auto res = tags.update_one(document{} << _ID << (ssize_t)tagId << finalize,
-                                   document{} << SET << open_document <<
-                                              TAG_NAME << newTag.name << TAG_TYPE << newTag.type <<
-                                              close_document << finalize);
-        if (!res)
-            return -1;
-        return 0;
-    }
-    return tagsAdd(newTag);
+shard_t &TagFS::tagShard(num_t tagId) {
+    return shards[tagShardIndex(tagId)];
 }
 
-tag_t TagFS::tagsGet(num_t tagId) {
-    auto res = tags.find_one(
-            document{} << _ID << tagId << finalize);
-#ifdef DEBUG
-    std::cout << "Tag id: " << tagId << std::endl;
-#endif
-    if(res) {
-        bsoncxx::document::view view = res->view();
-        return { .type=view[TAG_TYPE].get_int64(),
-                 .name=view[TAG_NAME].get_utf8().value.to_string(), };
-    }
-    return {};
+shard_t &TagFS::inodeShard(num_t inode) {
+    return shards[inodeShardIndex(inode)];
 }
 
-int TagFS::tagsDelete(num_t tagId) {
-    return collectionDelete(tags, tagId);
+std::map<size_t, numvec> TagFS::inodesByShard(const numvec &inodes) {
+    std::map<size_t, numvec> result;
+    for (auto inode: inodes) {
+        result[inodeShardIndex(inode)].push_back(inode);
+    }
+    return result;
 }
 
-
-strvec TagFS::tagNamesByTagType(num_t type) {
-    strvec result;
-    mongocxx::cursor cursor = tags.find(
-            document{} << TAG_TYPE << type << finalize);
-    for(const auto &doc : cursor) {
-        result.push_back(doc[TAG_NAME].get_utf8().value.to_string());
+std::map<size_t, numvec> TagFS::tagsByShard(const numvec &tagIds) {
+    std::map<size_t, numvec> result;
+    for (auto tagId: tagIds) {
+        result[tagShardIndex(tagId)].push_back(tagId);
     }
     return result;
 }
 
-
-//////////////////////////////////////////  tags collection manipulation  /////////////////////////////////////////////
-int TagFS::tagToInodeInsert(num_t tagId, num_t inode) {
-//    bsoncxx::document::value doc_value;
-    bsoncxx::stdx::optional<mongocxx::result::insert_one> res;
-    if (inode >= 0) {
-        auto doc_value = document{} << _ID << tagId << INODES << open_array << inode << close_array << finalize;
-        res = tagToInode.insert_one( doc_value.view() );
+void TagFS::shardsCheckLayout() {
+    // placement depends on number of shards only, so stores may move, but not be added or removed
+    auto config = db["config"];
+    auto res = config.find_one(document{} << _ID << STORES << finalize);
+    size_t created = 0;
+    if (res) {
+        for (const auto &it: res->view()[STORES].get_array().value) {
+            (void) it;
+            created++;
+        }
+    } else if (tags.estimated_document_count() != 0) {
+        // file system of one store, made before shards existed
+        created = 1;
     }
-    else {
-        auto doc_value = document{} << _ID << tagId << INODES << open_array << close_array << finalize;
-        res = tagToInode.insert_one( doc_value.view() );
+    if (created != 0 && created != shards.size()) {
+        std::cerr << "Error: file system is kept in " << created << " stores, but " << shards.size()
+                  << " are given" << std::endl;
+        std::exit(1);
     }
-    if (!res)
-        return -1;
-    return 0;
+    auto uris = bsoncxx::builder::basic::array{};
+    for (const auto &shard: shards) {
+        uris.append(shard.uri);
+    }
+    config.update_one(document{} << _ID << STORES << finalize,
+                      document{} << SET << open_document << STORES << uris.view() << close_document << finalize, upsert);
 }
 
-int TagFS::tagToInodeUpdate(num_t tagId, const numvec &inodes) {
-    auto inodes_arr = bsoncxx::builder::basic::document{};
-    inodes_arr.append(kvp(TAGS, [&inodes](sub_array child) {
-        for (const auto& inode : inodes) {
-            child.append(inode);
-        }
-    }));
-    auto res = inodeToTag.update_one(document{} << _ID << tagId << finalize, inodes_arr.view());
+bool TagFS::intentsNeeded() const {
+    return !memory && shards.size() > 1;
+}
+
+int TagFS::intentBegin(num_t inode, const numvec &fromTagIds, const numvec &toTagIds, const std::string &filename) {
+    if (!intentsNeeded())
+        return 0;
+    auto fields = bsoncxx::builder::basic::document{};
+    std::vector<uint8_t> fromBuffer, toBuffer;
+    fields.append(kvp(FROM, int64Array(fromTagIds, fromBuffer)));
+    fields.append(kvp(TO, int64Array(toTagIds, toBuffer)));
+    if (!filename.empty())
+        fields.append(kvp(FILENAME, filename));
+    auto res = intents.update_one(byId(inode).view(),
+                                  document{} << SET << fields.view() << finalize, upsert);
     if (!res)
         return -1;
     return 0;
 }
 
-bool TagFS::tagToInodeFind(num_t tagId) {
-    auto res = tagToInode.find_one(
-            document{} << _ID << tagId << finalize);
-    if(res) {
-        return true;
-    }
-    return false;
+void TagFS::intentEnd(num_t inode) {
+    if (intentsNeeded())
+        intents.delete_one(byId(inode).view());
 }
 
-numvec TagFS::tagToInodeGet(num_t tagId) {
-    auto res = tagToInode.find_one(
-            document{} << _ID << tagId << finalize);
-    if(res) {
-        auto view = res->view();
-        auto arr_value = view[INODES].get_array().value;
-
-        numvec result{};
-        for (const auto &it: arr_value) {
-            result.push_back(it.get_int64());
+void TagFS::intentsRecover() {
+    // every step is idempotent, so intent is replayed as a whole however far it got;
+    // statistics of tags are estimates and are not replayed
+    for (const auto &doc: intents.find({})) {
+        num_t inode = doc[_ID].get_int64();
+        auto fromTagIds = arrayToNumvec(doc[FROM]);
+        auto toTagIds = arrayToNumvec(doc[TO]);
+        inodeset toSet{toTagIds.begin(), toTagIds.end()};
+        inodeset keptClosures;
+        for (auto tagId: toTagIds) {
+            if (!tagToInodeFind(tagId))
+                tagToInodeInsert(tagId, inode);
+            else
+                tagToInodePatch(tagId, {inode}, {});
+            auto tag = tagsGet(tagId);
+            keptClosures.insert(tag.closures.begin(), tag.closures.end());
+            tagClosureAddInode(tag, inode);
         }
-        return result;
-//        return numvec{arr_value.begin(), arr_value.end()};
+        numvec leftClosures;
+        for (auto tagId: fromTagIds) {
+            if (toSet.count(tagId))
+                continue;
+            tagToInodePatch(tagId, {}, {inode});
+            for (auto closureId: tagsGet(tagId).closures) {
+                if (!keptClosures.count(closureId))
+                    leftClosures.push_back(closureId);
+            }
+        }
+        tagClosureRemoveInode(leftClosures, inode);
+
+        tagSetToInodeDelete(inode, fromTagIds);
+        if (!toTagIds.empty())
+            tagSetToInodeSet(inode, toTagIds);
+
+        auto &shard = inodeShard(inode);
+        if (toTagIds.empty()) {
+            collectionDelete(shard.inodeToTag, inode);
+            collectionDelete(shard.inodetoFilename, inode);
+            collectionDelete(shard.inodeToTime, inode);
+            shard.inodeToValue.delete_many(byInode(inode).view());
+        } else {
+            std::vector<uint8_t> buffer;
+            auto fileTags = bsoncxx::builder::basic::document{};
+            fileTags.append(kvp(TAGS, int64Array(toTagIds, buffer)));
+            shard.inodeToTag.update_one(byId(inode).view(),
+                                        document{} << SET << fileTags.view() << finalize, upsert);
+            if (doc[FILENAME]) {
+                auto filename = doc[FILENAME].get_utf8().value.to_string();
+                shard.inodetoFilename.update_one(byId(inode).view(),
+                        document{} << SET << open_document << FILENAME << filename
+                                   << LOWER_FILENAME << toLower(filename) << close_document << finalize, upsert);
+            }
+        }
+        intents.delete_one(byId(inode).view());
     }
-    return {};
 }
 
-int TagFS::tagToInodeDelete(num_t tagId) {
-    return collectionDelete(tagToInode, tagId);
-}
 
-int TagFS::tagToInodeAddInode(num_t tagId, num_t inode) {
-    auto res = tagToInode.update_one(
-            document{} << _ID << tagId << finalize,
-            document{} << PUSH << open_document << INODES << inode << close_document << finalize);
-    if (!res)
-        return -1;
-    return 0;
+////////////////////////////////////////////  group commit  /////////////////////////////////////////////
+// last ticket of mutations queued by request running on this thread
+static thread_local num_t commitTicket = 0;
+
+void TagFS::startCommitter(num_t windowMicros, num_t batchMax) {
+    if (memory || committer.joinable() || windowMicros <= 0)
+        return;
+    commitWindow = std::chrono::microseconds{windowMicros};
+    commitBatch = static_cast<size_t>(std::max<num_t>(batchMax, 1));
+    commitStop = false;
+    committer = std::thread(&TagFS::commitLoop, this);
 }
 
-int TagFS::tagToInodeDeleteInodes(const numvec &inodes) {
-    auto doc = bsoncxx::builder::basic::document{};
-    doc.append(kvp(IN, [&inodes](sub_array child) {
-        for (const auto& inode : inodes) {
-            child.append(inode);
-        }
-    }));
-    auto pull_query_finalized = document{} << PULL << open_document << INODES << doc << close_document << finalize;
+void TagFS::stopCommitter() {
+    if (!committer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock{commitMutex};
+        commitStop = true;
+    }
+    commitWakeup.notify_one();
+    committer.join();
+}
 
-    auto res = tagToInode.update_many({}, pull_query_finalized.view());
+int TagFS::commitWrite(commit_op_t op) {
+    if (!committer.joinable()) {
+        // fsck, dump, restore and applications linking the library have no committer
+        auto collection = shards[op.shard].db[op.collection];
+        auto opts = mongocxx::options::update{};
+        opts.upsert(op.upsert);
+        auto res = op.many ? collection.update_many(op.filter.view(), op.update.view(), opts)
+                           : collection.update_one(op.filter.view(), op.update.view(), opts);
+        if (!res)
+            return -1;
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock{commitMutex};
+        commitQueue.push_back(std::move(op));
+        commitTicket = ++commitEnqueued;
+    }
+    commitWakeup.notify_one();
+    return 0;
+}
 
-    if (!res)
+int TagFS::commitWait() {
+    num_t ticket = commitTicket;
+    if (ticket == 0)
+        return 0;
+    commitTicket = 0;
+    std::unique_lock<std::mutex> lock{commitMutex};
+    commitDone.wait(lock, [this, ticket]() { return commitCommitted >= ticket; });
+    auto failed = commitFailed.upper_bound(ticket);
+    if (failed != commitFailed.begin() && std::prev(failed)->second >= ticket) {
+        errno = EIO;
         return -1;
+    }
     return 0;
 }
 
+void TagFS::commitFlush() {
+    if (!committer.joinable())
+        return;
+    std::unique_lock<std::mutex> lock{commitMutex};
+    num_t ticket = commitEnqueued;
+    if (commitCommitted >= ticket)
+        return;
+    commitFlushTo = std::max(commitFlushTo, ticket);
+    commitWakeup.notify_one();
+    commitDone.wait(lock, [this, ticket]() { return commitCommitted >= ticket; });
+}
 
-//////////////////////////////////////////  InodeToTag collection manipulation  /////////////////////////////////////////////
-
-int TagFS::inodeToTagInsert(num_t inode, num_t tagsId) {
-    bsoncxx::stdx::optional<mongocxx::result::insert_one> res;
-    auto doc_value = document{} << _ID << inode << TAGS << open_array << tagsId << close_array << finalize;
-    res = inodeToTag.insert_one( doc_value.view() );
-    if (!res)
-        return -1;
-    return 0;
+commit_stats_t TagFS::commitStatistics() {
+    std::lock_guard<std::mutex> lock{commitMutex};
+    return commitStats;
 }
 
-int TagFS::inodeToTagUpdate(num_t inode, const numvec &tagsIds) {
-    auto tags = bsoncxx::builder::basic::document{};
-    tags.append(kvp(TAGS, [&tagsIds](sub_array child) {
-        for (const auto& tagid : tagsIds) {
-            child.append(tagid);
+void TagFS::commitLoop() {
+    // own connection to every shard, catalog collections are on the first one
+    std::vector<mongocxx::client> clients;
+    for (const auto &shard: shards) {
+        clients.emplace_back(mongocxx::uri{shard.uri});
+    }
+    std::unique_lock<std::mutex> lock{commitMutex};
+    while (true) {
+        commitWakeup.wait(lock, [this]() { return commitStop || !commitQueue.empty(); });
+        if (commitQueue.empty())
+            return;
+        // mutations of other requests join the batch within the window, unless someone waits for all of them
+        commitWakeup.wait_for(lock, commitWindow, [this]() {
+            return commitStop || commitQueue.size() >= commitBatch || commitFlushTo > commitCommitted;
+        });
+        size_t count = std::min(commitQueue.size(), commitBatch);
+        std::vector<commit_op_t> batch{std::make_move_iterator(commitQueue.begin()),
+                                       std::make_move_iterator(commitQueue.begin() + count)};
+        commitQueue.erase(commitQueue.begin(), commitQueue.begin() + count);
+        num_t first = commitCommitted + 1;
+        lock.unlock();
+
+        // one ordered bulk write per collection, mutations of different collections don't depend on each other
+        std::map<std::pair<size_t, std::string>, std::vector<mongocxx::model::write>> writes;
+        for (const auto &op: batch) {
+            auto &models = writes[{op.shard, op.collection}];
+            if (op.many)
+                models.emplace_back(mongocxx::model::update_many(op.filter.view(), op.update.view()).upsert(op.upsert));
+            else
+                models.emplace_back(mongocxx::model::update_one(op.filter.view(), op.update.view()).upsert(op.upsert));
+        }
+        bool failed = false;
+        for (auto &[target, models]: writes) {
+            try {
+                if (!clients[target.first][db_name][target.second].bulk_write(models))
+                    failed = true;
+            } catch (std::exception &e) {
+#ifdef DEBUG
+                std::cerr << "commit to " << target.second << " failed: " << e.what() << std::endl;
+#endif
+                failed = true;
+            }
         }
-    }));
-    auto res = inodeToTag.update_one(document{} << _ID << inode << finalize, tags.view());
 
-    if (!res)
-        return -1;
-    return 0;
+        lock.lock();
+        commitCommitted = first + static_cast<num_t>(count) - 1;
+        commitStats.batches++;
+        commitStats.operations += static_cast<num_t>(count);
+        commitStats.largest = std::max<num_t>(commitStats.largest, static_cast<num_t>(count));
+        if (failed) {
+            commitFailed.emplace(first, commitCommitted);
+            commitStats.failed++;
+        }
+        commitDone.notify_all();
+    }
 }
 
-bool TagFS::inodeToTagFind(num_t inode) {
-    auto res = inodeToTag.find_one(
-            document{} << _ID << inode << finalize);
-    if(res) {
-        return true;
+
+////////////////////////////////////////////  change streams  /////////////////////////////////////////////
+void TagFS::startWatching() {
+    if (memory || !watchers.empty())
+        return;
+    watchStop = false;
+    for (size_t k = 0; k < shards.size(); k++) {
+        watchers.emplace_back(&TagFS::watchLoop, this, k);
     }
-    return false;
 }
 
-numvec TagFS::inodeToTagGet(num_t inode) {
-    auto res = inodeToTag.find_one(
-            document{} << _ID << inode << finalize);
+void TagFS::stopWatching() {
+    {
+        std::lock_guard<std::mutex> lock{watchMutex};
+        watchStop = true;
+    }
+    watchWakeup.notify_all();
+    for (auto &watcher: watchers) {
+        watcher.join();
+    }
+    watchers.clear();
+}
+
+void TagFS::watchLoop(size_t index) {
+    // own connection, stream waits on server for changes
+    mongocxx::client client{mongocxx::uri{shards[index].uri}};
+    auto database = client[db_name];
+
+    // only changes which make something cached stale; stats of tags change on every write and are not cached
+    mongocxx::pipeline pipeline;
+    pipeline.match(document{} << OR << open_array
+            << open_document << "ns.coll" << "tags" << "operationType" << open_document
+                    << IN << open_array << "delete" << "replace" << close_array << close_document << close_document
+            << open_document << "ns.coll" << "tags" << "updateDescription.updatedFields." + TAG_NAME << open_document
+                    << "$exists" << true << close_document << close_document
+            << open_document << "ns.coll" << "inodeToTag" << "operationType" << "delete" << close_document
+            << open_document << "operationType" << open_document
+                    << IN << open_array << "drop" << "dropDatabase" << "invalidate" << close_array << close_document << close_document
+            << close_array << finalize);
+
+    bsoncxx::stdx::optional<bsoncxx::document::value> resumeToken;
+    bool reported = false;
+    while (!watchStop) {
+        try {
+            auto opts = mongocxx::options::change_stream{};
+            opts.max_await_time(std::chrono::milliseconds{WATCH_AWAIT_MS});
+            if (resumeToken)
+                opts.resume_after(resumeToken->view());
+            auto stream = database.watch(pipeline, opts);
+            bool reopen = false;
+            while (!watchStop && !reopen) {
+                for (const auto &event: stream) {
+                    if (!watchApply(event)) {
+                        // stream ends after drop of database, the next one starts from now on
+                        resumeToken = {};
+                        reopen = true;
+                        break;
+                    }
+                    resumeToken = bsoncxx::document::value{event[_ID].get_document().value};
+                }
+            }
+            continue;
+        } catch (std::exception &e) {
+            // caches stay as they are without the stream, coherent for the only process
+            if (!reported)
+                std::cerr << "Warning: no change stream of " << shards[index].uri
+                          << ", changes of other processes are not seen: " << e.what() << std::endl;
+            reported = true;
+        }
+        std::unique_lock<std::mutex> lock{watchMutex};
+        watchWakeup.wait_for(lock, std::chrono::milliseconds{WATCH_RETRY_MS}, [this]() { return watchStop.load(); });
+    }
+}
+
+bool TagFS::watchApply(const bsoncxx::document::view &event) {
+    // only cache of tag ids belongs to handlers, descriptors are cached under own lock
+    auto type = event["operationType"].get_utf8().value.to_string();
+#ifdef DEBUG
+    std::cout << " >>> change: " << bsoncxx::to_json(event) << std::endl;
+#endif
+    if (type == "drop" || type == "dropDatabase" || type == "invalidate") {
+        fdCache.clear();
+        std::lock_guard<std::mutex> lock{apiMutex};
+        tagIdCache.clear();
+        return type != "invalidate";
+    }
+    auto collection = event["ns"]["coll"].get_utf8().value.to_string();
+    num_t id = event["documentKey"][_ID].get_int64();
+    if (collection == "tags") {
+        // tag was renamed or deleted, cache is by names
+        std::lock_guard<std::mutex> lock{apiMutex};
+        for (auto it = tagIdCache.begin(); it != tagIdCache.end();) {
+            it = it->second == id ? tagIdCache.erase(it) : std::next(it);
+        }
+    } else {
+        // file was removed, its descriptor must not be given out
+        fdCache.forget(id);
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////  tags collection manipulation  /////////////////////////////////////////////
+
+// Id of tag does not change on rename, name is just its attribute looked up by index.
+// New tag gets hash of its name, unless it is held by a renamed tag
+num_t TagFS::tagNameToTagid(const std::string &tagname) {
+    auto cached = tagIdCache.find(tagname);
+    if (cached != tagIdCache.end())
+        return cached->second;
+
+    if (memory) {
+        auto it = mem.tagNames.find(tagname);
+        if (it != mem.tagNames.end()) {
+            tagIdCacheSet(tagname, it->second);
+            return it->second;
+        }
+    } else {
+        auto res = tags.find_one(document{} << TAG_NAME << tagname << finalize, idsOnly);
+        if (res) {
+            num_t tagId = res->view()[_ID].get_int64();
+            tagIdCacheSet(tagname, tagId);
+            return tagId;
+        }
+    }
+
+    auto tagId = (num_t)hasher(tagname);
+    while (tagIdTaken(tagId))
+        tagId++;
+    return tagId;
+}
+
+bool TagFS::tagIdTaken(num_t tagId) {
+    if (memory)
+        return mem.tags.count(tagId) > 0;
+    return static_cast<bool>(tags.find_one(byId(tagId).view(), idsOnly));
+}
+
+void TagFS::tagIdCacheSet(const std::string &tagname, num_t tagId) {
+    if (tagIdCache.size() >= TAG_ID_CACHE_CAPACITY)
+        tagIdCache.clear();
+    tagIdCache[tagname] = tagId;
+}
+
+int TagFS::tagsAdd(tag_t tag) {
+    auto tagId = tagNameToTagid(tag.name);
+    if (memory) {
+        if (!mem.tags.emplace(tagId, tag_t{tag.type, tag.name}).second)
+            return -1;
+        mem.tagNames[tag.name] = tagId;
+        tagIdCacheSet(tag.name, tagId);
+        return 0;
+    }
+    bsoncxx::document::value doc_value = document{} <<
+            _ID << tagId << TAG_NAME << tag.name << TAG_TYPE << tag.type << finalize;
+    auto res = tags.insert_one(doc_value.view());
+    if (!res)
+        return -1;
+    tagIdCacheSet(tag.name, tagId);
+    return 0;
+}
+
+int TagFS::tagsUpdate(num_t tagId, tag_t newTag) {
+    if (memory) {
+        auto it = mem.tags.find(tagId);
+        if (it == mem.tags.end())
+            return tagsAdd(newTag);
+        it->second.type = newTag.type;
+        return it->second.name == newTag.name ? 0 : tagsRename(tagId, newTag.name);
+    }
+    auto res_find = tags.find_one(
+            byId(tagId).view());
+    if (res_find) {
+        tagIdCache.erase(res_find->view()[TAG_NAME].get_utf8().value.to_string());
+        auto res = tags.update_one(byId(tagId).view(),
+                                   document{} << SET << open_document <<
+                                              TAG_NAME << newTag.name << TAG_TYPE << newTag.type <<
+                                              close_document << finalize);
+        if (!res)
+            return -1;
+        return 0;
+    }
+    return tagsAdd(newTag);
+}
+
+tag_t TagFS::tagsGet(num_t tagId) {
+    if (memory) {
+        auto it = mem.tags.find(tagId);
+        return it == mem.tags.end() ? tag_t{} : it->second;
+    }
+    auto res = tags.find_one(
+            byId(tagId).view());
+#ifdef DEBUG
+    std::cout << "Tag id: " << tagId << std::endl;
+#endif
+    if(res) {
+        return tagFromDocument(res->view());
+    }
+    return {};
+}
+
+tag_t TagFS::tagsGetByName(const std::string &tagname) {
+    auto cached = tagIdCache.find(tagname);
+    if (cached != tagIdCache.end())
+        return tagsGet(cached->second);
+    if (memory) {
+        auto it = mem.tagNames.find(tagname);
+        return it == mem.tagNames.end() ? tag_t{} : tagsGet(it->second);
+    }
+    auto res = tags.find_one(
+            document{} << TAG_NAME << tagname << finalize);
+    if (res) {
+        tagIdCacheSet(tagname, res->view()[_ID].get_int64());
+        return tagFromDocument(res->view());
+    }
+    return {};
+}
+
+std::pmr::map<std::string_view, tag_t> TagFS::tagsGetByNames(pathvec tagnames) {
+    std::pmr::map<std::string_view, tag_t> result{requestArena()};
+    if (tagnames.empty())
+        return result;
+    if (memory) {
+        for (auto tagname: tagnames) {
+            auto tag = tagsGetByName(std::string{tagname});
+            if (!(tag == tag_t{}))
+                result.emplace(tagname, std::move(tag));
+        }
+        return result;
+    }
+    // found tags are keyed by given views, which outlive the names of documents
+    std::sort(tagnames.begin(), tagnames.end());
+    auto names = bsoncxx::builder::basic::document{};
+    names.append(kvp(IN, [&tagnames](sub_array child) {
+        for (const auto &tagname: tagnames) {
+            child.append(tagname);
+        }
+    }));
+    for (const auto &doc: tags.find(document{} << TAG_NAME << names.view() << finalize)) {
+        auto tag = tagFromDocument(doc);
+        tagIdCacheSet(tag.name, doc[_ID].get_int64());
+        auto given = std::lower_bound(tagnames.begin(), tagnames.end(), std::string_view{tag.name});
+        if (given != tagnames.end() && *given == tag.name)
+            result.emplace(*given, std::move(tag));
+    }
+    return result;
+}
+
+std::unordered_map<num_t, tag_t> TagFS::tagsGetMany(const numvec &tagIds) {
+    std::unordered_map<num_t, tag_t> result;
+    if (tagIds.empty())
+        return result;
+    if (memory) {
+        for (auto tagId: tagIds) {
+            auto it = mem.tags.find(tagId);
+            if (it != mem.tags.end())
+                result.emplace(tagId, it->second);
+        }
+        return result;
+    }
+    for (const auto &doc: tags.find(document{} << _ID << idsIn(tagIds).view() << finalize)) {
+        result.emplace(doc[_ID].get_int64(), tagFromDocument(doc));
+    }
+    return result;
+}
+
+tag_t TagFS::tagFromDocument(const bsoncxx::document::view &view) {
+    return { .type=view[TAG_TYPE].get_int64(),
+             .name=view[TAG_NAME].get_utf8().value.to_string(),
+             .parents=arrayToNumvec(view[PARENTS]),
+             .children=arrayToNumvec(view[CHILDREN]),
+             .closures=arrayToNumvec(view[CLOSURES]),
+             .stats={ .files=elementToNum(view[FILES]),
+                      .bytes=elementToNum(view[BYTES]),
+                      .mtime=elementToNum(view[MTIME]), }, };
+}
+
+int TagFS::tagsDelete(num_t tagId) {
+    if (memory) {
+        auto it = mem.tags.find(tagId);
+        if (it == mem.tags.end())
+            return 0;
+        tagIdCache.erase(it->second.name);
+        mem.tagNames.erase(it->second.name);
+        mem.tags.erase(it);
+        return 1;
+    }
+    auto res = tags.find_one_and_delete(byId(tagId).view());
+    if (!res)
+        return 0;
+    tagIdCache.erase(res->view()[TAG_NAME].get_utf8().value.to_string());
+    return 1;
+}
+
+int TagFS::tagsRename(num_t tagId, const std::string &newName) {
+    if (memory) {
+        auto it = mem.tags.find(tagId);
+        if (it == mem.tags.end())
+            return -1;
+        tagIdCache.erase(it->second.name);
+        mem.tagNames.erase(it->second.name);
+        it->second.name = newName;
+        mem.tagNames[newName] = tagId;
+        return 0;
+    }
+    // document before update carries the old name
+    auto res = tags.find_one_and_update(
+            document{} << _ID << tagId << finalize,
+            document{} << SET << open_document << TAG_NAME << newName << close_document << finalize);
+    if (!res)
+        return -1;
+    tagIdCache.erase(res->view()[TAG_NAME].get_utf8().value.to_string());
+    return 0;
+}
+
+
+int TagFS::tagStatsUpdate(const numvec &tagIds, num_t files, num_t bytes) {
+    if (tagIds.empty())
+        return 0;
+    if (memory) {
+        for (auto tagId: tagIds) {
+            auto it = mem.tags.find(tagId);
+            if (it == mem.tags.end())
+                continue;
+            it->second.stats.files += files;
+            it->second.stats.bytes += bytes;
+            it->second.stats.mtime = static_cast<num_t>(time(nullptr));
+        }
+        return 0;
+    }
+    return commitWrite({0, "tags", true, false,
+                        document{} << _ID << idsIn(tagIds).view() << finalize,
+                        document{} << INC << open_document << FILES << files << BYTES << bytes << close_document <<
+                                      SET << open_document << MTIME << static_cast<num_t>(time(nullptr)) << close_document << finalize});
+}
+
+tag_stat_t TagFS::tagStatsGet(num_t tagId) {
+    return tagsGet(tagId).stats;
+}
+
+tag_stat_t TagFS::tagSetStats(tagvec &tags) {
+    // exact numbers for the set would need intersection, most selective tag bounds them instead
+    tag_stat_t result{};
+    bool first = true;
+    for (auto &tag: tags) {
+        if (tag.type == TAG_TYPE_TIME || tag.type == TAG_TYPE_NAME || tag.type == TAG_TYPE_VALUE ||
+            tag.type == TAG_TYPE_ORDER)
+            continue;
+        if (first || tag.stats.files < result.files) {
+            result = tag.stats;
+            first = false;
+        }
+    }
+    return result;
+}
+
+num_t TagFS::filesCountEstimate() {
+    // listing does not pay a request to every shard just to choose its plan
+    auto now = std::chrono::steady_clock::now();
+    if (now - filesCountAt > std::chrono::seconds{FILES_COUNT_TTL}) {
+        filesCountCached = filesCount();
+        filesCountAt = now;
+    }
+    return filesCountCached;
+}
+
+num_t TagFS::filesCount() {
+    if (memory)
+        return static_cast<num_t>(mem.inodetoFilename.size());
+    num_t count = 0;
+    for (auto &shard: shards) {
+        count += static_cast<num_t>(shard.inodetoFilename.estimated_document_count());
+    }
+    return count;
+}
+
+std::map<std::string, num_t> TagFS::tagFacets(const tagvec &pathTags, const inodeset &inodes) {
+    // only tags which lead to some of the files are offered, counted by tags of the files themselves
+    std::map<std::string, num_t> result;
+    std::unordered_set<std::string> pathNames;
+    for (const auto &tag: pathTags) {
+        pathNames.insert(tag.name);
+    }
+    if (pathTags.empty() || inodes.size() > TAG_FACETS_MAX_FILES) {
+        // root, or too many files to read their tags: every tag having files, counted by own statistics
+        auto offer = [&](const tag_t &tag) {
+            if (tag.type == TAG_TYPE_REGULAR && tag.stats.files > 0 && !pathNames.count(tag.name))
+                result[tag.name] = tag.stats.files;
+        };
+        if (memory) {
+            for (const auto &[tagId, tag]: mem.tags) {
+                offer(tag);
+            }
+        } else {
+            for (const auto &doc: tags.find(document{} << TAG_TYPE << TAG_TYPE_REGULAR
+                                                       << FILES << open_document << GT << 0 << close_document << finalize)) {
+                offer(tagFromDocument(doc));
+            }
+        }
+        return result;
+    }
+
+    auto fileTags = inodeToTagGetMany(numvec{inodes.begin(), inodes.end()});
+    numvec missing;
+    inodeset seen;
+    for (const auto &[inode, tagIds]: fileTags) {
+        for (auto tagId: tagIds) {
+            if (seen.insert(tagId).second)
+                missing.push_back(tagId);
+        }
+    }
+    // files are also under ancestors of their tags, fetched level by level
+    std::unordered_map<num_t, tag_t> known;
+    while (!missing.empty()) {
+        auto level = tagsGetMany(missing);
+        missing.clear();
+        for (auto &[tagId, tag]: level) {
+            for (auto parentId: tag.parents) {
+                if (seen.insert(parentId).second)
+                    missing.push_back(parentId);
+            }
+            known.emplace(tagId, std::move(tag));
+        }
+    }
+
+    for (const auto &[inode, tagIds]: fileTags) {
+        inodeset reached;
+        numvec frontier{tagIds.begin(), tagIds.end()};
+        while (!frontier.empty()) {
+            num_t tagId = frontier.back();
+            frontier.pop_back();
+            auto tag = known.find(tagId);
+            if (tag == known.end() || !reached.insert(tagId).second)
+                continue;
+            if (tag->second.type == TAG_TYPE_REGULAR && !pathNames.count(tag->second.name))
+                result[tag->second.name]++;
+            frontier.insert(frontier.end(), tag->second.parents.begin(), tag->second.parents.end());
+        }
+    }
+    return result;
+}
+
+strvec TagFS::tagNamesByTagType(num_t type) {
+    strvec result;
+    if (memory) {
+        for (const auto &[tagId, tag]: mem.tags) {
+            if (tag.type == type)
+                result.push_back(tag.name);
+        }
+        return result;
+    }
+    mongocxx::cursor cursor = tags.find(
+            document{} << TAG_TYPE << type << finalize);
+    for(const auto &doc : cursor) {
+        result.push_back(doc[TAG_NAME].get_utf8().value.to_string());
+    }
+    return result;
+}
+
+
+////////////////////////////////////////////  tags hierarchy manipulation  /////////////////////////////////////////////
+
+numvec TagFS::tagRelatives(num_t tagId, const std::string &relation) {
+    // breadth first search, one query per level of hierarchy
+    numvec result{};
+    inodeset visited{tagId};
+    numvec frontier{tagId};
+    while (!frontier.empty()) {
+        numvec next{};
+        auto visit = [&](const numvec &relatives) {
+            for (auto relativeId: relatives) {
+                if (visited.insert(relativeId).second) {
+                    result.push_back(relativeId);
+                    next.push_back(relativeId);
+                }
+            }
+        };
+        if (memory) {
+            for (auto id: frontier) {
+                auto it = mem.tags.find(id);
+                if (it != mem.tags.end())
+                    visit(relation == PARENTS ? it->second.parents : it->second.children);
+            }
+        } else {
+            mongocxx::cursor cursor = tags.find(document{} << _ID << idsIn(frontier).view() << finalize);
+            for (const auto &doc: cursor) {
+                visit(arrayToNumvec(doc[relation]));
+            }
+        }
+        frontier = std::move(next);
+    }
+    return result;
+}
+
+numvec TagFS::tagDescendants(num_t tagId) {
+    return tagRelatives(tagId, CHILDREN);
+}
+
+numvec TagFS::tagAncestors(num_t tagId) {
+    return tagRelatives(tagId, PARENTS);
+}
+
+int TagFS::setTagParents(const std::string &tagName, const strvec &parentNames) {
+    auto tagId = tagNameToTagid(tagName);
+    auto tag = tagsGet(tagId);
+    if (tag == tag_t{}) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (tag.type != TAG_TYPE_REGULAR) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    numvec parentIds;
+    auto descendants = tagDescendants(tagId);
+    for (auto &parentName: parentNames) {
+        auto parentId = tagNameToTagid(parentName);
+        auto parent = tagsGet(parentId);
+        if (parent == tag_t{}) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (parent.type != TAG_TYPE_REGULAR) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        // implication must stay acyclic
+        if (parentId == tagId || std::count(descendants.begin(), descendants.end(), parentId)) {
+            errno = ELOOP;
+            return -1;
+        }
+        if (!std::count(parentIds.begin(), parentIds.end(), parentId))
+            parentIds.push_back(parentId);
+    }
+
+    auto affected = tagAncestors(tagId);
+    if (memory) {
+        for (auto parentId: tag.parents) {
+            auto &children = mem.tags[parentId].children;
+            children.erase(std::remove(children.begin(), children.end(), tagId), children.end());
+        }
+        mem.tags[tagId].parents = parentIds;
+        for (auto parentId: parentIds) {
+            auto &children = mem.tags[parentId].children;
+            if (!std::count(children.begin(), children.end(), tagId))
+                children.push_back(tagId);
+        }
+    } else {
+        if (!tag.parents.empty()) {
+            tags.update_many(document{} << _ID << idsIn(tag.parents).view() << finalize,
+                             document{} << PULL << open_document << CHILDREN << tagId << close_document << finalize);
+        }
+        std::vector<uint8_t> buffer;
+        auto parents_arr = bsoncxx::builder::basic::document{};
+        parents_arr.append(kvp(PARENTS, int64Array(parentIds, buffer)));
+        auto res = tags.update_one(byId(tagId).view(),
+                                   document{} << SET << parents_arr.view() << finalize);
+        if (!res)
+            return -1;
+        if (!parentIds.empty()) {
+            tags.update_many(document{} << _ID << idsIn(parentIds).view() << finalize,
+                             document{} << ADD_TO_SET << open_document << CHILDREN << tagId << close_document << finalize);
+        }
+    }
+
+    // every ancestor, old or new, has changed set of descendants
+    for (auto ancestorId: tagAncestors(tagId)) {
+        if (!std::count(affected.begin(), affected.end(), ancestorId))
+            affected.push_back(ancestorId);
+    }
+    for (auto ancestorId: affected) {
+        tagClosureRefresh(ancestorId);
+    }
+    return 0;
+}
+
+numvec TagFS::tagInodesGet(const tag_t &tag) {
+    if (tag.type == TAG_TYPE_NAME)
+        return inodetoFilenameFind(tag.name);
+    if (tag.type == TAG_TYPE_VALUE) {
+        value_range_t range;
+        if (!parseValueTag(tag.name, range))
+            return {};
+        return inodeToValueRange(range);
+    }
+    if (tag.type == TAG_TYPE_TIME) {
+        num_t from, to;
+        if (!parseTimeTag(tag.name, from, to))
+            return {};
+        return inodeToTimeRange(from, to);
+    }
+    if (tag.type == TAG_TYPE_ORDER)
+        return {};
+    auto tagId = tagNameToTagid(tag.name);
+    if (std::count(tag.closures.begin(), tag.closures.end(), tagId)) {
+        return tagClosureGet(tagId);
+    }
+    auto result = tagToInodeGet(tagId);
+    if (tag.children.empty()) {
+        return result;
+    }
+    inodeset inodes{result.begin(), result.end()};
+    for (auto descendantId: tagDescendants(tagId)) {
+        auto descendantInodes = tagToInodeGet(descendantId);
+        inodes.insert(descendantInodes.begin(), descendantInodes.end());
+    }
+    return {inodes.begin(), inodes.end()};
+}
+
+int TagFS::tagClosureDelete(num_t tagId) {
+    if (memory) {
+        for (auto &[memberId, member]: mem.tags) {
+            member.closures.erase(std::remove(member.closures.begin(), member.closures.end(), tagId), member.closures.end());
+        }
+        return static_cast<int>(mem.tagClosure.erase(tagId));
+    }
+    tags.update_many(document{} << CLOSURES << tagId << finalize,
+                     document{} << PULL << open_document << CLOSURES << tagId << close_document << finalize);
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    auto res = tagClosure.delete_many(byTag(tagId).view());
+    if (!res)
+        return -1;
+    return 1;
+}
+
+int TagFS::tagClosureRefresh(num_t tagId) {
+    tagClosureDelete(tagId);
+
+    auto members = tagDescendants(tagId);
+    if (members.size() < TAG_CLOSURE_MIN_DESCENDANTS) {
+        return 0;
+    }
+    members.push_back(tagId);
+
+    if (memory) {
+        inodeset inodes;
+        for (auto memberId: members) {
+            auto memberInodes = tagToInodeGet(memberId);
+            inodes.insert(memberInodes.begin(), memberInodes.end());
+        }
+        mem.tagClosure[tagId] = std::move(inodes);
+        for (auto memberId: members) {
+            mem.tags[memberId].closures.push_back(tagId);
+        }
+        return 0;
+    }
+    // union is stored in chunks like posting lists, keyed by (closure, chunk)
+    numvec all, inodes;
+    for (auto &[memberId, memberInodes]: tagToInodeGetMany(members)) {
+        all.insert(all.end(), memberInodes.begin(), memberInodes.end());
+    }
+    mergePostings(inodes, all, {});
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    if (postingChunksReplace(tagClosure, tagId, inodes) != 0)
+        return -1;
+
+    // posting lists of members are now also written to closure
+    auto res_update = tags.update_many(document{} << _ID << idsIn(members).view() << finalize,
+                                       document{} << ADD_TO_SET << open_document << CLOSURES << tagId << close_document << finalize);
+    if (!res_update)
+        return -1;
+    return 0;
+}
+
+int TagFS::tagClosureAddInode(const tag_t &tag, num_t inode) {
+    if (tag.closures.empty())
+        return 0;
+    if (memory) {
+        for (auto closureId: tag.closures) {
+            mem.tagClosure[closureId].insert(inode);
+        }
+        return 0;
+    }
+    for (auto closureId: tag.closures) {
+        if (tagClosurePatch(closureId, {inode}, {}) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int TagFS::tagClosureRemoveInode(const numvec &closureIds, num_t inode) {
+    if (closureIds.empty())
+        return 0;
+    if (memory) {
+        for (auto closureId: closureIds) {
+            mem.tagClosure[closureId].erase(inode);
+        }
+        return 0;
+    }
+    for (auto closureId: closureIds) {
+        if (tagClosurePatch(closureId, {}, {inode}) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+numvec TagFS::tagClosureGet(num_t tagId) {
+    if (memory) {
+        auto it = mem.tagClosure.find(tagId);
+        if (it == mem.tagClosure.end())
+            return {};
+        return {it->second.begin(), it->second.end()};
+    }
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    numvec result{};
+    for (const auto &doc: tagClosure.find(byTag(tagId).view(), chunkOrder)) {
+        postingChunkInodes(doc, result);
+    }
+    return result;
+}
+
+int TagFS::tagClosurePatch(num_t closureId, const numvec &add, const numvec &remove) {
+    // closures are few and live on the first shard, chunks out of bounds are compacted at once
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    bool compact = false;
+    if (postingChunksPatch(tagClosure, closureId, add, remove, compact) != 0)
+        return -1;
+    if (compact)
+        return tagToInodeCompact(tagClosure, closureId);
+    return 0;
+}
+
+void TagFS::tagClosureChunkOld() {
+    // closures written before they were chunked are keyed by tag id and have plain inodes array
+    auto old = document{} << TAG_ID << open_document << "$exists" << false << close_document << finalize;
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    for (const auto &doc: tagClosure.find(old.view())) {
+        num_t closureId = doc[_ID].get_int64();
+        numvec sorted;
+        mergePostings(sorted, arrayToNumvec(doc[INODES]), {});
+        postingChunksReplace(tagClosure, closureId, sorted);
+        tagClosure.delete_one(byId(closureId).view());
+    }
+}
+
+
+//////////////////////////////////////////  tags collection manipulation  /////////////////////////////////////////////
+std::vector<posting_chunk_t> TagFS::postingChunks(mongocxx::collection &collection, num_t tagId) {
+    auto opts = mongocxx::options::find{};
+    opts.sort(document{} << CHUNK << 1 << finalize);
+    opts.projection(document{} << CHUNK << 1 << FIRST << 1 << LAST << 1 << COUNT << 1 << finalize);
+
+    std::vector<posting_chunk_t> result;
+    for (const auto &doc: collection.find(byTag(tagId).view(), opts)) {
+        result.push_back({.chunk=doc[CHUNK].get_int64(), .first=doc[FIRST].get_int64(),
+                          .last=doc[LAST].get_int64(), .count=doc[COUNT].get_int64()});
+    }
+    return result;
+}
+
+bsoncxx::document::value TagFS::postingChunkFields(const numvec &sorted) {
+    auto data = encodePostings(sorted);
+    bsoncxx::types::b_binary binary{bsoncxx::binary_sub_type::k_binary, static_cast<uint32_t>(data.size()),
+                                    reinterpret_cast<const uint8_t *>(data.data())};
+    return document{} << FIRST << (sorted.empty() ? num_t(-1) : sorted.front())
+                      << LAST << (sorted.empty() ? num_t(-1) : sorted.back())
+                      << COUNT << static_cast<num_t>(sorted.size()) << DATA << binary << finalize;
+}
+
+bsoncxx::document::value TagFS::postingChunkDocument(num_t tagId, num_t chunk, const numvec &sorted) {
+    auto fields = postingChunkFields(sorted);
+    return document{} << TAG_ID << tagId << CHUNK << chunk << bsoncxx::builder::concatenate(fields.view()) << finalize;
+}
+
+numvec TagFS::postingChunkInodes(const bsoncxx::document::view &view) {
+    numvec result;
+    postingChunkInodes(view, result);
+    return result;
+}
+
+void TagFS::postingChunkInodes(const bsoncxx::document::view &view, numvec &out) {
+    auto element = view[DATA];
+    if (!element)
+        return;
+    auto binary = element.get_binary();
+    decodePostings(binary.bytes, binary.size, out);
+}
+
+int TagFS::tagToInodeInsert(num_t tagId, num_t inode) {
+    if (memory) {
+        auto &inodes = mem.tagToInode[tagId];
+        if (inode >= 0)
+            inodes.insert(inode);
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    auto res = tagShard(tagId).tagToInode.insert_one(
+            postingChunkDocument(tagId, std::numeric_limits<num_t>::min(), inode >= 0 ? numvec{inode} : numvec{}).view());
+    if (!res)
+        return -1;
+    return 0;
+}
+
+int TagFS::tagToInodeUpdate(num_t tagId, const numvec &inodes) {
+    if (memory) {
+        mem.tagToInode[tagId] = inodeset{inodes.begin(), inodes.end()};
+        return 0;
+    }
+    numvec sorted;
+    mergePostings(sorted, inodes, {});
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    return postingChunksReplace(tagShard(tagId).tagToInode, tagId, sorted);
+}
+
+int TagFS::postingChunksReplace(mongocxx::collection &collection, num_t tagId, const numvec &sorted) {
+    auto pieces = splitPostings(sorted, POSTING_CHUNK_SIZE);
+    std::vector<mongocxx::model::write> writes;
+    writes.emplace_back(mongocxx::model::delete_many(document{} << TAG_ID << tagId << finalize));
+    for (size_t k = 0; k < pieces.size(); k++) {
+        auto chunk = k == 0 ? std::numeric_limits<num_t>::min() : pieces[k].front();
+        writes.emplace_back(mongocxx::model::insert_one(postingChunkDocument(tagId, chunk, pieces[k]).view()));
+    }
+    auto res = collection.bulk_write(writes);
+    if (!res)
+        return -1;
+    return 0;
+}
+
+bool TagFS::tagToInodeFind(num_t tagId) {
+    if (memory)
+        return mem.tagToInode.count(tagId) > 0;
+    auto opts = mongocxx::options::find{};
+    opts.projection(document{} << CHUNK << 1 << finalize);
+    auto res = tagShard(tagId).tagToInode.find_one(
+            byTag(tagId).view(), opts);
+    if(res) {
+        return true;
+    }
+    return false;
+}
+
+numvec TagFS::tagToInodeGet(num_t tagId) {
+    if (memory) {
+        auto it = mem.tagToInode.find(tagId);
+        if (it == mem.tagToInode.end())
+            return {};
+        return {it->second.begin(), it->second.end()};
+    }
+
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    numvec result{};
+    for (const auto &doc: tagShard(tagId).tagToInode.find(byTag(tagId).view(), chunkOrder)) {
+        postingChunkInodes(doc, result);
+    }
+    return result;
+}
+
+std::unordered_map<num_t, numvec> TagFS::tagToInodeGetMany(const numvec &tagIds) {
+    std::unordered_map<num_t, numvec> result;
+    if (tagIds.empty())
+        return result;
+    if (memory) {
+        for (auto tagId: tagIds) {
+            result[tagId] = tagToInodeGet(tagId);
+        }
+        return result;
+    }
+    auto opts = mongocxx::options::find{};
+    opts.sort(document{} << TAG_ID << 1 << CHUNK << 1 << finalize);
+
+    // one request to every shard which has some of the tags
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    auto byShard = tagsByShard(tagIds);
+    std::vector<size_t> indexes;
+    for (auto &[index, shardTagIds]: byShard) {
+        indexes.push_back(index);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        std::unordered_map<num_t, numvec> part;
+        for (const auto &doc: shard.tagToInode.find(document{} << TAG_ID << idsIn(byShard.at(index)).view() << finalize, opts)) {
+            postingChunkInodes(doc, part[doc[TAG_ID].get_int64()]);
+        }
+        return part;
+    });
+    for (auto &part: parts) {
+        result.merge(part);
+    }
+    return result;
+}
+
+inodeset TagFS::tagToInodeIntersect(num_t tagId, const inodeset &candidates) {
+    inodeset result;
+    if (candidates.empty())
+        return result;
+    if (memory) {
+        auto it = mem.tagToInode.find(tagId);
+        if (it == mem.tagToInode.end())
+            return result;
+        for (auto inode: candidates) {
+            if (it->second.count(inode))
+                result.insert(inode);
+        }
+        return result;
+    }
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    return tagToInodeIntersectIn(tagShard(tagId).tagToInode, tagId, candidates);
+}
+
+inodeset TagFS::tagToInodeIntersectIn(mongocxx::collection &collection, num_t tagId, const inodeset &candidates) {
+    inodeset result;
+    if (candidates.empty())
+        return result;
+    auto [lo, hi] = std::minmax_element(candidates.begin(), candidates.end());
+    auto filter = document{} << TAG_ID << tagId
+                             << LAST << open_document << GTE << *lo << close_document
+                             << FIRST << open_document << LTE << *hi << close_document << finalize;
+
+    // chunks come one batch after another, nothing but candidates is kept
+    for (const auto &doc: collection.find(filter.view(), chunkOrder)) {
+        for (auto inode: postingChunkInodes(doc)) {
+            if (candidates.count(inode))
+                result.insert(inode);
+        }
+    }
+    return result;
+}
+
+inodeset TagFS::tagToInodeIntersectMany(const numvec &tagIds, const inodeset &candidates) {
+    if (memory || shards.size() == 1) {
+        inodeset result = candidates;
+        for (auto tagId: tagIds) {
+            if (result.empty())
+                break;
+            result = tagToInodeIntersect(tagId, result);
+        }
+        return result;
+    }
+    // every shard narrows candidates by its own tags, results are intersected
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    auto byShard = tagsByShard(tagIds);
+    std::vector<size_t> indexes;
+    for (auto &[index, shardTagIds]: byShard) {
+        indexes.push_back(index);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        inodeset part = candidates;
+        for (auto tagId: byShard.at(index)) {
+            if (part.empty())
+                break;
+            part = tagToInodeIntersectIn(shard.tagToInode, tagId, part);
+        }
+        return part;
+    });
+    std::sort(parts.begin(), parts.end(), [](const inodeset &a, const inodeset &b) { return a.size() < b.size(); });
+    inodeset result;
+    for (auto inode: parts.front()) {
+        if (std::all_of(parts.begin() + 1, parts.end(), [inode](const inodeset &part) { return part.count(inode) > 0; }))
+            result.insert(inode);
+    }
+    return result;
+}
+
+int TagFS::tagToInodeDelete(num_t tagId) {
+    if (memory)
+        return static_cast<int>(mem.tagToInode.erase(tagId));
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    auto res = tagShard(tagId).tagToInode.delete_many(byTag(tagId).view());
+    if (!res)
+        return -1;
+    return 1;
+}
+
+int TagFS::tagToInodeAddInode(num_t tagId, num_t inode) {
+    if (memory) {
+        mem.tagToInode[tagId].insert(inode);
+        return 0;
+    }
+    return tagToInodePatch(tagId, {inode}, {});
+}
+
+int TagFS::tagToInodePatch(num_t tagId, const numvec &add, const numvec &remove) {
+    std::lock_guard<std::mutex> lock{postingsMutex};
+    bool compact = false;
+    if (postingChunksPatch(tagShard(tagId).tagToInode, tagId, add, remove, compact) != 0)
+        return -1;
+    if (compact) {
+        postingsToCompact.insert(tagId);
+        compactionWakeup.notify_one();
+    }
+    return 0;
+}
+
+int TagFS::postingChunksPatch(mongocxx::collection &collection, num_t tagId, const numvec &add, const numvec &remove,
+                              bool &compact) {
+    auto chunks = postingChunks(collection, tagId);
+    if (chunks.empty())
+        return 0;
+
+    // changes grouped by chunk which holds the inode, new inodes mostly go to the tail chunk
+    std::map<size_t, std::pair<numvec, numvec>> changes;
+    for (auto inode: add) {
+        if (inode >= 0)
+            changes[postingChunkOf(chunks, inode)].first.push_back(inode);
+    }
+    for (auto inode: remove) {
+        changes[postingChunkOf(chunks, inode)].second.push_back(inode);
+    }
+
+    std::vector<mongocxx::model::write> writes;
+    size_t alive = chunks.size();
+    for (auto &[k, change]: changes) {
+        auto &chunk = chunks[k];
+        auto doc = collection.find_one(document{} << TAG_ID << tagId << CHUNK << chunk.chunk << finalize);
+        if (!doc)
+            continue;
+        auto inodes = postingChunkInodes(doc->view());
+        mergePostings(inodes, change.first, change.second);
+
+        if (inodes.empty() && alive > 1) {
+            // range of chunk falls to its neighbours
+            writes.emplace_back(mongocxx::model::delete_one(
+                    document{} << TAG_ID << tagId << CHUNK << chunk.chunk << finalize));
+            alive--;
+            continue;
+        }
+        numvec kept = std::move(inodes);
+        std::vector<numvec> spilled;
+        if (k + 1 == chunks.size() && kept.size() > POSTING_CHUNK_SIZE) {
+            // appends fill the tail up to the chunk size and continue in new chunks
+            auto pieces = splitPostings(kept, POSTING_CHUNK_SIZE);
+            kept = std::move(pieces.front());
+            spilled.assign(std::make_move_iterator(pieces.begin() + 1), std::make_move_iterator(pieces.end()));
+        }
+        auto fields = postingChunkFields(kept);
+        writes.emplace_back(mongocxx::model::update_one(
+                document{} << TAG_ID << tagId << CHUNK << chunk.chunk << finalize,
+                document{} << SET << fields.view() << finalize));
+        for (const auto &piece: spilled) {
+            writes.emplace_back(mongocxx::model::insert_one(postingChunkDocument(tagId, piece.front(), piece).view()));
+        }
+        auto count = static_cast<num_t>(kept.size());
+        compact = compact || count > POSTING_CHUNK_MAX || (count < POSTING_CHUNK_MIN && k + 1 < chunks.size());
+    }
+    if (writes.empty())
+        return 0;
+    auto res = collection.bulk_write(writes);
+    if (!res)
+        return -1;
+    return 0;
+}
+
+int TagFS::tagToInodeCompact(mongocxx::collection &collection, num_t tagId) {
+    auto chunks = postingChunks(collection, tagId);
+    std::vector<mongocxx::model::write> writes;
+    auto chunkFilter = [&](num_t chunk) {
+        return document{} << TAG_ID << tagId << CHUNK << chunk << finalize;
+    };
+    auto chunkInodes = [&](num_t chunk) {
+        auto doc = collection.find_one(chunkFilter(chunk).view());
+        return doc ? postingChunkInodes(doc->view()) : numvec{};
+    };
+    for (size_t k = 0; k < chunks.size(); k++) {
+        auto &chunk = chunks[k];
+        if (chunk.count > POSTING_CHUNK_MAX) {
+            // pieces but the first get own chunks, numbered by their least inodes
+            auto pieces = splitPostings(chunkInodes(chunk.chunk), POSTING_CHUNK_SIZE);
+            for (size_t p = 1; p < pieces.size(); p++) {
+                writes.emplace_back(mongocxx::model::insert_one(
+                        postingChunkDocument(tagId, pieces[p].front(), pieces[p]).view()));
+            }
+            writes.emplace_back(mongocxx::model::update_one(chunkFilter(chunk.chunk).view(),
+                    document{} << SET << postingChunkFields(pieces.front()).view() << finalize));
+        } else if (chunk.count < POSTING_CHUNK_MIN && k + 1 < chunks.size() &&
+                   chunk.count + chunks[k + 1].count <= POSTING_CHUNK_MAX) {
+            // next chunk is merged into this one, its range goes along
+            auto &next = chunks[k + 1];
+            auto inodes = chunkInodes(chunk.chunk);
+            mergePostings(inodes, chunkInodes(next.chunk), {});
+            writes.emplace_back(mongocxx::model::update_one(chunkFilter(chunk.chunk).view(),
+                    document{} << SET << postingChunkFields(inodes).view() << finalize));
+            writes.emplace_back(mongocxx::model::delete_one(chunkFilter(next.chunk).view()));
+            k++;
+        }
+    }
+    if (writes.empty())
+        return 0;
+    auto res = collection.bulk_write(writes);
+    if (!res)
+        return -1;
+    return 0;
+}
+
+void TagFS::tagToInodeChunkOld() {
+    // documents written before chunks existed are keyed by tag id and have plain inodes array
+    auto old = document{} << TAG_ID << open_document << "$exists" << false << close_document << finalize;
+    for (auto &shard: shards) {
+        for (const auto &doc: shard.tagToInode.find(old.view())) {
+            num_t tagId = doc[_ID].get_int64();
+            numvec sorted;
+            mergePostings(sorted, arrayToNumvec(doc[INODES]), {});
+            auto pieces = splitPostings(sorted, POSTING_CHUNK_SIZE);
+            std::vector<mongocxx::model::write> writes;
+            for (size_t k = 0; k < pieces.size(); k++) {
+                auto chunk = k == 0 ? std::numeric_limits<num_t>::min() : pieces[k].front();
+                writes.emplace_back(mongocxx::model::insert_one(postingChunkDocument(tagId, chunk, pieces[k]).view()));
+            }
+            tagShard(tagId).tagToInode.bulk_write(writes);
+            shard.tagToInode.delete_one(byId(tagId).view());
+        }
+    }
+}
+
+void TagFS::compactionLoop() {
+    // own connection to every shard, collections are taken once all clients are in place
+    std::vector<mongocxx::client> clients;
+    for (const auto &shard: shards) {
+        clients.emplace_back(mongocxx::uri{shard.uri});
+    }
+    std::vector<mongocxx::collection> collections;
+    for (auto &client: clients) {
+        collections.push_back(client[db_name]["tagToInode"]);
+    }
+    std::unique_lock<std::mutex> lock{postingsMutex};
+    while (true) {
+        compactionWakeup.wait(lock, [this]() { return compactionStop || !postingsToCompact.empty(); });
+        if (compactionStop)
+            return;
+        auto tagId = *postingsToCompact.begin();
+        postingsToCompact.erase(postingsToCompact.begin());
+        // file system waits only while chunks of one tag are rewritten
+        try {
+            tagToInodeCompact(collections[tagShardIndex(tagId)], tagId);
+        } catch (std::exception &e) {
+#ifdef DEBUG
+            std::cerr << "compaction of posting list " << tagId << " failed: " << e.what() << std::endl;
+#endif
+        }
+    }
+}
+
+void TagFS::startCompaction() {
+    if (memory || compactor.joinable())
+        return;
+    compactionStop = false;
+    compactor = std::thread(&TagFS::compactionLoop, this);
+}
+
+void TagFS::stopCompaction() {
+    if (!compactor.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock{postingsMutex};
+        compactionStop = true;
+    }
+    compactionWakeup.notify_one();
+    compactor.join();
+}
+
+int TagFS::tagToInodeDeleteInodes(const numvec &inodes) {
+    if (memory) {
+        // posting lists of file's tags only, ids of its tags are in inodeToTag
+        for (auto inode: inodes) {
+            auto it = mem.inodeToTag.find(inode);
+            if (it == mem.inodeToTag.end())
+                continue;
+            for (auto tagId: it->second) {
+                auto posting = mem.tagToInode.find(tagId);
+                if (posting != mem.tagToInode.end())
+                    posting->second.erase(inode);
+            }
+        }
+        for (auto &[closureId, closure]: mem.tagClosure) {
+            for (auto inode: inodes) {
+                closure.erase(inode);
+            }
+        }
+        return 0;
+    }
+    // posting lists of file's tags only, ids of its tags are in inodeToTag
+    std::map<num_t, numvec> removed;
+    for (auto &[inode, fileTags]: inodeToTagGetMany(inodes)) {
+        for (auto tagId: fileTags) {
+            removed[tagId].push_back(inode);
+        }
+    }
+    numvec removedTagIds;
+    for (auto &[tagId, tagInodes]: removed) {
+        if (tagToInodePatch(tagId, {}, tagInodes) != 0)
+            return -1;
+        removedTagIds.push_back(tagId);
+    }
+
+    // closures hold files through their member tags only
+    std::map<num_t, inodeset> closureRemoved;
+    for (auto &[tagId, tag]: tagsGetMany(removedTagIds)) {
+        for (auto closureId: tag.closures) {
+            closureRemoved[closureId].insert(removed[tagId].begin(), removed[tagId].end());
+        }
+    }
+    for (auto &[closureId, closureInodes]: closureRemoved) {
+        if (tagClosurePatch(closureId, {}, numvec{closureInodes.begin(), closureInodes.end()}) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+int TagFS::tagToInodeMoveInode(num_t inode, const numvec &fromTagIds, const numvec &toTagIds) {
+    if (memory) {
+        for (auto tagId: fromTagIds) {
+            mem.tagToInode[tagId].erase(inode);
+        }
+        for (auto tagId: toTagIds) {
+            mem.tagToInode[tagId].insert(inode);
+        }
+        return 0;
+    }
+    // every posting list is patched in its own chunk
+    for (auto tagId: fromTagIds) {
+        if (tagToInodePatch(tagId, {}, {inode}) != 0)
+            return -1;
+    }
+    for (auto tagId: toTagIds) {
+        if (tagToInodePatch(tagId, {inode}, {}) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////  InodeToTag collection manipulation  /////////////////////////////////////////////
+
+int TagFS::inodeToTagInsert(num_t inode, num_t tagsId) {
+    if (memory) {
+        mem.inodeToTag[inode] = {tagsId};
+        return 0;
+    }
+    bsoncxx::stdx::optional<mongocxx::result::insert_one> res;
+    auto doc_value = document{} << _ID << inode << TAGS << open_array << tagsId << close_array << finalize;
+    res = inodeShard(inode).inodeToTag.insert_one( doc_value.view() );
+    if (!res)
+        return -1;
+    return 0;
+}
+
+int TagFS::inodeToTagUpdate(num_t inode, const numvec &tagsIds) {
+    if (memory) {
+        mem.inodeToTag[inode] = tagsIds;
+        return 0;
+    }
+    std::vector<uint8_t> buffer;
+    auto tags = bsoncxx::builder::basic::document{};
+    tags.append(kvp(TAGS, int64Array(tagsIds, buffer)));
+    auto res = inodeShard(inode).inodeToTag.update_one(byId(inode).view(),
+                                                       document{} << SET << tags.view() << finalize);
+
+    if (!res)
+        return -1;
+    return 0;
+}
+
+bool TagFS::inodeToTagFind(num_t inode) {
+    if (memory)
+        return mem.inodeToTag.count(inode) > 0;
+    auto res = inodeShard(inode).inodeToTag.find_one(
+            byId(inode).view());
+    if(res) {
+        return true;
+    }
+    return false;
+}
+
+numvec TagFS::inodeToTagGet(num_t inode) {
+    if (memory) {
+        auto it = mem.inodeToTag.find(inode);
+        return it == mem.inodeToTag.end() ? numvec{} : it->second;
+    }
+    auto res = inodeShard(inode).inodeToTag.find_one(
+            byId(inode).view());
     if(res) {
         auto view = res->view();
         auto arr_value = view[TAGS].get_array().value;
@@ -477,29 +2392,72 @@ numvec TagFS::inodeToTagGet(num_t inode) {
     return {};
 }
 
+std::unordered_map<num_t, numvec> TagFS::inodeToTagGetMany(const numvec &inodes) {
+    std::unordered_map<num_t, numvec> result;
+    if (inodes.empty())
+        return result;
+    if (memory) {
+        for (auto inode: inodes) {
+            result[inode] = inodeToTagGet(inode);
+        }
+        return result;
+    }
+    auto byShard = inodesByShard(inodes);
+    std::vector<size_t> indexes;
+    for (auto &[index, shardInodes]: byShard) {
+        indexes.push_back(index);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        std::unordered_map<num_t, numvec> part;
+        for (const auto &doc: shard.inodeToTag.find(document{} << _ID << idsIn(byShard.at(index)).view() << finalize)) {
+            decodeInt64Array(doc[TAGS], part[doc[_ID].get_int64()]);
+        }
+        return part;
+    });
+    for (auto &part: parts) {
+        result.merge(part);
+    }
+    return result;
+}
+
 int TagFS::inodeToTagDelete(num_t inode) {
-    return collectionDelete(inodeToTag, inode);
+    if (memory)
+        return static_cast<int>(mem.inodeToTag.erase(inode));
+    return collectionDelete(inodeShard(inode).inodeToTag, inode);
 }
 
 int TagFS::inodeToTagAddTagId(num_t inode, num_t tagid) {
-    auto res = inodeToTag.update_one(
-            document{} << _ID << inode << finalize,
-            document{} << PUSH << open_document << TAGS << tagid << close_document << finalize);
+    if (memory) {
+        auto &fileTags = mem.inodeToTag[inode];
+        if (!std::count(fileTags.begin(), fileTags.end(), tagid))
+            fileTags.push_back(tagid);
+        return 0;
+    }
+    auto res = inodeShard(inode).inodeToTag.update_one(
+            byId(inode).view(),
+            document{} << ADD_TO_SET << open_document << TAGS << tagid << close_document << finalize);
     if (!res)
         return -1;
     return 0;
 }
 
 int TagFS::inodeToTagDeleteTags(const numvec &tagIds) {
-    auto doc = bsoncxx::builder::basic::document{};
-    doc.append(kvp(IN, [&tagIds](sub_array child) {
-        for (const auto& tagid : tagIds) {
-            child.append(tagid);
+    if (memory) {
+        for (auto &[inode, fileTags]: mem.inodeToTag) {
+            fileTags.erase(std::remove_if(fileTags.begin(), fileTags.end(), [&tagIds](num_t tagId) {
+                return std::count(tagIds.begin(), tagIds.end(), tagId) > 0;
+            }), fileTags.end());
         }
-    }));
-    auto pull_query_finalized = document{} << PULL << open_document << INODES << doc << close_document << finalize;
-    auto res = inodeToTag.update_many({}, pull_query_finalized.view());
-    if (!res)
+        return 0;
+    }
+    std::vector<uint8_t> buffer;
+    auto doc = bsoncxx::builder::basic::document{};
+    doc.append(kvp(IN, int64Array(tagIds, buffer)));
+    auto pull_query_finalized = document{} << PULL << open_document << TAGS << doc << close_document << finalize;
+    auto results = scatterAll([&](shard_t &shard, size_t) {
+        return static_cast<bool>(shard.inodeToTag.update_many({}, pull_query_finalized.view()));
+    });
+    if (std::count(results.begin(), results.end(), false))
         return -1;
     return 0;
 }
@@ -507,24 +2465,38 @@ int TagFS::inodeToTagDeleteTags(const numvec &tagIds) {
 //////////////////////////////////////////  InodeToTag collection manipulation  /////////////////////////////////////////////
 
 int TagFS::inodetoFilenameInsert(num_t inode, const std::string &filename) {
-    auto res = inodetoFilename.insert_one(
-            document{} << _ID << inode << FILENAME << filename << finalize);
+    if (memory) {
+        mem.filenameSet(inode, filename);
+        return 0;
+    }
+    auto res = inodeShard(inode).inodetoFilename.insert_one(
+            document{} << _ID << inode << FILENAME << filename << LOWER_FILENAME << toLower(filename) << finalize);
     if (!res)
         return -1;
     return 0;}
 
 int TagFS::inodetoFilenameUpdate(num_t inode, const std::string &filename) {
-    auto res = inodetoFilename.update_one(
-            document{} << _ID << inode << finalize,
-            document{} << SET << open_document << FILENAME << filename << close_document << finalize);
+    if (memory) {
+        if (mem.inodetoFilename.count(inode))
+            mem.filenameSet(inode, filename);
+        return 0;
+    }
+    auto res = inodeShard(inode).inodetoFilename.update_one(
+            byId(inode).view(),
+            document{} << SET << open_document <<
+                          FILENAME << filename << LOWER_FILENAME << toLower(filename) << close_document << finalize);
     if (!res)
         return -1;
     return 0;
 }
 
 std::string TagFS::inodetoFilenameGet(num_t inode) {
-    auto res = inodetoFilename.find_one(
-            document{} << _ID << inode << finalize);
+    if (memory) {
+        auto it = mem.inodetoFilename.find(inode);
+        return it == mem.inodetoFilename.end() ? std::string{} : it->second;
+    }
+    auto res = inodeShard(inode).inodetoFilename.find_one(
+            byId(inode).view());
     if (res) {
         bsoncxx::document::view view = res->view();
         return view[FILENAME].get_utf8().value.to_string();
@@ -532,46 +2504,543 @@ std::string TagFS::inodetoFilenameGet(num_t inode) {
     return {};
 }
 
+std::unordered_map<num_t, std::string> TagFS::inodetoFilenameGetMany(const numvec &inodes) {
+    std::unordered_map<num_t, std::string> result;
+    if (inodes.empty())
+        return result;
+    if (memory) {
+        for (auto inode: inodes) {
+            auto it = mem.inodetoFilename.find(inode);
+            if (it != mem.inodetoFilename.end())
+                result.emplace(inode, it->second);
+        }
+        return result;
+    }
+    auto opts = mongocxx::options::find{};
+    opts.projection(document{} << FILENAME << 1 << finalize);
+    auto byShard = inodesByShard(inodes);
+    std::vector<size_t> indexes;
+    for (auto &[index, shardInodes]: byShard) {
+        indexes.push_back(index);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        std::unordered_map<num_t, std::string> part;
+        for (const auto &doc: shard.inodetoFilename.find(document{} << _ID << idsIn(byShard.at(index)).view() << finalize, opts)) {
+            part.emplace(doc[_ID].get_int64(), doc[FILENAME].get_utf8().value.to_string());
+        }
+        return part;
+    });
+    for (auto &part: parts) {
+        result.merge(part);
+    }
+    return result;
+}
+
 int TagFS::inodetoFilenameDelete(num_t inode) {
-    return collectionDelete(inodetoFilename, inode);
+    if (memory) {
+        mem.filenameDelete(inode);
+        return 1;
+    }
+    return collectionDelete(inodeShard(inode).inodetoFilename, inode);
+}
+
+numvec TagFS::inodetoFilenameFind(const std::string &pattern) {
+    // exact name or prefix is a range scan of index, posting lists are not involved
+    if (pattern.empty())
+        return {};
+    bool prefix = pattern.back() == NAME_PREFIX_WILDCARD;
+    auto name = prefix ? toLower(pattern.substr(0, pattern.size() - 1)) : pattern;
+    if (memory)
+        return mem.filenameFind(name, prefix);
+
+    auto filter = bsoncxx::builder::basic::document{};
+    if (prefix) {
+        auto range = bsoncxx::builder::basic::document{};
+        range.append(kvp(GTE, name));
+        auto upper = prefixUpperBound(name);
+        if (!upper.empty())
+            range.append(kvp(LT, upper));
+        filter.append(kvp(LOWER_FILENAME, range.extract()));
+    } else {
+        filter.append(kvp(FILENAME, name));
+    }
+
+    // names are on every shard
+    auto parts = scatterAll([&](shard_t &shard, size_t) {
+        numvec part{};
+        for (const auto &doc: shard.inodetoFilename.find(filter.view(), idsOnly)) {
+            part.push_back(doc[_ID].get_int64());
+        }
+        return part;
+    });
+    numvec result{};
+    for (auto &part: parts) {
+        result.insert(result.end(), part.begin(), part.end());
+    }
+    return result;
+}
+
+void TagFS::inodetoFilenameIndexNames() {
+    // names written before lowercase index existed
+    auto missing = document{} << LOWER_FILENAME << open_document << "$exists" << false << close_document << finalize;
+    for (auto &shard: shards) {
+        std::vector<mongocxx::model::write> writes;
+        auto flush = [&]() {
+            if (!writes.empty())
+                shard.inodetoFilename.bulk_write(writes);
+            writes.clear();
+        };
+        for (const auto &doc: shard.inodetoFilename.find(missing.view())) {
+            auto filename = doc[FILENAME].get_utf8().value.to_string();
+            writes.emplace_back(mongocxx::model::update_one(
+                    document{} << _ID << doc[_ID].get_int64() << finalize,
+                    document{} << SET << open_document << LOWER_FILENAME << toLower(filename) << close_document << finalize));
+            if (writes.size() >= 1000)
+                flush();
+        }
+        flush();
+    }
+}
+
+
+//////////////////////////////////////////  InodeToTime collection manipulation  /////////////////////////////////////////////
+
+int TagFS::inodeToTimeUpdate(num_t inode, num_t mtime) {
+    if (memory)
+        return mem.timeUpdate(inode, mtime);
+    return commitWrite({inodeShardIndex(inode), "inodeToTime", false, true,
+                        document{} << _ID << inode << finalize,
+                        document{} << SET << open_document << MTIME << mtime << close_document << finalize});
+}
+
+int TagFS::inodeToTimeDelete(num_t inode) {
+    if (memory)
+        return mem.timeDelete(inode);
+    commitFlush();
+    return collectionDelete(inodeShard(inode).inodeToTime, inode);
+}
+
+std::unordered_map<num_t, num_t> TagFS::inodeToTimeGetMany(const numvec &inodes) {
+    std::unordered_map<num_t, num_t> result;
+    if (inodes.empty())
+        return result;
+    if (memory) {
+        for (auto inode: inodes) {
+            num_t mtime = mem.timeGet(inode);
+            if (mtime != -1)
+                result.emplace(inode, mtime);
+        }
+        return result;
+    }
+    commitFlush();
+    auto opts = mongocxx::options::find{};
+    opts.projection(document{} << MTIME << 1 << finalize);
+    auto byShard = inodesByShard(inodes);
+    std::vector<size_t> indexes;
+    for (auto &[index, shardInodes]: byShard) {
+        indexes.push_back(index);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        std::unordered_map<num_t, num_t> part;
+        for (const auto &doc: shard.inodeToTime.find(document{} << _ID << idsIn(byShard.at(index)).view() << finalize, opts)) {
+            part.emplace(doc[_ID].get_int64(), doc[MTIME].get_int64());
+        }
+        return part;
+    });
+    for (auto &part: parts) {
+        result.merge(part);
+    }
+    return result;
+}
+
+numvec TagFS::inodeToTimeRange(num_t from, num_t to, const numvec &candidates) {
+    if (memory)
+        return mem.timeRange(from, to, candidates);
+    commitFlush();
+    auto range = bsoncxx::builder::basic::document{};
+    if (from != std::numeric_limits<num_t>::min())
+        range.append(kvp(GTE, from));
+    if (to != std::numeric_limits<num_t>::max())
+        range.append(kvp(LT, to));
+    auto bounds = range.extract();
+
+    // candidates are looked up on their own shards, whole range on every shard
+    auto byShard = inodesByShard(candidates);
+    std::vector<size_t> indexes;
+    for (size_t k = 0; k < shards.size(); k++) {
+        if (candidates.empty() || byShard.count(k))
+            indexes.push_back(k);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        auto filter = bsoncxx::builder::basic::document{};
+        filter.append(kvp(MTIME, bounds.view()));
+        if (!candidates.empty())
+            filter.append(kvp(_ID, idsIn(byShard.at(index))));
+        numvec part{};
+        for (const auto &doc: shard.inodeToTime.find(filter.view(), idsOnly)) {
+            part.push_back(doc[_ID].get_int64());
+        }
+        return part;
+    });
+    numvec result{};
+    for (auto &part: parts) {
+        result.insert(result.end(), part.begin(), part.end());
+    }
+    return result;
+}
+
+int TagFS::inodeToTimeRefresh(num_t inode) {
+    struct stat st{};
+    if (fstatat(fdCache.dirFd(), std::to_string(inode).c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return -1;
+    return inodeToTimeUpdate(inode, st.st_mtime);
 }
 
 
 ///////////////////////////////////////////////////////////////////////
 
 num_t TagFS::getMaximumInode() {
+    if (memory) {
+        num_t maximum = -1;
+        for (const auto &[inode, fileTags]: mem.inodeToTag) {
+            maximum = std::max(maximum, inode);
+        }
+        return maximum + 1;
+    }
     auto sort_order = document{} << _ID << -1 << finalize;
     auto opts = mongocxx::options::find{};
     opts.sort(sort_order.view());
+    opts.limit(1);
 
-    auto cursor = inodeToTag.find({}, opts);
-
-    for (const auto &doc: cursor) {
-        return doc[_ID].get_int64() + 1;
+    num_t maximum = 0;
+    for (auto &shard: shards) {
+        for (const auto &doc: shard.inodeToTag.find({}, opts)) {
+            maximum = std::max<num_t>(maximum, doc[_ID].get_int64() + 1);
+        }
     }
-
-    return 0;
+    return maximum;
 }
 
 int TagFS::renameFileTag(num_t inode, const std::string &oldTagName, const std::string &newTagName) {
-    // TODO: Support multiple file having the same filetag
+    // only this file changes name, other files with the same name keep it
     auto oldTagId = tagNameToTagid(oldTagName);
     auto newTagId = tagNameToTagid(newTagName);
-    auto oldTags = inodeToTagGet(inode);
+    if (oldTagId == newTagId)
+        return 0;
 
-    oldTags.erase(std::remove(oldTags.begin(), oldTags.end(), oldTagId), oldTags.end());
-    oldTags.push_back(tagNameToTagid(newTagName));
-    inodeToTagUpdate(inode, oldTags);
+    auto oldFileTags = inodeToTagGet(inode);
+    auto fileTags = oldFileTags;
+    fileTags.erase(std::remove(fileTags.begin(), fileTags.end(), oldTagId), fileTags.end());
+    if (!std::count(fileTags.begin(), fileTags.end(), newTagId))
+        fileTags.push_back(newTagId);
+
+    if (!tagToInodeFind(newTagId)) {
+        tagsAdd({TAG_TYPE_FILE, newTagName});
+        tagToInodeInsert(newTagId, -1);
+    }
+    if (intentBegin(inode, oldFileTags, fileTags, newTagName) != 0)
+        return -1;
+    if (tagToInodeMoveInode(inode, {oldTagId}, {newTagId}) != 0)
+        return -1;
+    inodeToTagUpdate(inode, fileTags);
+    tagSetToInodeDelete(inode, oldFileTags);
+    tagSetToInodeSet(inode, fileTags);
     inodetoFilenameUpdate(inode, newTagName);
+    intentEnd(inode);
+
+    auto size = getFileSize(inode);
+    tagStatsUpdate({oldTagId}, -1, -size);
+    tagStatsUpdate({newTagId}, 1, size);
+
+    if (tagToInodeGet(oldTagId).empty()) {
+        tagToInodeDelete(oldTagId);
+        tagsDelete(oldTagId);
+    }
+    return 0;
+}
+
+int TagFS::renameRegularTag(const std::string &oldTagName, const std::string &newTagName) {
+    // posting lists, file tags and hierarchy refer to id, so only the name changes
+    auto tagId = tagNameToTagid(oldTagName);
+    auto tag = tagsGet(tagId);
+    if (tag == tag_t{}) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (tag.type != TAG_TYPE_REGULAR) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (oldTagName == newTagName)
+        return 0;
+    num_t from, to;
+    value_range_t range;
+    query_order_t order;
+    if (parseTimeTag(newTagName, from, to) || parseOrderTag(newTagName, order) || newTagName == NAME_DIR || newTagName == FACETS_FILE ||
+        (parseValueTag(newTagName, range) && inodeToValueKeyExists(range.key))) {
+        errno = EPERM;
+        return -1;
+    }
+    if (!(tagsGet(tagNameToTagid(newTagName)) == tag_t{})) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (tagsRename(tagId, newTagName) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int TagFS::retagFile(num_t inode, const tagvec &newTags) {
+    auto oldTagIds = inodeToTagGet(inode);
+    inodeset oldSet{oldTagIds.begin(), oldTagIds.end()};
+    numvec newTagIds;
+    inodeset newSet;
+    for (const auto &tag: newTags) {
+        auto tagId = tagNameToTagid(tag.name);
+        if (newSet.insert(tagId).second)
+            newTagIds.push_back(tagId);
+    }
+
+    numvec left, joined;
+    std::copy_if(oldTagIds.begin(), oldTagIds.end(), std::back_inserter(left),
+                 [&newSet](num_t tagId) { return !newSet.count(tagId); });
+    std::copy_if(newTagIds.begin(), newTagIds.end(), std::back_inserter(joined),
+                 [&oldSet](num_t tagId) { return !oldSet.count(tagId); });
+    if (left.empty() && joined.empty())
+        return 0;
+
+    if (intentBegin(inode, oldTagIds, newTagIds) != 0)
+        return -1;
+    if (tagToInodeMoveInode(inode, left, joined) != 0)
+        return -1;
+    if (inodeToTagUpdate(inode, newTagIds) != 0)
+        return -1;
+    tagSetToInodeDelete(inode, oldTagIds);
+    tagSetToInodeSet(inode, newTagIds);
+
+    // materialized ancestors keep the file while any of its remaining tags is their member
+    inodeset keptClosures;
+    for (const auto &tag: newTags) {
+        keptClosures.insert(tag.closures.begin(), tag.closures.end());
+        if (!oldSet.count(tagNameToTagid(tag.name)))
+            tagClosureAddInode(tag, inode);
+    }
+    numvec leftClosures;
+    for (auto tagId: left) {
+        for (auto closureId: tagsGet(tagId).closures) {
+            if (!keptClosures.count(closureId) && !std::count(leftClosures.begin(), leftClosures.end(), closureId))
+                leftClosures.push_back(closureId);
+        }
+    }
+    tagClosureRemoveInode(leftClosures, inode);
+    intentEnd(inode);
+
+    auto size = getFileSize(inode);
+    tagStatsUpdate(left, -1, -size);
+    tagStatsUpdate(joined, 1, size);
+    return 0;
+}
+
+
+//////////////////////////////////////////  InodeToValue collection manipulation  /////////////////////////////////////////////
+
+int TagFS::inodeToValueSet(num_t inode, const std::string &key, const tag_value_t &value) {
+    if (memory)
+        return mem.valueSet(inode, key, value);
+    auto fields = bsoncxx::builder::basic::document{};
+    fields.append(kvp(VALUE, value.text));
+    auto update = bsoncxx::builder::basic::document{};
+    if (value.numeric) {
+        fields.append(kvp(NUMBER, value.number));
+        update.append(kvp(SET, fields.extract()));
+    } else {
+        update.append(kvp(SET, fields.extract()));
+        // value which was a number before
+        update.append(kvp("$unset", document{} << NUMBER << "" << finalize));
+    }
+    auto res = inodeShard(inode).inodeToValue.update_one(document{} << INODE << inode << KEY << key << finalize, update.view(), upsert);
+    if (!res)
+        return -1;
+    return 0;
+}
+
+int TagFS::inodeToValueDelete(num_t inode, const std::string &key) {
+    if (memory)
+        return mem.valueDelete(inode, key);
+    auto filter = bsoncxx::builder::basic::document{};
+    filter.append(kvp(INODE, inode));
+    if (!key.empty())
+        filter.append(kvp(KEY, key));
+    auto res = inodeShard(inode).inodeToValue.delete_many(filter.view());
+    if (!res)
+        return -1;
+    return res->deleted_count();
+}
+
+std::map<std::string, std::string> TagFS::inodeToValueGet(num_t inode) {
+    if (memory)
+        return mem.valueGet(inode);
+    std::map<std::string, std::string> result;
+    for (const auto &doc: inodeShard(inode).inodeToValue.find(byInode(inode).view())) {
+        result[doc[KEY].get_utf8().value.to_string()] = doc[VALUE].get_utf8().value.to_string();
+    }
+    return result;
+}
+
+numvec TagFS::inodeToValueRange(const value_range_t &range, const numvec &candidates) {
+    if (memory)
+        return mem.valueRange(range, candidates);
+    // range scan of (key, number) or (key, value) index
+    auto bounds = bsoncxx::builder::basic::document{};
+    if (range.hasFrom) {
+        auto &op = range.fromOpen ? GT : GTE;
+        if (range.numeric)
+            bounds.append(kvp(op, range.from.number));
+        else
+            bounds.append(kvp(op, range.from.text));
+    }
+    if (range.hasTo) {
+        auto &op = range.toOpen ? LT : LTE;
+        if (range.numeric)
+            bounds.append(kvp(op, range.to.number));
+        else
+            bounds.append(kvp(op, range.to.text));
+    }
+    auto rangeBounds = bounds.extract();
+    auto opts = mongocxx::options::find{};
+    opts.projection(document{} << INODE << 1 << finalize);
+
+    // candidates are looked up on their own shards, whole range on every shard
+    auto byShard = inodesByShard(candidates);
+    std::vector<size_t> indexes;
+    for (size_t k = 0; k < shards.size(); k++) {
+        if (candidates.empty() || byShard.count(k))
+            indexes.push_back(k);
+    }
+    auto parts = scatter(indexes, [&](shard_t &shard, size_t index) {
+        auto filter = bsoncxx::builder::basic::document{};
+        filter.append(kvp(KEY, range.key));
+        filter.append(kvp(range.numeric ? NUMBER : VALUE, rangeBounds.view()));
+        if (!candidates.empty())
+            filter.append(kvp(INODE, idsIn(byShard.at(index))));
+        numvec part{};
+        for (const auto &doc: shard.inodeToValue.find(filter.view(), opts)) {
+            part.push_back(doc[INODE].get_int64());
+        }
+        return part;
+    });
+    numvec result{};
+    for (auto &part: parts) {
+        result.insert(result.end(), part.begin(), part.end());
+    }
+    return result;
+}
+
+bool TagFS::inodeToValueKeyExists(const std::string &key) {
+    if (memory)
+        return mem.valueKeyExists(key);
+    auto opts = mongocxx::options::find{};
+    opts.projection(document{} << KEY << 1 << finalize);
+    for (auto &shard: shards) {
+        if (shard.inodeToValue.find_one(document{} << KEY << key << finalize, opts))
+            return true;
+    }
+    return false;
+}
+
+
+//////////////////////////////////////////  TagSetToInode collection manipulation  /////////////////////////////////////////////
+
+// Full path written out by the whole tag set of file is looked up by one key instead of intersection.
+// Entry is only a hint: hashes may collide and entries may outlive tags, so it is checked by tags of file
+num_t TagFS::tagSetToInodeGet(const numvec &tagIds) {
+    num_t hash = tagSetHash(tagIds);
+    num_t inode = -1;
+    if (memory) {
+        auto it = mem.tagSetToInode.find(hash);
+        if (it != mem.tagSetToInode.end())
+            inode = it->second;
+    } else {
+        // hashes spread over shards like tag ids
+        auto res = tagShard(hash).tagSetToInode.find_one(byId(hash).view());
+        if (res)
+            inode = res->view()[INODE].get_int64();
+    }
+    if (inode == -1 || !sameTagSet(inodeToTagGet(inode), tagIds))
+        return -1;
+    return inode;
+}
 
-    auto oldInodes = tagToInodeGet(oldTagId);
-    tagToInodeDelete(oldTagId);
-    for(auto& oldInode: oldInodes){
-        tagToInodeAddInode(newTagId, oldInode);
+int TagFS::tagSetToInodeSet(num_t inode, const numvec &tagIds) {
+    num_t hash = tagSetHash(tagIds);
+    if (memory) {
+        mem.tagSetToInode[hash] = inode;
+        return 0;
     }
+    auto res = tagShard(hash).tagSetToInode.update_one(
+            byId(hash).view(),
+            document{} << SET << open_document << INODE << inode << close_document << finalize, upsert);
+    if (!res)
+        return -1;
+    return 0;
+}
 
-    tagsDelete(oldTagId);
-    tagsAdd({TAG_TYPE_FILE, newTagName});
+int TagFS::tagSetToInodeDelete(num_t inode, const numvec &tagIds) {
+    num_t hash = tagSetHash(tagIds);
+    if (memory) {
+        auto it = mem.tagSetToInode.find(hash);
+        if (it != mem.tagSetToInode.end() && it->second == inode)
+            mem.tagSetToInode.erase(it);
+        return 0;
+    }
+    auto res = tagShard(hash).tagSetToInode.delete_one(document{} << _ID << hash << INODE << inode << finalize);
+    if (!res)
+        return -1;
     return 0;
 }
 
+num_t TagFS::exactFileInode(const tagvec &tags) {
+    if (tags.empty() || tags.back().type != TAG_TYPE_FILE || hasVirtualTags(tags))
+        return -1;
+    numvec tagIds;
+    tagIds.reserve(tags.size());
+    for (const auto &tag: tags) {
+        tagIds.push_back(tagNameToTagid(tag.name));
+    }
+    return tagSetToInodeGet(tagIds);
+}
+
+void TagFS::tagSetToInodeBuild() {
+    // file systems made before the index, and restored ones, get entries of all files at once
+    num_t entries = 0;
+    for (auto &shard: shards) {
+        entries += static_cast<num_t>(shard.tagSetToInode.estimated_document_count());
+    }
+    if (entries != 0)
+        return;
+    std::vector<std::vector<mongocxx::model::write>> writes(shards.size());
+    auto flush = [&](size_t index) {
+        if (!writes[index].empty())
+            shards[index].tagSetToInode.bulk_write(writes[index]);
+        writes[index].clear();
+    };
+    auto opts = mongocxx::options::find{};
+    opts.batch_size(10000);
+    for (auto &shard: shards) {
+        for (const auto &doc: shard.inodeToTag.find({}, opts)) {
+            num_t hash = tagSetHash(arrayToNumvec(doc[TAGS]));
+            auto index = tagShardIndex(hash);
+            writes[index].emplace_back(mongocxx::model::update_one(
+                    document{} << _ID << hash << finalize,
+                    document{} << SET << open_document << INODE << doc[_ID].get_int64() << close_document << finalize
+            ).upsert(true));
+            if (writes[index].size() >= 1000)
+                flush(index);
+        }
+    }
+    for (size_t index = 0; index < shards.size(); index++) {
+        flush(index);
+    }
+}
@@ -2,10 +2,13 @@
 
 
 std::map<std::string, std::string> parse_args(int argc, char **argv) {
-    std::string usage = "USAGE:\n    ucutag [-r|--remove] [ -n--name fs_name=main ] [--help ] [-u|--umount] [-m|--mount] mountpoint";
+    std::string usage = "USAGE:\n    ucutag [-r|--remove] [--fsck fs_name [--repair]] [--dump|--restore fs_name --archive path|- [--with-data]] [ -n--name fs_name=main ] [--backend mongo|memory [--memory-limit bytes]] [--store uri ...] [--query-socket path] [--commit-window us] [--commit-batch n] [--single-thread] [--help ] [-u|--umount] [-m|--mount] mountpoint";
     std::map<std::string, std::string> result{};
     bool debug;
     bool umount;
+    bool repair;
+    bool withData;
+    bool singleThread;
     // parse arguments
     try {
         po::options_description generic("Generic options");
@@ -15,7 +18,20 @@ std::map<std::string, std::string> parse_args(int argc, char **argv) {
                 ("name,n", po::value<std::string>(), "Name of file system")
                 ("debug,d", po::bool_switch(&debug), "Debug. Compile with Debug to see debug messages")
                 ("umount,u", po::bool_switch(&umount), "Umount filesystem")
-                ("remove,r", po::value<std::string>(), "Remove file system by name");
+                ("remove,r", po::value<std::string>(), "Remove file system by name")
+                ("fsck", po::value<std::string>(), "Check consistency of file system by name")
+                ("repair", po::bool_switch(&repair), "Repair problems found by --fsck")
+                ("dump", po::value<std::string>(), "Write metadata of file system by name to --archive")
+                ("restore", po::value<std::string>(), "Create file system by name from --archive")
+                ("archive", po::value<std::string>(), "Archive of --dump or --restore, - for stdout or stdin")
+                ("with-data", po::bool_switch(&withData), "Put contents of files into --dump archive too")
+                ("backend", po::value<std::string>()->default_value("mongo"), "Where to keep file system: mongo or memory (lost on umount)")
+                ("memory-limit", po::value<std::string>()->default_value("0"), "Maximal size of files with memory backend, 0 if unlimited")
+                ("store", po::value<std::vector<std::string>>()->composing(), "Mongo endpoint of metadata, repeat to shard it over several; fixed when file system is created")
+                ("query-socket", po::value<std::string>(), "Unix socket where mounted file system answers queries without VFS")
+                ("commit-window", po::value<std::string>()->default_value("500"), "Microseconds to gather mutations of concurrent requests into one write, 0 to write each at once")
+                ("commit-batch", po::value<std::string>()->default_value("256"), "Maximal number of mutations written at once")
+                ("single-thread", po::bool_switch(&singleThread), "Run requests one after another in one thread, without io_uring; mutations are then never gathered");
 
         po::options_description hidden("Hidden options");
         hidden.add_options()
@@ -50,8 +66,54 @@ std::map<std::string, std::string> parse_args(int argc, char **argv) {
             result["remove"] = "";
         }
 
+        if (vm.count("fsck")) {
+            result["fsck"] = vm["fsck"].as<std::string>();
+        } else {
+            result["fsck"] = "";
+        }
+        result["repair"] = repair ? "true" : "false";
+
+        for (const auto &option: {"dump", "restore"}) {
+            result[option] = vm.count(option) ? vm[option].as<std::string>() : "";
+        }
+        if (vm.count("dump") && vm.count("restore")) {
+            std::cerr << "Error: --dump and --restore can't be used together" << std::endl;
+            exit(1);
+        }
+        if ((vm.count("dump") || vm.count("restore")) && !vm.count("archive")) {
+            std::cerr << "Error: Archive is not specified (--archive)" << std::endl;
+            exit(1);
+        }
+        result["archive"] = vm.count("archive") ? vm["archive"].as<std::string>() : "";
+        result["with-data"] = withData ? "true" : "false";
+
+        result["backend"] = vm["backend"].as<std::string>();
+        if (result["backend"] != "mongo" && result["backend"] != "memory") {
+            std::cerr << "Error: Unknown backend: " << result["backend"] << std::endl;
+            exit(1);
+        }
+        if (result["backend"] == "memory" && (vm.count("remove") || vm.count("fsck") || vm.count("dump") || vm.count("restore"))) {
+            std::cerr << "Error: File system in memory can't be removed, checked, dumped or restored" << std::endl;
+            exit(1);
+        }
+        result["memory-limit"] = vm["memory-limit"].as<std::string>();
+        if (result["backend"] == "memory" && vm.count("store")) {
+            std::cerr << "Error: --store can't be used with memory backend" << std::endl;
+            exit(1);
+        }
+        result["store"] = "";
+        if (vm.count("store")) {
+            for (const auto &uri: vm["store"].as<std::vector<std::string>>()) {
+                result["store"] += (result["store"].empty() ? "" : "\n") + uri;
+            }
+        }
+        result["query-socket"] = vm.count("query-socket") ? vm["query-socket"].as<std::string>() : "";
+        result["commit-window"] = vm["commit-window"].as<std::string>();
+        result["commit-batch"] = vm["commit-batch"].as<std::string>();
+        result["single-thread"] = singleThread ? "true" : "false";
+
         if (!vm.count("mount")) {
-            if (!vm.count("remove")) {
+            if (!vm.count("remove") && !vm.count("fsck") && !vm.count("dump") && !vm.count("restore")) {
                 std::cerr << "Error: Mount point is not specified (-m|--mount)" << std::endl;
                 exit(1);
             } else {
@@ -64,7 +126,7 @@ std::map<std::string, std::string> parse_args(int argc, char **argv) {
         result["debug"] = debug ? "true" : "false";
 
         if (!vm.count("name")) {
-            if (!vm.count("remove") && !umount)
+            if (!vm.count("remove") && !vm.count("fsck") && !vm.count("dump") && !vm.count("restore") && !umount)
                 std::cout << "Warning: Didn't specify fs name (-n|--name): using default: main" << std::endl;
             result["name"] = "main";
         } else {
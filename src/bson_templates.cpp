@@ -0,0 +1,88 @@
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include "bson_templates.h"
+
+#define BSON_TYPE_INT64 0x12
+
+static void putInt32(uint8_t *at, uint32_t value) {
+    for (int k = 0; k < 4; k++)
+        at[k] = static_cast<uint8_t>(value >> (8 * k));
+}
+
+static void putInt64(uint8_t *at, uint64_t value) {
+    for (int k = 0; k < 8; k++)
+        at[k] = static_cast<uint8_t>(value >> (8 * k));
+}
+
+static uint64_t getInt64(const uint8_t *at) {
+    uint64_t value = 0;
+    for (int k = 0; k < 8; k++)
+        value |= static_cast<uint64_t>(at[k]) << (8 * k);
+    return value;
+}
+
+int64_filter::int64_filter(std::string_view key) {
+    if (key.size() > BSON_TEMPLATE_KEY_MAX)
+        throw std::length_error("key of bson template is too long");
+    // length, type, key with terminating zero, value, end of document
+    size = static_cast<uint32_t>(4 + 1 + key.size() + 1 + 8 + 1);
+    putInt32(data.data(), size);
+    data[4] = BSON_TYPE_INT64;
+    memcpy(data.data() + 5, key.data(), key.size());
+    data[5 + key.size()] = 0;
+    valueOffset = static_cast<uint32_t>(5 + key.size() + 1);
+    data[size - 1] = 0;
+}
+
+int64_filter int64_filter::operator()(num_t value) const {
+    int64_filter result = *this;
+    putInt64(result.data.data() + valueOffset, static_cast<uint64_t>(value));
+    return result;
+}
+
+bsoncxx::document::view int64_filter::view() const {
+    return {data.data(), size};
+}
+
+bsoncxx::array::view encodeInt64Array(const numvec &values, std::vector<uint8_t> &buffer) {
+    // keys of array are decimal indexes
+    buffer.clear();
+    buffer.resize(4);
+    char key[24];
+    uint8_t value[8];
+    for (size_t k = 0; k < values.size(); k++) {
+        buffer.push_back(BSON_TYPE_INT64);
+        auto end = std::to_chars(key, key + sizeof(key), k).ptr;
+        buffer.insert(buffer.end(), key, end);
+        buffer.push_back(0);
+        putInt64(value, static_cast<uint64_t>(values[k]));
+        buffer.insert(buffer.end(), value, value + sizeof(value));
+    }
+    buffer.push_back(0);
+    putInt32(buffer.data(), static_cast<uint32_t>(buffer.size()));
+    return {buffer.data(), buffer.size()};
+}
+
+void decodeInt64Array(const bsoncxx::document::element &element, numvec &out) {
+    if (!element)
+        return;
+    auto array = element.get_array().value;
+    auto start = out.size();
+    const uint8_t *at = array.data() + 4;
+    const uint8_t *end = array.data() + array.length() - 1;
+    while (at < end) {
+        if (*at != BSON_TYPE_INT64) {
+            // written by someone else, let the driver decode it
+            out.resize(start);
+            for (const auto &it: array) {
+                out.push_back(it.get_int64());
+            }
+            return;
+        }
+        at += 1 + strlen(reinterpret_cast<const char *>(at + 1)) + 1;
+        out.push_back(static_cast<num_t>(getInt64(at)));
+        at += 8;
+    }
+}
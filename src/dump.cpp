@@ -0,0 +1,696 @@
+#include <array>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef UCUTAG_ZLIB
+#include <zlib.h>
+#endif
+
+#include "TagFS.h"
+namespace fs = std::filesystem;
+
+#define DUMP_MAGIC "UCUTAGD1"
+#define DUMP_VERSION 1
+#define DUMP_FLAG_DATA 1                    // archive has contents of files
+// Raw size of records in one block, blocks are compressed and checked independently
+#define DUMP_BLOCK_SIZE (1 << 20)
+// File data in one record
+#define DUMP_DATA_PIECE (256 * 1024)
+// Number of documents inserted by restore in one request
+#define DUMP_BULK_SIZE 1000
+
+// Archive is a header followed by blocks, every block has records of one kind:
+//     header:  magic[8] version:u32 flags:u32
+//     block:   kind:u8 codec:u8 raw_size:u32 stored_size:u32 crc32_of_raw:u32 stored[stored_size]
+// Integers in records are varints, signed ones zigzag encoded, strings are prefixed by length.
+// The last block has counts of records of every kind, so truncated archive is detected.
+namespace {
+    enum dump_kind : uint8_t {
+        DUMP_TAGS = 1,                      // id type name parents... files bytes mtime
+        DUMP_POSTINGS,                      // tag encoded_inodes, records of tag follow each other
+        DUMP_FILE_TAGS,                     // inode tags...
+        DUMP_FILENAMES,                     // inode filename
+        DUMP_TIMES,                         // inode mtime
+        DUMP_VALUES,                        // inode key value
+        DUMP_FILES,                         // 0 inode offset bytes | 1 inode mode mtime_sec mtime_nsec link
+        DUMP_END,                           // count of every kind above
+    };
+    enum dump_codec : uint8_t { DUMP_RAW = 0, DUMP_ZLIB = 1 };
+    enum dump_file_record : uint8_t { DUMP_FILE_DATA = 0, DUMP_FILE_META = 1 };
+
+    uint32_t crc32Of(const std::string &data) {
+        static const auto table = []() {
+            std::array<uint32_t, 256> result{};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                result[i] = c;
+            }
+            return result;
+        }();
+        uint32_t crc = 0xFFFFFFFF;
+        for (unsigned char c: data)
+            crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFF;
+    }
+
+    void putU32(std::string &out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+
+    uint32_t getU32(const char *in) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++)
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        return value;
+    }
+
+    class record_writer {
+    public:
+        std::string buffer;
+
+        void putVarint(uint64_t value) {
+            while (value >= 0x80) {
+                buffer.push_back(static_cast<char>((value & 0x7F) | 0x80));
+                value >>= 7;
+            }
+            buffer.push_back(static_cast<char>(value));
+        }
+
+        void putSigned(int64_t value) {
+            putVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+        }
+
+        void putString(const std::string &value) {
+            putVarint(value.size());
+            buffer += value;
+        }
+    };
+
+    class record_reader {
+    private:
+        const std::string &buffer;
+        size_t pos = 0;
+    public:
+        explicit record_reader(const std::string &buffer) : buffer(buffer) {}
+
+        bool done() const {
+            return pos >= buffer.size();
+        }
+
+        uint64_t getVarint() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (pos >= buffer.size())
+                    throw std::runtime_error("record is cut");
+                auto byte = static_cast<unsigned char>(buffer[pos++]);
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+            throw std::runtime_error("varint is too long");
+        }
+
+        int64_t getSigned() {
+            auto value = getVarint();
+            return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+        }
+
+        std::string getString() {
+            auto size = getVarint();
+            if (size > buffer.size() - pos)
+                throw std::runtime_error("record is cut");
+            auto value = buffer.substr(pos, size);
+            pos += size;
+            return value;
+        }
+    };
+
+    std::string frameBlock(uint8_t kind, const std::string &raw) {
+        uint8_t codec = DUMP_RAW;
+        std::string stored;
+#ifdef UCUTAG_ZLIB
+        uLongf size = compressBound(raw.size());
+        stored.resize(size);
+        if (compress2(reinterpret_cast<Bytef *>(stored.data()), &size,
+                      reinterpret_cast<const Bytef *>(raw.data()), raw.size(), Z_DEFAULT_COMPRESSION) == Z_OK &&
+            size < raw.size()) {
+            stored.resize(size);
+            codec = DUMP_ZLIB;
+        }
+#endif
+        if (codec == DUMP_RAW)
+            stored = raw;
+        std::string block;
+        block.push_back(static_cast<char>(kind));
+        block.push_back(static_cast<char>(codec));
+        putU32(block, raw.size());
+        putU32(block, stored.size());
+        putU32(block, crc32Of(raw));
+        return block + stored;
+    }
+
+    std::string unframeBlock(uint8_t codec, uint32_t rawSize, uint32_t crc, const std::string &stored) {
+        std::string raw;
+        if (codec == DUMP_RAW) {
+            raw = stored;
+        } else if (codec == DUMP_ZLIB) {
+#ifdef UCUTAG_ZLIB
+            raw.resize(rawSize);
+            uLongf size = rawSize;
+            if (uncompress(reinterpret_cast<Bytef *>(raw.data()), &size,
+                           reinterpret_cast<const Bytef *>(stored.data()), stored.size()) != Z_OK || size != rawSize)
+                throw std::runtime_error("block can't be decompressed");
+#else
+            throw std::runtime_error("block is compressed, but zlib is not compiled in");
+#endif
+        } else {
+            throw std::runtime_error("unknown codec of block");
+        }
+        if (raw.size() != rawSize || crc32Of(raw) != crc)
+            throw std::runtime_error("checksum of block does not match");
+        return raw;
+    }
+
+    // blocks are compressed by worker threads, and written in order of submission
+    class block_writer {
+    private:
+        std::ostream &out;
+        std::deque<std::future<std::string>> pending;
+        size_t maxPending = std::max(2u, std::thread::hardware_concurrency());
+
+        void writeOne() {
+            auto block = pending.front().get();
+            pending.pop_front();
+            out.write(block.data(), static_cast<std::streamsize>(block.size()));
+            if (!out)
+                throw std::runtime_error("could not write archive");
+        }
+    public:
+        std::array<uint64_t, DUMP_END> counts{};
+
+        explicit block_writer(std::ostream &out) : out(out) {}
+
+        void submit(uint8_t kind, std::string raw) {
+            pending.push_back(std::async(std::launch::async, [kind, raw = std::move(raw)]() {
+                return frameBlock(kind, raw);
+            }));
+            while (pending.size() > maxPending)
+                writeOne();
+        }
+
+        void finish() {
+            record_writer end;
+            for (auto count: counts)
+                end.putVarint(count);
+            submit(DUMP_END, end.buffer);
+            while (!pending.empty())
+                writeOne();
+            out.flush();
+            if (!out)
+                throw std::runtime_error("could not write archive");
+        }
+    };
+
+    // records of one kind, cut into blocks
+    class section {
+    private:
+        block_writer &blocks;
+        uint8_t kind;
+        record_writer current;
+    public:
+        section(block_writer &blocks, uint8_t kind) : blocks(blocks), kind(kind) {}
+        ~section() {
+            if (!current.buffer.empty())
+                blocks.submit(kind, std::move(current.buffer));
+        }
+
+        record_writer &record() {
+            blocks.counts[kind]++;
+            return current;
+        }
+
+        void done() {
+            if (current.buffer.size() >= DUMP_BLOCK_SIZE) {
+                blocks.submit(kind, std::move(current.buffer));
+                current.buffer.clear();
+            }
+        }
+    };
+
+    // blocks are read ahead and checked by worker threads, and returned in order
+    class block_reader {
+    private:
+        std::istream &in;
+        std::deque<std::future<std::pair<uint8_t, std::string>>> ahead;
+        size_t maxAhead = std::max(2u, std::thread::hardware_concurrency());
+        bool eof = false;
+
+        void readOne() {
+            char header[14];
+            in.read(header, sizeof(header));
+            if (in.gcount() == 0) {
+                eof = true;
+                return;
+            }
+            if (in.gcount() != sizeof(header))
+                throw std::runtime_error("archive is truncated");
+            auto kind = static_cast<uint8_t>(header[0]);
+            auto codec = static_cast<uint8_t>(header[1]);
+            auto rawSize = getU32(header + 2);
+            auto storedSize = getU32(header + 6);
+            auto crc = getU32(header + 10);
+            std::string stored(storedSize, '\0');
+            in.read(stored.data(), storedSize);
+            if (static_cast<uint32_t>(in.gcount()) != storedSize)
+                throw std::runtime_error("archive is truncated");
+            ahead.push_back(std::async(std::launch::async, [=, stored = std::move(stored)]() {
+                return std::make_pair(kind, unframeBlock(codec, rawSize, crc, stored));
+            }));
+        }
+    public:
+        explicit block_reader(std::istream &in) : in(in) {}
+
+        bool next(uint8_t &kind, std::string &raw) {
+            while (!eof && ahead.size() < maxAhead)
+                readOne();
+            if (ahead.empty())
+                return false;
+            std::tie(kind, raw) = ahead.front().get();
+            ahead.pop_front();
+            return true;
+        }
+    };
+
+    // inserts of restored documents, sent in unordered bulks
+    class bulk_inserter {
+    private:
+        mongocxx::collection &collection;
+        std::vector<bsoncxx::document::value> documents;
+    public:
+        explicit bulk_inserter(mongocxx::collection &collection) : collection(collection) {}
+
+        void append(bsoncxx::document::value document) {
+            documents.push_back(std::move(document));
+            if (documents.size() >= DUMP_BULK_SIZE)
+                flush();
+        }
+
+        void flush() {
+            if (documents.empty())
+                return;
+            mongocxx::options::insert opts{};
+            opts.ordered(false);
+            if (!collection.insert_many(documents, opts))
+                throw std::runtime_error("could not insert into " + collection.name());
+            documents.clear();
+        }
+    };
+}
+
+
+int TagFS::dumpFS(const std::string &archive, bool withData) {
+    try {
+        std::ofstream file;
+        std::ostream *out = &std::cout;
+        if (archive != "-") {
+            file.open(archive, std::ios::binary | std::ios::trunc);
+            if (!file)
+                throw std::runtime_error("could not create " + archive);
+            out = &file;
+        }
+        std::string header = DUMP_MAGIC;
+        putU32(header, DUMP_VERSION);
+        putU32(header, withData ? DUMP_FLAG_DATA : 0);
+        out->write(header.data(), static_cast<std::streamsize>(header.size()));
+
+        block_writer blocks{*out};
+        auto opts = mongocxx::options::find{};
+        opts.batch_size(10000);
+        {
+            section tagsSection{blocks, DUMP_TAGS};
+            for (const auto &doc: tags.find({}, opts)) {
+                auto tag = tagFromDocument(doc);
+                auto &record = tagsSection.record();
+                record.putSigned(doc[_ID].get_int64());
+                record.putVarint(tag.type);
+                record.putString(tag.name);
+                record.putVarint(tag.parents.size());
+                for (auto parentId: tag.parents)
+                    record.putSigned(parentId);
+                record.putSigned(tag.stats.files);
+                record.putSigned(tag.stats.bytes);
+                record.putSigned(tag.stats.mtime);
+                tagsSection.done();
+            }
+        }
+        {
+            // chunks are already delta encoded, they are copied as they are
+            auto chunkOpts = mongocxx::options::find{};
+            chunkOpts.batch_size(1000);
+            chunkOpts.sort(document{} << TAG_ID << 1 << CHUNK << 1 << finalize);
+            // posting list of a tag is whole on one shard, so its chunks stay together
+            section postings{blocks, DUMP_POSTINGS};
+            for (auto &shard: shards) {
+                for (const auto &doc: shard.tagToInode.find({}, chunkOpts)) {
+                    auto &record = postings.record();
+                    record.putSigned(doc[TAG_ID].get_int64());
+                    record.putString(encodePostings(postingChunkInodes(doc)));
+                    postings.done();
+                }
+            }
+        }
+        {
+            section fileTags{blocks, DUMP_FILE_TAGS};
+            for (auto &shard: shards) {
+                for (const auto &doc: shard.inodeToTag.find({}, opts)) {
+                    auto &record = fileTags.record();
+                    record.putSigned(doc[_ID].get_int64());
+                    numvec tagIds;
+                    for (const auto &tagId: doc[TAGS].get_array().value)
+                        tagIds.push_back(tagId.get_int64());
+                    record.putVarint(tagIds.size());
+                    for (auto tagId: tagIds)
+                        record.putSigned(tagId);
+                    fileTags.done();
+                }
+            }
+        }
+        {
+            section filenames{blocks, DUMP_FILENAMES};
+            for (auto &shard: shards) {
+                for (const auto &doc: shard.inodetoFilename.find({}, opts)) {
+                    auto &record = filenames.record();
+                    record.putSigned(doc[_ID].get_int64());
+                    record.putString(doc[FILENAME].get_utf8().value.to_string());
+                    filenames.done();
+                }
+            }
+        }
+        {
+            section times{blocks, DUMP_TIMES};
+            for (auto &shard: shards) {
+                for (const auto &doc: shard.inodeToTime.find({}, opts)) {
+                    auto &record = times.record();
+                    record.putSigned(doc[_ID].get_int64());
+                    record.putSigned(doc[MTIME].get_int64());
+                    times.done();
+                }
+            }
+        }
+        {
+            section values{blocks, DUMP_VALUES};
+            for (auto &shard: shards) {
+                for (const auto &doc: shard.inodeToValue.find({}, opts)) {
+                    auto &record = values.record();
+                    record.putSigned(doc[INODE].get_int64());
+                    record.putString(doc[KEY].get_utf8().value.to_string());
+                    record.putString(doc[VALUE].get_utf8().value.to_string());
+                    values.done();
+                }
+            }
+        }
+        if (withData) {
+            // contents go before metadata of file, so restore sets mode and time after writing
+            section files{blocks, DUMP_FILES};
+            std::string piece(DUMP_DATA_PIECE, '\0');
+            for (const auto &entry: fs::directory_iterator(fs_files_dir)) {
+                auto name = entry.path().filename().string();
+                if (name.empty() || !std::all_of(name.begin(), name.end(), ::isdigit))
+                    continue;
+                num_t inode = std::stoll(name);
+                struct stat st{};
+                if (fstatat(fdCache.dirFd(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    throw std::runtime_error("could not stat file " + name);
+
+                std::string link;
+                if (S_ISREG(st.st_mode)) {
+                    int fd = openat(fdCache.dirFd(), name.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fd == -1)
+                        throw std::runtime_error("could not open file " + name);
+                    off_t offset = 0;
+                    ssize_t res;
+                    while ((res = pread(fd, piece.data(), piece.size(), offset)) > 0) {
+                        auto &record = files.record();
+                        record.putVarint(DUMP_FILE_DATA);
+                        record.putSigned(inode);
+                        record.putVarint(offset);
+                        record.putString(piece.substr(0, res));
+                        files.done();
+                        offset += res;
+                    }
+                    close(fd);
+                    if (res == -1)
+                        throw std::runtime_error("could not read file " + name);
+                } else if (S_ISLNK(st.st_mode)) {
+                    link.resize(PATH_MAX);
+                    auto res = readlinkat(fdCache.dirFd(), name.c_str(), link.data(), link.size());
+                    if (res == -1)
+                        throw std::runtime_error("could not read link " + name);
+                    link.resize(res);
+                }
+                auto &record = files.record();
+                record.putVarint(DUMP_FILE_META);
+                record.putSigned(inode);
+                record.putVarint(st.st_mode);
+                record.putSigned(st.st_mtim.tv_sec);
+                record.putSigned(st.st_mtim.tv_nsec);
+                record.putString(link);
+                files.done();
+            }
+        }
+        blocks.finish();
+    } catch (std::exception &e) {
+        std::cerr << "Error: dump failed: " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+int TagFS::restoreFS(const std::string &archive) {
+    std::error_code ec;
+    if (tags.estimated_document_count() != 0 || !fs::is_empty(fs_files_dir, ec)) {
+        std::cerr << "Error: restore needs new file system, remove " << fs_files_dir << " first" << std::endl;
+        return -1;
+    }
+    try {
+        std::ifstream file;
+        std::istream *in = &std::cin;
+        if (archive != "-") {
+            file.open(archive, std::ios::binary);
+            if (!file)
+                throw std::runtime_error("could not open " + archive);
+            in = &file;
+        }
+        char header[16];
+        in->read(header, sizeof(header));
+        if (in->gcount() != sizeof(header) || memcmp(header, DUMP_MAGIC, 8) != 0)
+            throw std::runtime_error("not an archive of file system");
+        if (getU32(header + 8) != DUMP_VERSION)
+            throw std::runtime_error("unsupported version of archive");
+        if (!(getU32(header + 12) & DUMP_FLAG_DATA))
+            std::cout << "Warning: archive has no contents of files, copy them to " << fs_files_dir << std::endl;
+
+        // records are routed to shard of their tag or inode, which may differ from the dumped one
+        bulk_inserter tagsInserter{tags};
+        std::vector<bulk_inserter> postingsInserters, fileTagsInserters, filenamesInserters, timesInserters,
+                valuesInserters;
+        for (auto &shard: shards) {
+            postingsInserters.emplace_back(shard.tagToInode);
+            fileTagsInserters.emplace_back(shard.inodeToTag);
+            filenamesInserters.emplace_back(shard.inodetoFilename);
+            timesInserters.emplace_back(shard.inodeToTime);
+            valuesInserters.emplace_back(shard.inodeToValue);
+        }
+        std::unordered_map<num_t, std::string> tagNames;
+        std::vector<std::pair<num_t, numvec>> tagParents;
+        std::array<uint64_t, DUMP_END> counts{};
+
+        // posting list of one tag is gathered from its records and cut into chunks anew
+        num_t postingTag = 0;
+        numvec postingInodes;
+        bool postingOpen = false;
+        auto flushPosting = [&]() {
+            if (!postingOpen)
+                return;
+            auto pieces = splitPostings(postingInodes, POSTING_CHUNK_SIZE);
+            for (size_t k = 0; k < pieces.size(); k++) {
+                auto chunk = k == 0 ? std::numeric_limits<num_t>::min() : pieces[k].front();
+                postingsInserters[tagShardIndex(postingTag)].append(postingChunkDocument(postingTag, chunk, pieces[k]));
+            }
+            postingInodes.clear();
+            postingOpen = false;
+        };
+
+        // file which is being written, data of one file follow each other
+        num_t openInode = -1;
+        int openFd = -1;
+        auto closeOpen = [&]() {
+            if (openFd != -1)
+                close(openFd);
+            openFd = -1;
+            openInode = -1;
+        };
+
+        bool ended = false;
+        uint8_t kind;
+        std::string raw;
+        block_reader blocks{*in};
+        while (!ended && blocks.next(kind, raw)) {
+            record_reader record{raw};
+            while (!record.done()) {
+                if (kind < DUMP_END)
+                    counts[kind]++;
+                switch (kind) {
+                    case DUMP_TAGS: {
+                        num_t tagId = record.getSigned();
+                        num_t type = record.getVarint();
+                        auto name = record.getString();
+                        numvec parents(record.getVarint());
+                        for (auto &parentId: parents)
+                            parentId = record.getSigned();
+                        num_t files = record.getSigned();
+                        num_t bytes = record.getSigned();
+                        num_t mtime = record.getSigned();
+                        tagsInserter.append(document{} << _ID << tagId << TAG_NAME << name << TAG_TYPE << type
+                                                       << FILES << files << BYTES << bytes << MTIME << mtime << finalize);
+                        tagNames[tagId] = name;
+                        if (!parents.empty())
+                            tagParents.emplace_back(tagId, std::move(parents));
+                        break;
+                    }
+                    case DUMP_POSTINGS: {
+                        num_t tagId = record.getSigned();
+                        auto encoded = record.getString();
+                        if (postingOpen && tagId != postingTag)
+                            flushPosting();
+                        postingTag = tagId;
+                        postingOpen = true;
+                        auto inodes = decodePostings(reinterpret_cast<const uint8_t *>(encoded.data()), encoded.size());
+                        postingInodes.insert(postingInodes.end(), inodes.begin(), inodes.end());
+                        break;
+                    }
+                    case DUMP_FILE_TAGS: {
+                        num_t inode = record.getSigned();
+                        auto tagIds = bsoncxx::builder::basic::array{};
+                        for (auto n = record.getVarint(); n > 0; n--)
+                            tagIds.append(static_cast<num_t>(record.getSigned()));
+                        fileTagsInserters[inodeShardIndex(inode)].append(document{} << _ID << inode << TAGS << tagIds.view() << finalize);
+                        break;
+                    }
+                    case DUMP_FILENAMES: {
+                        num_t inode = record.getSigned();
+                        auto filename = record.getString();
+                        filenamesInserters[inodeShardIndex(inode)].append(
+                                document{} << _ID << inode << FILENAME << filename
+                                           << LOWER_FILENAME << toLower(filename) << finalize);
+                        break;
+                    }
+                    case DUMP_TIMES: {
+                        num_t inode = record.getSigned();
+                        num_t mtime = record.getSigned();
+                        timesInserters[inodeShardIndex(inode)].append(document{} << _ID << inode << MTIME << mtime << finalize);
+                        break;
+                    }
+                    case DUMP_VALUES: {
+                        num_t inode = record.getSigned();
+                        auto key = record.getString();
+                        auto value = parseTagValue(record.getString());
+                        auto doc = bsoncxx::builder::basic::document{};
+                        doc.append(kvp(INODE, inode), kvp(KEY, key), kvp(VALUE, value.text));
+                        if (value.numeric)
+                            doc.append(kvp(NUMBER, value.number));
+                        valuesInserters[inodeShardIndex(inode)].append(doc.extract());
+                        break;
+                    }
+                    case DUMP_FILES: {
+                        auto type = record.getVarint();
+                        num_t inode = record.getSigned();
+                        auto name = std::to_string(inode);
+                        if (type == DUMP_FILE_DATA) {
+                            auto offset = static_cast<off_t>(record.getVarint());
+                            auto data = record.getString();
+                            if (openInode != inode) {
+                                closeOpen();
+                                openFd = openat(fdCache.dirFd(), name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+                                if (openFd == -1)
+                                    throw std::runtime_error("could not create file " + name);
+                                openInode = inode;
+                            }
+                            if (pwrite(openFd, data.data(), data.size(), offset) != static_cast<ssize_t>(data.size()))
+                                throw std::runtime_error("could not write file " + name);
+                            break;
+                        }
+                        auto mode = static_cast<mode_t>(record.getVarint());
+                        struct timespec times[2]{};
+                        times[0].tv_sec = times[1].tv_sec = record.getSigned();
+                        times[0].tv_nsec = times[1].tv_nsec = record.getSigned();
+                        auto link = record.getString();
+                        closeOpen();
+                        int res = 0;
+                        if (S_ISLNK(mode)) {
+                            res = symlinkat(link.c_str(), fdCache.dirFd(), name.c_str());
+                        } else if (S_ISREG(mode)) {
+                            int fd = openat(fdCache.dirFd(), name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+                            res = fd == -1 ? -1 : close(fd);
+                        } else {
+                            res = mknodat(fdCache.dirFd(), name.c_str(), mode, 0);
+                        }
+                        if (res == -1)
+                            throw std::runtime_error("could not create file " + name);
+                        if (!S_ISLNK(mode))
+                            fchmodat(fdCache.dirFd(), name.c_str(), mode & 07777, 0);
+                        utimensat(fdCache.dirFd(), name.c_str(), times, AT_SYMLINK_NOFOLLOW);
+                        break;
+                    }
+                    case DUMP_END: {
+                        for (size_t k = 1; k < DUMP_END; k++) {
+                            if (record.getVarint() != counts[k])
+                                throw std::runtime_error("archive misses records");
+                        }
+                        ended = true;
+                        break;
+                    }
+                    default:
+                        throw std::runtime_error("unknown kind of block");
+                }
+            }
+        }
+        closeOpen();
+        if (!ended)
+            throw std::runtime_error("archive is truncated");
+        flushPosting();
+        tagsInserter.flush();
+        for (auto *inserters: {&postingsInserters, &fileTagsInserters, &filenamesInserters,
+                               &timesInserters, &valuesInserters}) {
+            for (auto &inserter: *inserters)
+                inserter.flush();
+        }
+
+        // hierarchy goes through the usual path, so that closures are materialized over restored postings
+        for (auto &[tagId, parents]: tagParents) {
+            strvec parentNames;
+            for (auto parentId: parents)
+                parentNames.push_back(tagNames[parentId]);
+            if (setTagParents(tagNames[tagId], parentNames) != 0)
+                throw std::runtime_error("could not restore parents of tag " + tagNames[tagId]);
+        }
+        tagSetToInodeBuild();
+    } catch (std::exception &e) {
+        std::cerr << "Error: restore failed: " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
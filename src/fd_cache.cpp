@@ -0,0 +1,63 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fd_cache.h"
+
+fd_holder::~fd_holder() {
+    if (fd >= 0)
+        close(fd);
+}
+
+FdCache::FdCache(size_t capacity) : capacity(capacity) {}
+
+int FdCache::openDir(const std::string &files_dir) {
+    int fd = open(files_dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    std::lock_guard<std::mutex> lock{mutex};
+    dir = std::make_shared<fd_holder>(fd);
+    lru.clear();
+    index.clear();
+    return 0;
+}
+
+int FdCache::dirFd() const {
+    return dir ? dir->fd : -1;
+}
+
+fdptr FdCache::get(num_t inode) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = index.find(inode);
+    if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    int fd = openat(dirFd(), std::to_string(inode).c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+    auto holder = std::make_shared<fd_holder>(fd);
+    lru.emplace_front(inode, holder);
+    index[inode] = lru.begin();
+    if (lru.size() > capacity) {
+        // descriptor is closed when the last user releases it
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+    return holder;
+}
+
+void FdCache::forget(num_t inode) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = index.find(inode);
+    if (it != index.end()) {
+        lru.erase(it->second);
+        index.erase(it);
+    }
+}
+
+void FdCache::clear() {
+    std::lock_guard<std::mutex> lock{mutex};
+    lru.clear();
+    index.clear();
+}
@@ -0,0 +1,463 @@
+#include <thread>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <mongocxx/options/bulk_write.hpp>
+#include <mongocxx/model/write.hpp>
+
+#include "TagFS.h"
+namespace fs = std::filesystem;
+
+// Maximal number of inodes checked in one pass, bounds memory used by hash joins
+#define FSCK_PARTITION_SIZE (1 << 21)
+// Number of repairing writes sent to the db in one bulk request
+#define FSCK_BULK_SIZE 1000
+// Number of reported problems of the same kind
+#define FSCK_REPORT_LIMIT 10
+// Where repair puts backing files which has no metadata
+#define FSCK_LOST_FOUND "lost+found"
+
+namespace {
+    struct pair_hash {
+        std::size_t operator()(const std::pair<num_t, num_t> &p) const {
+            return std::hash<num_t>()(p.first) ^ (std::hash<num_t>()(p.second) << 1);
+        }
+    };
+    // (tagId, inode)
+    typedef std::unordered_set<std::pair<num_t, num_t>, pair_hash> pairset;
+
+    // everything one pass knows about its partition, every field is filled by scanners of its collection,
+    // which merge what they found on their shard under the mutex
+    struct fsck_pass {
+        std::mutex mutex;
+        inodeset postingTags;                            // ids of all tagToInode documents
+        pairset postings;                                // tagToInode entries with inode in partition
+        pairset inodeTags;                               // inodeToTag entries with inode in partition
+        inodeset metaInodes;                             // inodeToTag documents in partition
+        std::unordered_map<num_t, std::string> filenames;
+        std::unordered_map<num_t, tag_t> tags;           // tags in partition
+        std::unordered_map<std::string, num_t> tagIds;   // ids of all tags by name
+        inodeset files;                                  // backing files in partition
+        inodeset timeInodes;                             // inodeToTime documents in partition
+        inodeset valueInodes;                            // inodes of inodeToValue documents in partition
+        pairset tagSets;                                 // (hash, inode) tagSetToInode entries with inode in partition
+    };
+
+    inline num_t partitionOf(num_t id, num_t partitions) {
+        return ((id % partitions) + partitions) % partitions;
+    }
+
+    class fsck_reporter {
+    private:
+        std::map<std::string, size_t> problems;
+    public:
+        size_t repaired = 0;
+
+        void report(const std::string &kind, const std::string &what) {
+            if (problems[kind]++ < FSCK_REPORT_LIMIT) {
+                std::cout << "fsck: " << kind << ": " << what << std::endl;
+            }
+        }
+
+        // prints totals of kinds which were not reported completely
+        size_t summarize() const {
+            size_t res = 0;
+            for (auto &[kind, count]: problems) {
+                if (count > FSCK_REPORT_LIMIT) {
+                    std::cout << "fsck: " << kind << ": " << count << " in total" << std::endl;
+                }
+                res += count;
+            }
+            return res;
+        }
+    };
+
+    // accumulates writes to one collection and sends them in unordered bulks
+    class bulk_writer {
+    private:
+        mongocxx::collection &collection;
+        std::vector<mongocxx::model::write> writes;
+    public:
+        explicit bulk_writer(mongocxx::collection &collection) : collection(collection) {}
+
+        int append(mongocxx::model::write write) {
+            writes.push_back(std::move(write));
+            if (writes.size() >= FSCK_BULK_SIZE)
+                return flush();
+            return 0;
+        }
+
+        int flush() {
+            if (writes.empty())
+                return 0;
+            mongocxx::options::bulk_write opts{};
+            opts.ordered(false);
+            auto res = collection.bulk_write(writes, opts);
+            writes.clear();
+            if (!res)
+                return -1;
+            return 0;
+        }
+    };
+}
+
+
+int TagFS::checkFS(bool repair) {
+    num_t inodeCount = 0;
+    for (auto &shard: shards) {
+        inodeCount += static_cast<num_t>(shard.inodeToTag.estimated_document_count());
+    }
+    num_t partitions = inodeCount / FSCK_PARTITION_SIZE + 1;
+    fsck_reporter reporter;
+
+    // repairs go to shard of their posting list or inode
+    std::vector<bulk_writer> tagToInodeWriters, inodeToTagWriters, inodetoFilenameWriters;
+    std::vector<bulk_writer> inodeToTimeWriters, inodeToValueWriters, tagSetToInodeWriters;
+    for (auto &shard: shards) {
+        tagToInodeWriters.emplace_back(shard.tagToInode);
+        inodeToTagWriters.emplace_back(shard.inodeToTag);
+        inodetoFilenameWriters.emplace_back(shard.inodetoFilename);
+        inodeToTimeWriters.emplace_back(shard.inodeToTime);
+        inodeToValueWriters.emplace_back(shard.inodeToValue);
+        tagSetToInodeWriters.emplace_back(shard.tagSetToInode);
+    }
+    auto tagToInodeWriter = [&](num_t tagId) -> bulk_writer & { return tagToInodeWriters[tagShardIndex(tagId)]; };
+    auto inodeToTagWriter = [&](num_t inode) -> bulk_writer & { return inodeToTagWriters[inodeShardIndex(inode)]; };
+    auto inodetoFilenameWriter = [&](num_t inode) -> bulk_writer & { return inodetoFilenameWriters[inodeShardIndex(inode)]; };
+    auto inodeToTimeWriter = [&](num_t inode) -> bulk_writer & { return inodeToTimeWriters[inodeShardIndex(inode)]; };
+    auto inodeToValueWriter = [&](num_t inode) -> bulk_writer & { return inodeToValueWriters[inodeShardIndex(inode)]; };
+    auto tagSetToInodeWriter = [&](num_t hash) -> bulk_writer & { return tagSetToInodeWriters[tagShardIndex(hash)]; };
+
+    if (repair) {
+        fs::create_directories(fs::path(fs_files_dir) / FSCK_LOST_FOUND);
+    }
+
+    for (num_t partition = 0; partition < partitions; partition++) {
+#ifdef DEBUG
+        std::cout << "fsck: pass " << partition + 1 << "/" << partitions << std::endl;
+#endif
+        fsck_pass pass{};
+
+        // select documents which id falls into partition, negative ids are taken into account
+        auto partitionFilter = [&](const std::string &field) -> bsoncxx::document::value {
+            if (partitions == 1)
+                return document{} << finalize;
+            return document{} <<
+                OR << open_array <<
+                    open_document << field << open_document << MOD << open_array << partitions << partition << close_array << close_document << close_document <<
+                    open_document << field << open_document << MOD << open_array << partitions << partition - partitions << close_array << close_document << close_document <<
+                close_array << finalize;
+        };
+        bsoncxx::document::value filter = partitionFilter(_ID);
+        bsoncxx::document::value inodeFilter = partitionFilter(INODE);
+        auto opts = mongocxx::options::find{};
+        opts.batch_size(10000);
+
+        // every collection of every shard is streamed by own cursor over own connection
+        std::vector<std::tuple<std::string, std::string, std::function<void(mongocxx::database &)>>> scanners;
+        for (const auto &shard: shards) {
+            scanners.emplace_back("tagToInode", shard.uri, [&](mongocxx::database &scan_db) {
+                inodeset postingTags;
+                pairset postings;
+                for (const auto &doc: scan_db["tagToInode"].find({}, opts)) {
+                    num_t tagId = doc[TAG_ID].get_int64();
+                    postingTags.insert(tagId);
+                    for (auto inode: postingChunkInodes(doc)) {
+                        if (partitionOf(inode, partitions) == partition)
+                            postings.insert({tagId, inode});
+                    }
+                }
+                std::lock_guard<std::mutex> lock{pass.mutex};
+                pass.postingTags.merge(postingTags);
+                pass.postings.merge(postings);
+            });
+            scanners.emplace_back("inodeToTag", shard.uri, [&](mongocxx::database &scan_db) {
+                inodeset metaInodes;
+                pairset inodeTags;
+                for (const auto &doc: scan_db["inodeToTag"].find(filter.view(), opts)) {
+                    num_t inode = doc[_ID].get_int64();
+                    metaInodes.insert(inode);
+                    for (const auto &it: doc[TAGS].get_array().value) {
+                        inodeTags.insert({it.get_int64(), inode});
+                    }
+                }
+                std::lock_guard<std::mutex> lock{pass.mutex};
+                pass.metaInodes.merge(metaInodes);
+                pass.inodeTags.merge(inodeTags);
+            });
+            scanners.emplace_back("inodetoFilename", shard.uri, [&](mongocxx::database &scan_db) {
+                std::unordered_map<num_t, std::string> filenames;
+                for (const auto &doc: scan_db["inodetoFilename"].find(filter.view(), opts)) {
+                    filenames[doc[_ID].get_int64()] = doc[FILENAME].get_utf8().value.to_string();
+                }
+                std::lock_guard<std::mutex> lock{pass.mutex};
+                pass.filenames.merge(filenames);
+            });
+            scanners.emplace_back("inodeToTime", shard.uri, [&](mongocxx::database &scan_db) {
+                inodeset timeInodes;
+                for (const auto &doc: scan_db["inodeToTime"].find(filter.view(), opts)) {
+                    timeInodes.insert(doc[_ID].get_int64());
+                }
+                std::lock_guard<std::mutex> lock{pass.mutex};
+                pass.timeInodes.merge(timeInodes);
+            });
+            scanners.emplace_back("inodeToValue", shard.uri, [&](mongocxx::database &scan_db) {
+                inodeset valueInodes;
+                for (const auto &doc: scan_db["inodeToValue"].find(inodeFilter.view(), opts)) {
+                    valueInodes.insert(doc[INODE].get_int64());
+                }
+                std::lock_guard<std::mutex> lock{pass.mutex};
+                pass.valueInodes.merge(valueInodes);
+            });
+            // entries are keyed by hash of tag set, inodes of partition are picked from all of them
+            scanners.emplace_back("tagSetToInode", shard.uri, [&](mongocxx::database &scan_db) {
+                pairset tagSets;
+                for (const auto &doc: scan_db["tagSetToInode"].find({}, opts)) {
+                    num_t inode = doc[INODE].get_int64();
+                    if (partitionOf(inode, partitions) == partition)
+                        tagSets.insert({doc[_ID].get_int64(), inode});
+                }
+                std::lock_guard<std::mutex> lock{pass.mutex};
+                pass.tagSets.merge(tagSets);
+            });
+        }
+        // all tags are streamed, filenames of partition are looked up by name among them
+        scanners.emplace_back("tags", shards.front().uri, [&](mongocxx::database &scan_db) {
+            for (const auto &doc: scan_db["tags"].find({}, opts)) {
+                num_t tagId = doc[_ID].get_int64();
+                auto name = doc[TAG_NAME].get_utf8().value.to_string();
+                auto [it, inserted] = pass.tagIds.emplace(name, tagId);
+                if (!inserted) {
+                    // reported by pass of the greater id only
+                    num_t other = std::max(it->second, tagId);
+                    if (partitionOf(other, partitions) == partition)
+                        reporter.report("duplicate tag name", name + " " + std::to_string(std::min(it->second, tagId)) +
+                                                              " " + std::to_string(other));
+                }
+                if (partitionOf(tagId, partitions) == partition)
+                    pass.tags[tagId] = {.type=doc[TAG_TYPE].get_int64(), .name=std::move(name)};
+            }
+        });
+        scanners.emplace_back(fs_files_dir, shards.front().uri, [&](mongocxx::database &) {
+            for (const auto &entry: fs::directory_iterator(fs_files_dir)) {
+                auto name = entry.path().filename().string();
+                if (name.empty() || !std::all_of(name.begin(), name.end(), ::isdigit))
+                    continue;
+                num_t inode = std::stoll(name);
+                if (partitionOf(inode, partitions) == partition)
+                    pass.files.insert(inode);
+            }
+        });
+
+        std::vector<std::thread> threads;
+        std::vector<std::string> errors(scanners.size());
+        for (size_t i = 0; i < scanners.size(); i++) {
+            threads.emplace_back([&, i]() {
+                try {
+                    mongocxx::client scan_client{mongocxx::uri{std::get<1>(scanners[i])}};
+                    mongocxx::database scan_db = scan_client[db_name];
+                    std::get<2>(scanners[i])(scan_db);
+                } catch (std::exception &e) {
+                    errors[i] = e.what();
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        for (size_t i = 0; i < scanners.size(); i++) {
+            if (!errors[i].empty()) {
+                std::cerr << "Error: fsck could not read " << std::get<0>(scanners[i]) << " of "
+                          << std::get<1>(scanners[i]) << ": " << errors[i] << std::endl;
+                return -1;
+            }
+        }
+
+        // tags against posting lists
+        for (auto &[tagId, tag]: pass.tags) {
+            if (!pass.postingTags.count(tagId)) {
+                reporter.report("tag without posting list", tag.name);
+                if (repair) {
+                    tagToInodeWriter(tagId).append(mongocxx::model::insert_one(
+                            postingChunkDocument(tagId, std::numeric_limits<num_t>::min(), {}).view()));
+                    reporter.repaired++;
+                }
+            }
+        }
+        numvec staleTagIds;
+        for (auto tagId: pass.postingTags) {
+            if (partitionOf(tagId, partitions) == partition && !pass.tags.count(tagId)) {
+                reporter.report("posting list without tag", std::to_string(tagId));
+                if (repair) {
+                    tagToInodeWriter(tagId).append(mongocxx::model::delete_many(document{} << TAG_ID << tagId << finalize));
+                    staleTagIds.push_back(tagId);
+                    reporter.repaired++;
+                }
+            }
+        }
+        if (!staleTagIds.empty()) {
+            auto doc = bsoncxx::builder::basic::document{};
+            doc.append(kvp(IN, [&staleTagIds](sub_array child) {
+                for (const auto &tagId: staleTagIds) {
+                    child.append(tagId);
+                }
+            }));
+            for (auto &writer: inodeToTagWriters) {
+                writer.append(mongocxx::model::update_many(
+                        document{} << finalize,
+                        document{} << PULL << open_document << TAGS << doc << close_document << finalize));
+            }
+        }
+
+        // chunks of posting lists are patched after the pass, (added, removed) inodes by tag
+        std::map<num_t, std::pair<numvec, numvec>> postingRepairs;
+
+        // inodes against filenames and backing files
+        inodeset deadInodes;
+        auto isLive = [&pass](num_t inode) {
+            return pass.metaInodes.count(inode) && pass.files.count(inode);
+        };
+        for (auto inode: pass.metaInodes) {
+            if (!pass.files.count(inode)) {
+                reporter.report("inode without backing file", std::to_string(inode));
+                if (repair) {
+                    inodeToTagWriter(inode).append(mongocxx::model::delete_one(document{} << _ID << inode << finalize));
+                    inodetoFilenameWriter(inode).append(mongocxx::model::delete_one(document{} << _ID << inode << finalize));
+                    if (pass.timeInodes.count(inode))
+                        inodeToTimeWriter(inode).append(mongocxx::model::delete_one(document{} << _ID << inode << finalize));
+                    if (pass.valueInodes.count(inode))
+                        inodeToValueWriter(inode).append(mongocxx::model::delete_many(document{} << INODE << inode << finalize));
+                    deadInodes.insert(inode);
+                    reporter.repaired++;
+                }
+                continue;
+            }
+            auto filename = pass.filenames.find(inode);
+            if (filename == pass.filenames.end()) {
+                reporter.report("inode without filename", std::to_string(inode));
+                continue;
+            }
+            auto tagId = pass.tagIds.find(filename->second);
+            if (tagId == pass.tagIds.end() || !pass.inodeTags.count({tagId->second, inode})) {
+                reporter.report("inode is not tagged with own filename", std::to_string(inode) + " " + filename->second);
+            }
+        }
+        for (auto &[inode, filename]: pass.filenames) {
+            if (!pass.metaInodes.count(inode)) {
+                reporter.report("filename without inode", std::to_string(inode) + " " + filename);
+                if (repair) {
+                    inodetoFilenameWriter(inode).append(mongocxx::model::delete_one(document{} << _ID << inode << finalize));
+                    reporter.repaired++;
+                }
+            }
+        }
+        for (auto inode: pass.timeInodes) {
+            if (!pass.metaInodes.count(inode)) {
+                reporter.report("mtime without inode", std::to_string(inode));
+                if (repair) {
+                    inodeToTimeWriter(inode).append(mongocxx::model::delete_one(document{} << _ID << inode << finalize));
+                    reporter.repaired++;
+                }
+            }
+        }
+        for (auto inode: pass.valueInodes) {
+            if (!pass.metaInodes.count(inode)) {
+                reporter.report("values without inode", std::to_string(inode));
+                if (repair) {
+                    inodeToValueWriter(inode).append(mongocxx::model::delete_many(document{} << INODE << inode << finalize));
+                    reporter.repaired++;
+                }
+            }
+        }
+        // entries of removed inodes go away silently, the inode itself was reported
+        for (auto &[hash, inode]: pass.tagSets) {
+            bool orphan = !pass.metaInodes.count(inode);
+            if (orphan)
+                reporter.report("tag set without inode", std::to_string(hash) + " -> " + std::to_string(inode));
+            if (repair && (orphan || deadInodes.count(inode))) {
+                tagSetToInodeWriter(hash).append(mongocxx::model::delete_one(document{} << _ID << hash << INODE << inode << finalize));
+                if (orphan)
+                    reporter.repaired++;
+            }
+        }
+        for (auto inode: pass.files) {
+            if (!pass.metaInodes.count(inode)) {
+                reporter.report("orphan backing file", std::to_string(inode));
+                if (repair) {
+                    std::error_code ec;
+                    fs::rename(fs::path(fs_files_dir) / std::to_string(inode),
+                               fs::path(fs_files_dir) / FSCK_LOST_FOUND / std::to_string(inode), ec);
+                    if (!ec)
+                        reporter.repaired++;
+                }
+            }
+        }
+
+        if (!deadInodes.empty()) {
+            for (auto &[tagId, inode]: pass.postings) {
+                if (deadInodes.count(inode))
+                    postingRepairs[tagId].second.push_back(inode);
+            }
+        }
+
+        // hash join of both directions of tag <-> inode mapping
+        for (auto &[tagId, inode]: pass.postings) {
+            if (pass.inodeTags.count({tagId, inode}))
+                continue;
+            reporter.report("dangling posting", std::to_string(tagId) + " -> " + std::to_string(inode));
+            if (!repair)
+                continue;
+            if (isLive(inode)) {
+                inodeToTagWriter(inode).append(mongocxx::model::update_one(
+                        document{} << _ID << inode << finalize,
+                        document{} << ADD_TO_SET << open_document << TAGS << tagId << close_document << finalize));
+            } else {
+                postingRepairs[tagId].second.push_back(inode);
+            }
+            reporter.repaired++;
+        }
+        for (auto &[tagId, inode]: pass.inodeTags) {
+            if (pass.postings.count({tagId, inode}))
+                continue;
+            reporter.report("missing posting", std::to_string(tagId) + " -> " + std::to_string(inode));
+            if (!repair)
+                continue;
+            if (isLive(inode) && pass.postingTags.count(tagId)) {
+                postingRepairs[tagId].first.push_back(inode);
+            } else {
+                inodeToTagWriter(inode).append(mongocxx::model::update_one(
+                        document{} << _ID << inode << finalize,
+                        document{} << PULL << open_document << TAGS << tagId << close_document << finalize));
+            }
+            reporter.repaired++;
+        }
+
+        bool flushed = true;
+        for (auto *writers: {&tagToInodeWriters, &inodeToTagWriters, &inodetoFilenameWriters,
+                             &inodeToTimeWriters, &inodeToValueWriters, &tagSetToInodeWriters}) {
+            for (auto &writer: *writers) {
+                flushed = writer.flush() == 0 && flushed;
+            }
+        }
+        if (!flushed) {
+            std::cerr << "Error: fsck could not write repairs" << std::endl;
+            return -1;
+        }
+        for (auto &[tagId, fix]: postingRepairs) {
+            if (tagToInodePatch(tagId, fix.first, fix.second) != 0) {
+                std::cerr << "Error: fsck could not write repairs" << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    size_t problems = reporter.summarize();
+    std::cout << "fsck: " << problems << " problems found";
+    if (repair)
+        std::cout << ", " << reporter.repaired << " repaired";
+    std::cout << std::endl;
+    return static_cast<int>(problems);
+}
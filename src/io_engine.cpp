@@ -0,0 +1,281 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+#include <iostream>
+
+#include "io_engine.h"
+
+IoEngine ioEngine;
+
+IoEngine::~IoEngine() {
+    stop();
+}
+
+bool IoEngine::available() const {
+    return running;
+}
+
+#ifdef UCUTAG_IO_URING
+
+int IoEngine::start() {
+    if (running)
+        return 0;
+    int res = io_uring_queue_init(IO_ENGINE_ENTRIES, &ring, 0);
+    if (res < 0) {
+#ifdef DEBUG
+        std::cout << "io_uring is unavailable (" << strerror(-res) << "), using syscalls" << std::endl;
+#endif
+        return -1;
+    }
+
+    // sparse table of descriptors, filled on open of files
+    files.assign(IO_ENGINE_FILES, -1);
+    files_registered = io_uring_register_files(&ring, files.data(), files.size()) == 0;
+
+    buffers_memory.assign(static_cast<size_t>(IO_ENGINE_BUFFERS) * IO_ENGINE_BUFFER_SIZE, 0);
+    std::vector<struct iovec> iovecs(IO_ENGINE_BUFFERS);
+    for (int i = 0; i < IO_ENGINE_BUFFERS; i++) {
+        iovecs[i].iov_base = buffer(i);
+        iovecs[i].iov_len = IO_ENGINE_BUFFER_SIZE;
+    }
+    if (io_uring_register_buffers(&ring, iovecs.data(), iovecs.size()) == 0) {
+        for (int i = 0; i < IO_ENGINE_BUFFERS; i++)
+            free_buffers.push_back(i);
+    }
+
+    running = true;
+    reaper = std::thread(&IoEngine::reap, this);
+    return 0;
+}
+
+void IoEngine::stop() {
+    if (!running)
+        return;
+    // request without data tells reaper to finish, ring is not touched while someone submits
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        idle.wait(lock, [this] { return !submitting && pending.empty(); });
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (sqe == nullptr) {
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, nullptr);
+        io_uring_submit(&ring);
+    }
+    reaper.join();
+    running = false;
+    io_uring_queue_exit(&ring);
+    files.clear();
+    free_buffers.clear();
+    buffers_memory.clear();
+}
+
+int IoEngine::submit(std::function<void(struct io_uring_sqe *)> prepare) {
+    io_request request{std::move(prepare), {}};
+    auto result = request.result.get_future();
+
+    // requests which came while someone else was submitting are submitted by him in the same batch
+    std::unique_lock<std::mutex> lock{mutex};
+    pending.push_back(&request);
+    if (!submitting) {
+        submitting = true;
+        while (!pending.empty()) {
+            auto batch = std::move(pending);
+            pending.clear();
+            lock.unlock();
+            for (auto *req: batch) {
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+                if (sqe == nullptr) {
+                    io_uring_submit(&ring);
+                    sqe = io_uring_get_sqe(&ring);
+                }
+                req->prepare(sqe);
+                io_uring_sqe_set_data(sqe, req);
+            }
+            io_uring_submit(&ring);
+            lock.lock();
+        }
+        submitting = false;
+        idle.notify_all();
+    }
+    lock.unlock();
+
+    int res = result.get();
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+void IoEngine::reap() {
+    while (true) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&ring, &cqe) < 0)
+            continue;
+        auto *request = static_cast<io_request *>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        if (request == nullptr)
+            return;
+        request->result.set_value(res);
+    }
+}
+
+char *IoEngine::buffer(int index) {
+    return buffers_memory.data() + static_cast<size_t>(index) * IO_ENGINE_BUFFER_SIZE;
+}
+
+int IoEngine::acquireBuffer() {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (free_buffers.empty())
+        return -1;
+    int index = free_buffers.back();
+    free_buffers.pop_back();
+    return index;
+}
+
+void IoEngine::releaseBuffer(int index) {
+    std::lock_guard<std::mutex> lock{mutex};
+    free_buffers.push_back(index);
+}
+
+int IoEngine::registerFile(int fd) {
+    if (!running || !files_registered)
+        return -1;
+    std::lock_guard<std::mutex> lock{mutex};
+    for (size_t slot = 0; slot < files.size(); slot++) {
+        if (files[slot] == -1) {
+            if (io_uring_register_files_update(&ring, slot, &fd, 1) < 0)
+                return -1;
+            files[slot] = fd;
+            return static_cast<int>(slot);
+        }
+    }
+    return -1;
+}
+
+void IoEngine::unregisterFile(int slot) {
+    if (!running || slot < 0)
+        return;
+    std::lock_guard<std::mutex> lock{mutex};
+    int fd = -1;
+    io_uring_register_files_update(&ring, slot, &fd, 1);
+    files[slot] = -1;
+}
+
+ssize_t IoEngine::read(int fd, int slot, void *buf, size_t size, off_t offset) {
+    if (!running)
+        return pread(fd, buf, size, offset);
+
+    int index = size <= IO_ENGINE_BUFFER_SIZE ? acquireBuffer() : -1;
+    int res = submit([&](struct io_uring_sqe *sqe) {
+        if (index >= 0)
+            io_uring_prep_read_fixed(sqe, slot >= 0 ? slot : fd, buffer(index), size, offset, index);
+        else
+            io_uring_prep_read(sqe, slot >= 0 ? slot : fd, buf, size, offset);
+        if (slot >= 0)
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    });
+    if (index >= 0) {
+        if (res > 0)
+            memcpy(buf, buffer(index), res);
+        releaseBuffer(index);
+    }
+    return res;
+}
+
+ssize_t IoEngine::write(int fd, int slot, const void *buf, size_t size, off_t offset) {
+    if (!running)
+        return pwrite(fd, buf, size, offset);
+
+    int index = size <= IO_ENGINE_BUFFER_SIZE ? acquireBuffer() : -1;
+    if (index >= 0)
+        memcpy(buffer(index), buf, size);
+    int res = submit([&](struct io_uring_sqe *sqe) {
+        if (index >= 0)
+            io_uring_prep_write_fixed(sqe, slot >= 0 ? slot : fd, buffer(index), size, offset, index);
+        else
+            io_uring_prep_write(sqe, slot >= 0 ? slot : fd, buf, size, offset);
+        if (slot >= 0)
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    });
+    if (index >= 0)
+        releaseBuffer(index);
+    return res;
+}
+
+int IoEngine::fsync(int fd, int slot, bool datasync) {
+    if (!running)
+        return datasync ? fdatasync(fd) : ::fsync(fd);
+
+    return submit([&](struct io_uring_sqe *sqe) {
+        io_uring_prep_fsync(sqe, slot >= 0 ? slot : fd, datasync ? IORING_FSYNC_DATASYNC : 0);
+        if (slot >= 0)
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    });
+}
+
+int IoEngine::stat(int dirfd, const char *path, int flags, struct stat *stbuf) {
+    if (!running)
+        return fstatat(dirfd, path, stbuf, flags);
+
+    struct statx stx{};
+    int res = submit([&](struct io_uring_sqe *sqe) {
+        io_uring_prep_statx(sqe, dirfd, path, flags, STATX_BASIC_STATS, &stx);
+    });
+    if (res < 0)
+        return res;
+
+    *stbuf = {};
+    stbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    stbuf->st_ino = stx.stx_ino;
+    stbuf->st_mode = stx.stx_mode;
+    stbuf->st_nlink = stx.stx_nlink;
+    stbuf->st_uid = stx.stx_uid;
+    stbuf->st_gid = stx.stx_gid;
+    stbuf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    stbuf->st_size = stx.stx_size;
+    stbuf->st_blksize = stx.stx_blksize;
+    stbuf->st_blocks = stx.stx_blocks;
+    stbuf->st_atim = {stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec};
+    stbuf->st_mtim = {stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec};
+    stbuf->st_ctim = {stx.stx_ctime.tv_sec, stx.stx_ctime.tv_nsec};
+    return 0;
+}
+
+#else
+
+int IoEngine::start() {
+    return -1;
+}
+
+void IoEngine::stop() {}
+
+int IoEngine::registerFile(int) {
+    return -1;
+}
+
+void IoEngine::unregisterFile(int) {}
+
+ssize_t IoEngine::read(int fd, int, void *buf, size_t size, off_t offset) {
+    return pread(fd, buf, size, offset);
+}
+
+ssize_t IoEngine::write(int fd, int, const void *buf, size_t size, off_t offset) {
+    return pwrite(fd, buf, size, offset);
+}
+
+int IoEngine::fsync(int fd, int, bool datasync) {
+    return datasync ? fdatasync(fd) : ::fsync(fd);
+}
+
+int IoEngine::stat(int dirfd, const char *path, int flags, struct stat *stbuf) {
+    return fstatat(dirfd, path, stbuf, flags);
+}
+
+#endif
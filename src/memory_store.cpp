@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+
+#include "memory_store.h"
+#include "string_utils.h"
+
+int MemoryStore::timeUpdate(num_t inode, num_t mtime) {
+    auto it = inodeToTime.find(inode);
+    if (it != inodeToTime.end()) {
+        timeIndex.erase({it->second, inode});
+        it->second = mtime;
+    } else {
+        inodeToTime.emplace(inode, mtime);
+    }
+    timeIndex.emplace(mtime, inode);
+    return 0;
+}
+
+int MemoryStore::timeDelete(num_t inode) {
+    auto it = inodeToTime.find(inode);
+    if (it == inodeToTime.end())
+        return 0;
+    timeIndex.erase({it->second, inode});
+    inodeToTime.erase(it);
+    return 1;
+}
+
+num_t MemoryStore::timeGet(num_t inode) {
+    auto it = inodeToTime.find(inode);
+    return it == inodeToTime.end() ? -1 : it->second;
+}
+
+numvec MemoryStore::timeRange(num_t from, num_t to, const numvec &candidates) {
+    numvec result{};
+    if (!candidates.empty()) {
+        for (auto inode: candidates) {
+            auto it = inodeToTime.find(inode);
+            if (it != inodeToTime.end() && it->second >= from && it->second < to)
+                result.push_back(inode);
+        }
+        return result;
+    }
+    auto end = timeIndex.lower_bound({to, std::numeric_limits<num_t>::min()});
+    for (auto it = timeIndex.lower_bound({from, std::numeric_limits<num_t>::min()}); it != end; ++it) {
+        result.push_back(it->second);
+    }
+    return result;
+}
+
+int MemoryStore::resize(num_t oldSize, num_t newSize) {
+    num_t delta = newSize - oldSize;
+    if (delta > 0 && bytesLimit != 0 && bytesUsed + delta > bytesLimit) {
+        errno = ENOSPC;
+        return -1;
+    }
+    bytesUsed = std::max<num_t>(bytesUsed + delta, 0);
+    return 0;
+}
+
+void MemoryStore::filenameSet(num_t inode, const std::string &filename) {
+    filenameDelete(inode);
+    inodetoFilename[inode] = filename;
+    filenameIndex.emplace(filename, inode);
+    lowerFilenameIndex.emplace(toLower(filename), inode);
+}
+
+void MemoryStore::filenameDelete(num_t inode) {
+    auto it = inodetoFilename.find(inode);
+    if (it == inodetoFilename.end())
+        return;
+    filenameIndex.erase({it->second, inode});
+    lowerFilenameIndex.erase({toLower(it->second), inode});
+    inodetoFilename.erase(it);
+}
+
+numvec MemoryStore::filenameFind(const std::string &filename, bool prefix) {
+    auto &index = prefix ? lowerFilenameIndex : filenameIndex;
+    numvec result{};
+    for (auto it = index.lower_bound({filename, std::numeric_limits<num_t>::min()}); it != index.end(); ++it) {
+        if (prefix ? it->first.compare(0, filename.size(), filename) != 0 : it->first != filename)
+            break;
+        result.push_back(it->second);
+    }
+    return result;
+}
+
+int MemoryStore::valueSet(num_t inode, const std::string &key, const tag_value_t &value) {
+    valueDelete(inode, key);
+    inodeToValue[inode][key] = value;
+    if (value.numeric)
+        numberIndex[key].emplace(value.number, inode);
+    textIndex[key].emplace(value.text, inode);
+    return 0;
+}
+
+int MemoryStore::valueDelete(num_t inode, const std::string &key) {
+    auto it = inodeToValue.find(inode);
+    if (it == inodeToValue.end())
+        return 0;
+    int deleted = 0;
+    for (auto value = it->second.begin(); value != it->second.end();) {
+        if (!key.empty() && value->first != key) {
+            ++value;
+            continue;
+        }
+        if (value->second.numeric)
+            numberIndex[value->first].erase({value->second.number, inode});
+        textIndex[value->first].erase({value->second.text, inode});
+        value = it->second.erase(value);
+        deleted++;
+    }
+    if (it->second.empty())
+        inodeToValue.erase(it);
+    return deleted;
+}
+
+std::map<std::string, std::string> MemoryStore::valueGet(num_t inode) {
+    std::map<std::string, std::string> result;
+    auto it = inodeToValue.find(inode);
+    if (it == inodeToValue.end())
+        return result;
+    for (auto &[key, value]: it->second) {
+        result[key] = value.text;
+    }
+    return result;
+}
+
+numvec MemoryStore::valueRange(const value_range_t &range, const numvec &candidates) {
+    numvec result{};
+    if (!candidates.empty()) {
+        for (auto inode: candidates) {
+            auto it = inodeToValue.find(inode);
+            if (it == inodeToValue.end())
+                continue;
+            auto value = it->second.find(range.key);
+            if (value != it->second.end() && valueInRange(value->second, range))
+                result.push_back(inode);
+        }
+        return result;
+    }
+    // scan of ordered index from lower bound while values are in range
+    auto scan = [&range, &result](const auto &index, auto from, auto toValue) {
+        auto it = range.hasFrom ? index.lower_bound({from, std::numeric_limits<num_t>::min()}) : index.begin();
+        for (; it != index.end(); ++it) {
+            auto value = toValue(it->first);
+            if (range.hasTo && (range.numeric ? value.number > range.to.number : value.text > range.to.text))
+                break;
+            if (valueInRange(value, range))
+                result.push_back(it->second);
+        }
+    };
+    if (range.numeric) {
+        auto index = numberIndex.find(range.key);
+        if (index != numberIndex.end())
+            scan(index->second, range.from.number, [](double number) { return tag_value_t{true, number, {}}; });
+    } else {
+        auto index = textIndex.find(range.key);
+        if (index != textIndex.end())
+            scan(index->second, range.from.text, [](const std::string &text) { return tag_value_t{false, 0, text}; });
+    }
+    return result;
+}
+
+bool MemoryStore::valueKeyExists(const std::string &key) {
+    auto index = textIndex.find(key);
+    return index != textIndex.end() && !index->second.empty();
+}
@@ -0,0 +1,76 @@
+#include <algorithm>
+
+#include "posting_chunks.h"
+
+std::string encodePostings(const numvec &sorted) {
+    std::string result;
+    result.reserve(sorted.size() * 2);
+    num_t previous = 0;
+    for (auto inode: sorted) {
+        auto delta = static_cast<uint64_t>(inode - previous);
+        previous = inode;
+        while (delta >= 0x80) {
+            result.push_back(static_cast<char>((delta & 0x7F) | 0x80));
+            delta >>= 7;
+        }
+        result.push_back(static_cast<char>(delta));
+    }
+    return result;
+}
+
+numvec decodePostings(const uint8_t *data, size_t size) {
+    numvec result;
+    decodePostings(data, size, result);
+    return result;
+}
+
+void decodePostings(const uint8_t *data, size_t size, numvec &out) {
+    out.reserve(out.size() + size);
+    num_t previous = 0;
+    uint64_t delta = 0;
+    int shift = 0;
+    for (size_t i = 0; i < size; i++) {
+        delta |= static_cast<uint64_t>(data[i] & 0x7F) << shift;
+        if (data[i] & 0x80) {
+            shift += 7;
+            continue;
+        }
+        previous += static_cast<num_t>(delta);
+        out.push_back(previous);
+        delta = 0;
+        shift = 0;
+    }
+}
+
+void mergePostings(numvec &sorted, const numvec &add, const numvec &remove) {
+    for (auto inode: add) {
+        if (inode >= 0)
+            sorted.push_back(inode);
+    }
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (remove.empty())
+        return;
+    numvec removed{remove};
+    std::sort(removed.begin(), removed.end());
+    sorted.erase(std::remove_if(sorted.begin(), sorted.end(), [&removed](num_t inode) {
+        return std::binary_search(removed.begin(), removed.end(), inode);
+    }), sorted.end());
+}
+
+std::vector<numvec> splitPostings(const numvec &sorted, size_t chunkSize) {
+    std::vector<numvec> result;
+    for (size_t i = 0; i < sorted.size(); i += chunkSize) {
+        result.emplace_back(sorted.begin() + i, sorted.begin() + std::min(i + chunkSize, sorted.size()));
+    }
+    if (result.empty())
+        result.emplace_back();
+    return result;
+}
+
+size_t postingChunkOf(const std::vector<posting_chunk_t> &chunks, num_t inode) {
+    auto it = std::upper_bound(chunks.begin(), chunks.end(), inode, [](num_t value, const posting_chunk_t &chunk) {
+        return value < chunk.chunk;
+    });
+    return it == chunks.begin() ? 0 : static_cast<size_t>(it - chunks.begin() - 1);
+}
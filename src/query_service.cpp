@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "query_service.h"
+#include "tag_query.h"
+
+// Bytes of response buffered before sending
+#define QUERY_SEND_SIZE (256 * 1024)
+
+namespace {
+    int sendAll(int fd, const std::string &data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t res = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (res == -1 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                return -1;
+            sent += res;
+        }
+        return 0;
+    }
+
+    void appendEscaped(std::string &out, const std::string &filename) {
+        for (char c: filename) {
+            if (c == '\\')
+                out += "\\\\";
+            else if (c == '\n')
+                out += "\\n";
+            else
+                out.push_back(c);
+        }
+    }
+}
+
+QueryService::~QueryService() {
+    stop();
+}
+
+int QueryService::start(TagFS &fs, const std::string &path) {
+    struct sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    // socket of previous mount which was not unmounted cleanly
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    tagFS = &fs;
+    socketPath = path;
+    listenFd = fd;
+    stopping = false;
+    server = std::thread(&QueryService::serve, this);
+    return 0;
+}
+
+void QueryService::stop() {
+    if (listenFd == -1)
+        return;
+    stopping = true;
+    // wakes up accept and recv of client
+    shutdown(listenFd, SHUT_RDWR);
+    int client = clientFd;
+    if (client != -1)
+        shutdown(client, SHUT_RDWR);
+    server.join();
+    close(listenFd);
+    listenFd = -1;
+    unlink(socketPath.c_str());
+}
+
+void QueryService::serve() {
+    while (!stopping) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        clientFd = fd;
+        serveClient(fd);
+        clientFd = -1;
+        close(fd);
+    }
+}
+
+void QueryService::serveClient(int fd) {
+    std::string pending;
+    char buf[4096];
+    while (!stopping) {
+        auto newline = pending.find('\n');
+        if (newline != std::string::npos) {
+            auto path = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (answer(fd, path) == -1)
+                return;
+            continue;
+        }
+        ssize_t res = recv(fd, buf, sizeof(buf), 0);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return;
+        pending.append(buf, res);
+    }
+}
+
+int QueryService::answer(int fd, const std::string &path) {
+#ifdef DEBUG
+    std::cout << " >>> query: " << path << std::endl;
+#endif
+    if (path == COMMITS_REQUEST) {
+        auto stats = tagFS->commitStatistics();
+        return sendAll(fd, "commits\t" + std::to_string(stats.batches) + "\t" + std::to_string(stats.operations) + "\t" +
+                           std::to_string(stats.largest) + "\t" + std::to_string(stats.failed) + "\n\n");
+    }
+    TagQuery query{*tagFS, path, &tagFS->apiMutex};
+    if (query.status() != 0) {
+        return sendAll(fd, "error\t" + std::to_string(query.status()) + "\t" + strerror(query.status()) + "\n");
+    }
+
+    std::string out;
+    while (!query.done() && !stopping) {
+        for (auto &entry: query.next()) {
+            out += std::to_string(entry.inode);
+            out.push_back('\t');
+            out += std::to_string(entry.st.st_size);
+            out.push_back('\t');
+            out += std::to_string(entry.st.st_mtime);
+            out.push_back('\t');
+            appendEscaped(out, entry.filename);
+            out.push_back('\n');
+        }
+        if (out.size() >= QUERY_SEND_SIZE) {
+            if (sendAll(fd, out) == -1)
+                return -1;
+            out.clear();
+        }
+    }
+    out.push_back('\n');
+    return sendAll(fd, out);
+}
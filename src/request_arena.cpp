@@ -0,0 +1,30 @@
+#include "request_arena.h"
+
+namespace {
+    // the first REQUEST_ARENA_SIZE bytes need no allocation at all, more are taken from heap until release
+    struct request_arena {
+        alignas(std::max_align_t) std::byte buffer[REQUEST_ARENA_SIZE];
+        std::pmr::monotonic_buffer_resource resource{buffer, sizeof(buffer)};
+        int depth = 0;
+    };
+
+    request_arena &threadArena() {
+        thread_local request_arena arena;
+        return arena;
+    }
+}
+
+RequestScope::RequestScope() {
+    threadArena().depth++;
+}
+
+RequestScope::~RequestScope() {
+    auto &arena = threadArena();
+    if (--arena.depth == 0)
+        arena.resource.release();
+}
+
+std::pmr::memory_resource *requestArena() {
+    auto &arena = threadArena();
+    return arena.depth > 0 ? &arena.resource : std::pmr::get_default_resource();
+}
@@ -1,19 +1,39 @@
 #include "string_utils.h"
 #include <sys/stat.h>
 #include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <charconv>
+#include <limits>
 #include <unistd.h>
 
 strvec split(const std::string &str, const std::string &delim) {
     size_t next, prev = 0;
     strvec result;
     while ((next = str.find(delim, prev)) != std::string::npos) {
-        std::string push_str = str.substr(prev, next - prev);
-        if (!push_str.empty())
-            result.push_back(push_str);
+        if (next > prev)
+            result.emplace_back(str, prev, next - prev);
         prev = next + delim.length();
     }
-    if (!str.substr(prev).empty())
-        result.push_back(str.substr(prev));
+    if (prev < str.size())
+        result.emplace_back(str, prev);
+    return result;
+}
+
+pathvec splitPath(std::string_view path) {
+    pathvec result{requestArena()};
+    size_t next, prev = 0;
+    while ((next = path.find('/', prev)) != std::string_view::npos) {
+        if (next > prev)
+            result.push_back(path.substr(prev, next - prev));
+        prev = next + 1;
+    }
+    if (prev < path.size())
+        result.push_back(path.substr(prev));
     return result;
 }
 
@@ -27,3 +47,202 @@ void fillTagStat(struct stat *stbuf) {
 }
 
 
+
+// bucket of local time, given as YYYY, YYYY-MM or YYYY-MM-DD
+static bool parseTimeBucket(const std::string &value, num_t &from, num_t &to) {
+    if (value.empty() || !isdigit(value[0]))
+        return false;
+    struct tm start{};
+    int year, month = 1, day = 1, consumed = 0;
+    int fields = sscanf(value.c_str(), "%4d%n-%2d%n-%2d%n", &year, &consumed, &month, &consumed, &day, &consumed);
+    if (fields < 1 || static_cast<size_t>(consumed) != value.size())
+        return false;
+    start.tm_year = year - 1900;
+    start.tm_mon = month - 1;
+    start.tm_mday = day;
+    start.tm_isdst = -1;
+    struct tm end = start;
+    if (fields == 1)
+        end.tm_year++;
+    else if (fields == 2)
+        end.tm_mon++;
+    else
+        end.tm_mday++;
+    from = mktime(&start);
+    to = mktime(&end);
+    return from != -1 && to != -1;
+}
+
+// moment in the past relative to now, given as -<number><s|m|h|d|w>
+static bool parseTimeAgo(const std::string &value, num_t &moment) {
+    long long amount;
+    char unit;
+    int consumed = 0;
+    if (sscanf(value.c_str(), "-%lld%c%n", &amount, &unit, &consumed) != 2 || static_cast<size_t>(consumed) != value.size())
+        return false;
+    num_t seconds;
+    switch (unit) {
+        case 's': seconds = 1; break;
+        case 'm': seconds = 60; break;
+        case 'h': seconds = 60 * 60; break;
+        case 'd': seconds = 24 * 60 * 60; break;
+        case 'w': seconds = 7 * 24 * 60 * 60; break;
+        default: return false;
+    }
+    moment = time(nullptr) - amount * seconds;
+    return true;
+}
+
+bool parseTimeTag(std::string_view name, num_t &from, num_t &to) {
+    // names of usual tags are rejected without copies
+    constexpr std::string_view prefix = TIME_TAG_PREFIX;
+    if (name.substr(0, prefix.size()) != prefix)
+        return false;
+    std::string rest{name.substr(prefix.size())};
+
+    std::string op;
+    for (const char *candidate: {">=", "<=", ":", ">", "<"}) {
+        if (rest.compare(0, strlen(candidate), candidate) == 0) {
+            op = candidate;
+            break;
+        }
+    }
+    if (op.empty())
+        return false;
+    std::string value = rest.substr(op.size());
+
+    num_t start, end;
+    if (!parseTimeBucket(value, start, end)) {
+        if (!parseTimeAgo(value, start))
+            return false;
+        end = start;
+    }
+
+    // comparisons treat the bucket as a whole: ">" is after its end, "<" is before its start
+    from = std::numeric_limits<num_t>::min();
+    to = std::numeric_limits<num_t>::max();
+    if (op == ":") {
+        from = start;
+        if (end != start)
+            to = end;
+    } else if (op == ">=") {
+        from = start;
+    } else if (op == ">") {
+        from = end;
+    } else if (op == "<=") {
+        to = end;
+    } else {
+        to = start;
+    }
+    return true;
+}
+
+bool parseOrderTag(std::string_view name, query_order_t &order) {
+    constexpr std::string_view sortPrefix = SORT_TAG_PREFIX;
+    constexpr std::string_view limitPrefix = LIMIT_TAG_PREFIX;
+    if (name.substr(0, sortPrefix.size()) == sortPrefix) {
+        auto key = name.substr(sortPrefix.size());
+        bool descending = !key.empty() && key.front() == '-';
+        if (descending)
+            key.remove_prefix(1);
+        if (key != ORDER_KEY_MTIME && key != ORDER_KEY_NAME)
+            return false;
+        order.key = std::string{key};
+        order.descending = descending;
+        return true;
+    }
+    if (name.substr(0, limitPrefix.size()) == limitPrefix) {
+        auto value = name.substr(limitPrefix.size());
+        num_t limit = 0;
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), limit);
+        if (error != std::errc{} || end != value.data() + value.size() || limit <= 0)
+            return false;
+        order.limit = limit;
+        return true;
+    }
+    return false;
+}
+
+bool isValueKey(std::string_view key) {
+    return !key.empty() && key[0] != '@' && std::all_of(key.begin(), key.end(), [](unsigned char c) {
+        return std::isalnum(c) || c == '_' || c == '-' || c == '.';
+    });
+}
+
+tag_value_t parseTagValue(const std::string &text) {
+    char *end = nullptr;
+    double number = std::strtod(text.c_str(), &end);
+    if (!text.empty() && !std::isspace(static_cast<unsigned char>(text[0])) &&
+        end == text.c_str() + text.size() && std::isfinite(number))
+        return {true, number, text};
+    return {false, 0, text};
+}
+
+bool parseValueTag(std::string_view name, value_range_t &range) {
+    auto op = name.find_first_of("=<>");
+    if (op == std::string_view::npos || !isValueKey(name.substr(0, op)))
+        return false;
+    std::string oper{name.substr(op, name[op] != '=' && name.substr(op + 1, 1) == "=" ? 2 : 1)};
+    std::string value{name.substr(op + oper.size())};
+    if (value.empty())
+        return false;
+
+    range = {};
+    range.key = std::string{name.substr(0, op)};
+    auto dots = value.find("..");
+    if (oper == "=" && value.front() == '[' && value.back() == ']' && dots != std::string::npos) {
+        auto from = value.substr(1, dots - 1);
+        auto to = value.substr(dots + 2, value.size() - dots - 3);
+        if (from.empty() || to.empty())
+            return false;
+        range.from = parseTagValue(from);
+        range.to = parseTagValue(to);
+        range.hasFrom = range.hasTo = true;
+    } else if (oper == "=") {
+        range.from = range.to = parseTagValue(value);
+        range.hasFrom = range.hasTo = true;
+    } else if (oper[0] == '>') {
+        range.from = parseTagValue(value);
+        range.hasFrom = true;
+        range.fromOpen = oper == ">";
+    } else {
+        range.to = parseTagValue(value);
+        range.hasTo = true;
+        range.toOpen = oper == "<";
+    }
+    // texts are compared if any bound is not a number
+    range.numeric = (!range.hasFrom || range.from.numeric) && (!range.hasTo || range.to.numeric);
+    return true;
+}
+
+bool valueInRange(const tag_value_t &value, const value_range_t &range) {
+    if (range.numeric) {
+        if (!value.numeric)
+            return false;
+        if (range.hasFrom && (range.fromOpen ? value.number <= range.from.number : value.number < range.from.number))
+            return false;
+        return !(range.hasTo && (range.toOpen ? value.number >= range.to.number : value.number > range.to.number));
+    }
+    if (range.hasFrom && (range.fromOpen ? value.text <= range.from.text : value.text < range.from.text))
+        return false;
+    return !(range.hasTo && (range.toOpen ? value.text >= range.to.text : value.text > range.to.text));
+}
+
+std::string toLower(const std::string &str) {
+    std::string result{str};
+    std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+std::string prefixUpperBound(const std::string &prefix) {
+    std::string result{prefix};
+    while (!result.empty()) {
+        auto last = static_cast<unsigned char>(result.back());
+        if (last != 0xFF) {
+            result.back() = static_cast<char>(last + 1);
+            return result;
+        }
+        result.pop_back();
+    }
+    return result;
+}
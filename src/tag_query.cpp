@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+
+#include "tag_query.h"
+
+namespace {
+    // locks mutex if there is one
+    std::unique_lock<std::mutex> lockOf(std::mutex *mutex) {
+        return mutex ? std::unique_lock<std::mutex>{*mutex} : std::unique_lock<std::mutex>{};
+    }
+}
+
+TagQuery::TagQuery(TagFS &tagFS, const std::string &path, std::mutex *lock) : tagFS(tagFS), lock(lock) {
+    std::string fullPath = path.empty() || path.front() != '/' ? "/" + path : path;
+    resolved_t resolved;
+    {
+        auto guard = lockOf(lock);
+        RequestScope scope;
+        resolved = tagFS.resolve(fullPath.c_str(), true);
+        error = resolved.status != 0 ? errno : 0;
+    }
+    queryTags = std::move(resolved.tags);
+    if (error != 0)
+        return;
+    if (resolved.isOrdered) {
+        inodes = std::move(resolved.ordered);
+        return;
+    }
+    inodes.assign(resolved.inodes.begin(), resolved.inodes.end());
+    std::sort(inodes.begin(), inodes.end());
+}
+
+int TagQuery::status() const {
+    return error;
+}
+
+const tagvec &TagQuery::tags() const {
+    return queryTags;
+}
+
+size_t TagQuery::size() const {
+    return inodes.size();
+}
+
+bool TagQuery::done() const {
+    return position >= inodes.size();
+}
+
+std::vector<query_entry_t> TagQuery::next(size_t count) {
+    std::vector<query_entry_t> result;
+    // batch may have only files which are skipped, then the next one is taken
+    while (result.empty() && !done()) {
+        auto end = std::min(inodes.size(), position + std::max<size_t>(count, 1));
+        numvec batch(inodes.begin() + position, inodes.begin() + end);
+        position = end;
+
+        std::unordered_map<num_t, std::string> filenames;
+        {
+            auto guard = lockOf(lock);
+            filenames = tagFS.inodetoFilenameGetMany(batch);
+        }
+        result.reserve(batch.size());
+        for (auto inode: batch) {
+            auto it = filenames.find(inode);
+            // "@" is the file listing all tags in the root
+            if (it == filenames.end() || it->second == "@")
+                continue;
+            query_entry_t entry{inode, std::move(it->second), {}};
+            if (fstatat(tagFS.fdCache.dirFd(), std::to_string(inode).c_str(), &entry.st, AT_SYMLINK_NOFOLLOW) == -1)
+                entry.st = {};
+            result.push_back(std::move(entry));
+        }
+    }
+    return result;
+}
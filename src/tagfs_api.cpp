@@ -8,22 +8,84 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/file.h> 
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
 #include <filesystem>
 
 #include "tagfs_api.h"
 #include "string_utils.h"
 #include "TagFS.h"
 #include "arg_utils.h"
+#include "io_engine.h"
+#include "query_service.h"
 
 namespace fs = std::filesystem;
 
 TagFS tagFS;
+QueryService queryService;
+std::string query_socket;       // empty if service is not asked for
+num_t commit_window = 0;        // microseconds, no group commit if 0
+num_t commit_batch = 0;
+bool multithreaded = false;     // fuse runs requests in several threads
+
+// comma separated names of tags implied by tag directory
+#define UCUTAG_XATTR_IMPLIES "user.ucutag.implies"
+// statistics of tag directory: files=<count>,bytes=<size>,mtime=<seconds>
+#define UCUTAG_XATTR_STATS "user.ucutag.stats"
+// value of typed tag of file, followed by its key: user.ucutag.value.rating
+#define UCUTAG_XATTR_VALUE "user.ucutag.value."
+// write only: file becomes copy of file at path in mount, copied by backing file system
+#define UCUTAG_XATTR_CLONE "user.ucutag.clone"
+// Maximal bytes copied by one copy_file_range call when reflink is not supported
+#define CLONE_CHUNK_SIZE (1 << 30)
 
 struct tag_dirp {
+    tagvec tags;        // of directory, its facets are listed after files
     inodeset inodes;
-    inodeset::iterator entry;
+    numvec ordered;     // files in order of @sort and @limit, if tags have them
+    bool isOrdered;
+    std::map<std::string, num_t> facets;    // filled by the first readdir of handle
+    bool hasFacets;
 };
 
+struct tag_filep {
+    int fd;
+    num_t inode;
+    off_t size;         // size on open, change is accounted in tag statistics on release
+    time_t mtime;       // modification time on open, change is written to time index on release
+    int slot;           // registered in I/O engine, -1 if not
+};
+
+static inline struct tag_filep *get_filep(struct fuse_file_info *fi) {
+    return (struct tag_filep *) (uintptr_t) fi->fh;
+}
+
+// descriptor of files directory, backing files are resolved relative to it
+static inline int files_dir() {
+    return tagFS.fdCache.dirFd();
+}
+
+// directory of virtual facets file, false if path is not one
+static bool facets_dir(const char *path, std::string &dir) {
+    std::string p{path};
+    auto slash = p.rfind('/');
+    if (slash == std::string::npos || p.compare(slash + 1, std::string::npos, FACETS_FILE) != 0)
+        return false;
+    dir = slash == 0 ? "/" : p.substr(0, slash);
+    return true;
+}
+
+// cached O_PATH descriptor of backing file, nullptr and errno if there is no such file
+static fdptr get_file_fd(num_t file_inode) {
+    if (file_inode == num_t(-1)) {
+        errno = ENOENT;
+        return nullptr;
+    }
+    return tagFS.fdCache.get(file_inode);
+}
+
 static int ucutag_getattr(const char *path, struct stat *stbuf) {
 #ifdef DEBUG
     std::cout << " >>> getattr: " << path << std::endl;
@@ -35,24 +97,44 @@ static int ucutag_getattr(const char *path, struct stat *stbuf) {
         return 0;
     }
 
-    auto [tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) {
+    std::string dir;
+    if (facets_dir(path, dir)) {
+        // contents are made on open and read directly, so size is unknown here
+        auto[tag_vec, status] = tagFS.parseTags(dir.c_str());
+        if (status != 0)
+            return -errno;
+        if (!tag_vec.empty() && tag_vec.back().type == TAG_TYPE_FILE)
+            return -ENOTDIR;
+        fillTagStat(stbuf);
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        return 0;
+    }
+
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) {
 #ifdef DEBUG
         std::cout << " >>> parseTags error " << std::endl;
 #endif
         return -errno;
     }
 
-    if ( tag_vec.back().type == TAG_TYPE_REGULAR ) {
+    if ( resolved.tags.back().type != TAG_TYPE_FILE ) {
 #ifdef DEBUG
         std::cout << " >>> getattr TAG_TYPE_REGULAR" << std::endl;
 #endif
         fillTagStat(stbuf);
+        auto &stats = resolved.tags.back().stats;
+        stbuf->st_nlink = 2 + stats.files;
+        stbuf->st_size = stats.bytes;
+        if (stats.mtime != 0)
+            stbuf->st_mtime = stats.mtime;
         return 0;
     }
 
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
-    res = lstat(file_path.c_str(), stbuf);
+    auto file_fd = get_file_fd(resolved.inode);
+    if (!file_fd) return -errno;
+    res = ioEngine.stat(file_fd->fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW, stbuf);
     if (res == -1) {
 #ifdef DEBUG
         std::cout << " >>> lstat error " << std::endl;
@@ -74,16 +156,20 @@ static int ucutag_access(const char *path, int mask) {
 
     int res;
 
-    auto [tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
+    std::string dir;
+    if (facets_dir(path, dir))
+        return (mask & (W_OK | X_OK)) ? -EACCES : 0;
+
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
 
     // return 0 for directory
-    if (tag_vec.back().type == TAG_TYPE_REGULAR) {
+    if (resolved.tags.back().type != TAG_TYPE_FILE) {
         mask = R_OK | W_OK | X_OK;
         return 0;
     }
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
-    res = access(file_path.c_str(), mask);
+    std::string file_path = std::to_string(resolved.inode);
+    res = faccessat(files_dir(), file_path.c_str(), mask, 0);
     if (res == -1)
         return -errno;
 
@@ -97,10 +183,11 @@ static int ucutag_readlink(const char *path, char *buf, size_t size) {
 
     int res;
 
-    auto [tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
-    res = readlink(file_path.c_str(), buf, size - 1);
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    auto file_fd = get_file_fd(resolved.inode);
+    if (!file_fd) return -errno;
+    res = readlinkat(file_fd->fd, "", buf, size - 1);
     if (res == -1)
         return -errno;
 
@@ -126,16 +213,21 @@ static int ucutag_opendir(const char *path, struct fuse_file_info *fi) {
 #endif
 
     // fill and save pointer to dirent
-    auto [tags, status] = tagFS.parseTags(path);
+    auto resolved = tagFS.resolve(path, true);
 #ifdef DEBUG
-    std::cerr << " >>> opendir status: " << status << " tags " << tags << std::endl;
+    std::cerr << " >>> opendir status: " << resolved.status << " tags " << resolved.tags << std::endl;
 #endif
 
-    if (status != 0) return -errno;
+    if (resolved.status != 0) {
+        delete d;
+        return -errno;
+    }
 
-    d->inodes = std::move(tagFS.getInodesFromTags(tags));
+    d->tags = std::move(resolved.tags);
+    d->inodes = std::move(resolved.inodes);
+    d->ordered = std::move(resolved.ordered);
+    d->isOrdered = resolved.isOrdered;
 
-    d->entry = d->inodes.begin();
     fi->fh = (unsigned long) d;
 
     return res;
@@ -152,19 +244,14 @@ static int ucutag_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     std::cout << " >>> readdir: " << path << std::endl;
 #endif
 
+    (void) path;
     int status = 0;
     tag_dirp *d = get_dirp(fi);
 
-    // get first entry
-    d->entry = d->inodes.begin();
-
-    // move entry on offset
-    std::advance(d->entry, offset);
-
     bool flag = true;
-    while (d->entry != d->inodes.end()) {
+    auto fillFile = [&](num_t inode) {
         struct stat st{};
-        auto filename = tagFS.inodetoFilenameGet(*d->entry);
+        auto filename = tagFS.inodetoFilenameGet(inode);
         if (filename == "@"){
             flag = false;
             fillTagStat(&st);
@@ -176,29 +263,37 @@ static int ucutag_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                 filler(buf, nonFileTagName.c_str(), &st, 0);
             }
         } else {
-            if (lstat(std::to_string(*d->entry).c_str(), &st) == -1) status = -1;
+            if (fstatat(files_dir(), std::to_string(inode).c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) status = -1;
             filler(buf, filename.c_str(), &st, 0);
         }
-
-
-        d->entry++;
+    };
+    // entries after offset, files of ordered directory in their order
+    if (d->isOrdered) {
+        for (auto it = d->ordered.begin() + std::min<size_t>(offset, d->ordered.size()); it != d->ordered.end(); ++it)
+            fillFile(*it);
+    } else {
+        auto it = d->inodes.begin();
+        std::advance(it, std::min<size_t>(offset, d->inodes.size()));
+        for (; it != d->inodes.end(); ++it)
+            fillFile(*it);
     }
 
 #ifdef DEBUG
     std::cout << " >>> readdir - inserting dirs " << std::endl;
 #endif
     if (flag) {
-        auto splitted = split(path, "/");
-        auto tags = tagFS.tagNamesByTagType(TAG_TYPE_REGULAR);
-        for (auto& nonFileTagName : tags) {
-            if (!std::count(splitted.begin(), splitted.end(), nonFileTagName)) {
+        // only tags which narrow files of directory, no dead ends, computed once per handle
+        if (!d->hasFacets) {
+            d->facets = tagFS.tagFacets(d->tags, d->inodes);
+            d->hasFacets = true;
+        }
+        for (auto &[nonFileTagName, files]: d->facets) {
 #ifdef DEBUG
-                std::cout << " >>> readdir - inserting tag " << nonFileTagName << std::endl;
+            std::cout << " >>> readdir - inserting tag " << nonFileTagName << std::endl;
 #endif
-                struct stat st{};
-                fillTagStat(&st);
-                filler(buf, nonFileTagName.c_str(), &st, 0);
-            }
+            struct stat st{};
+            fillTagStat(&st);
+            filler(buf, nonFileTagName.c_str(), &st, 0);
         }
     }
 
@@ -211,7 +306,7 @@ static int ucutag_releasedir(const char *path, struct fuse_file_info *fi) {
 #endif
 
     tag_dirp *d = get_dirp(fi);
-    free(d);
+    delete d;
     return 0;
 }
 
@@ -219,8 +314,7 @@ static int ucutag_mkdir(const char *path, mode_t mode) {
 #ifdef DEBUG
     std::cout << " >>> mkdir: " << path << std::endl;
 #endif
-    strvec tagNames = split(path, "/");
-    return tagFS.createRegularTags(tagNames);
+    return tagFS.createRegularTags(splitPath(path));
 }
 
 static int ucutag_mknod(const char *path, mode_t mode, dev_t rdev) {
@@ -230,7 +324,8 @@ static int ucutag_mknod(const char *path, mode_t mode, dev_t rdev) {
 
     int res;
     // We expect that all tags exist or last one might not exist
-    auto[tag_vec, status] = tagFS.prepareFileCreation(path);
+    pathvec components{requestArena()};
+    auto[tag_vec, status] = tagFS.prepareFileCreation(path, &components);
     if (status != 0) {
         return status;
 
@@ -241,22 +336,22 @@ static int ucutag_mknod(const char *path, mode_t mode, dev_t rdev) {
     }
     else {
         num_t new_inode = tagFS.getNewInode();
+        if (new_inode == -1)
+            return -errno;
         std::string new_path = std::to_string(new_inode);
 
         if (S_ISFIFO(mode)) {
-            res = mkfifo(new_path.c_str(), mode);
+            res = mkfifoat(files_dir(), new_path.c_str(), mode);
         }
         else {
-            res = mknod(new_path.c_str(), mode, rdev);
+            res = mknodat(files_dir(), new_path.c_str(), mode, rdev);
         }
         if (res == -1) {
             return -errno;
         }
-        auto splitted = split(path, "/");
-
-        tag_vec.push_back({TAG_TYPE_FILE, splitted.back()});
+        tag_vec.push_back({TAG_TYPE_FILE, std::string{components.back()}});
         if (tagFS.createNewFileMetaData(tag_vec, new_inode) != 0) {
-            unlink(new_path.c_str());
+            unlinkat(files_dir(), new_path.c_str(), 0);
             errno = EEXIST;
             return -errno;
         }
@@ -272,23 +367,26 @@ static int ucutag_unlink(const char *path) {
 #endif
 
     int res;
-    auto [tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
-    num_t file_inode = tagFS.getFileInode(tag_vec);
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    num_t file_inode = resolved.inode;
     if (file_inode == num_t(-1)) {
         errno = ENOENT;
         return -errno;
     }
+    std::string file_path = std::to_string(file_inode);
 
-    if (tagFS.deleteFileMetaData(tag_vec, file_inode) != 0) {
+    num_t size = tagFS.getFileSize(file_inode);
+    if (tagFS.deleteFileMetaData(resolved.tags, file_inode) != 0) {
         errno = ENOENT;
         return -errno;
     }
 
-    res = unlink(file_path.c_str());
+    res = unlinkat(files_dir(), file_path.c_str(), 0);
+    tagFS.fdCache.forget(file_inode);
     if (res == -1)
         return -errno;
+    tagFS.dataResize(size, 0);
 
     return 0;
 }
@@ -297,8 +395,7 @@ static int ucutag_rmdir(const char *path) {
 #ifdef DEBUG
     std::cout << " >>> rmdir: " << path << std::endl;
 #endif
-    auto splitted = split(path, "/");
-    if (splitted.size() > 1) {
+    if (splitPath(path).size() > 1) {
         return 0;
     }
     auto [tag_vec, status] = tagFS.parseTags(path);
@@ -315,19 +412,21 @@ static int ucutag_symlink(const char *from, const char *to) {
 
     auto [tag_vec_to, status_to] = tagFS.prepareFileCreation(to);
     if (status_to != 0) return status_to;
-    auto [tag_vec_from, status_from] = tagFS.parseTags(from);
-    if (status_from != 0) return -errno;
-    std::string link_file_path = tagFS.getFileRealPath(tag_vec_from);
+    auto resolved_from = tagFS.resolve(from);
+    if (resolved_from.status != 0) return -errno;
+    std::string link_file_path = std::to_string(resolved_from.inode);
 
     num_t new_inode = tagFS.getNewInode();
+    if (new_inode == -1)
+        return -errno;
     std::string new_path = std::to_string(new_inode);
 
-    res = symlink(link_file_path.c_str(), new_path.c_str());
+    res = symlinkat(link_file_path.c_str(), files_dir(), new_path.c_str());
     if (res == -1)
         return -errno;
 
     if (tagFS.createNewFileMetaData(tag_vec_to, new_inode) != 0) {
-        unlink(new_path.c_str());
+        unlinkat(files_dir(), new_path.c_str(), 0);
         errno = EEXIST;
         return -errno;
     }
@@ -335,26 +434,33 @@ static int ucutag_symlink(const char *from, const char *to) {
     return 0;
 }
 
-//// TODO: Replace dir rename with tag rename
 static int ucutag_rename(const char *from, const char *to) {
 #ifdef DEBUG
     std::cout << " >>> rename: " << from << " -> " << to << std::endl;
 #endif
 
-    auto[tag_vec_from, status_from] = tagFS.parseTags(from);
-    if (status_from != 0) return -errno;
+    auto resolved_from = tagFS.resolve(from);
+    if (resolved_from.status != 0) return -errno;
+    auto &tag_vec_from = resolved_from.tags;
 
-    auto[tag_vec_to, status_to] = tagFS.parseTags(to);
-    auto tag_name_to = split(to, "/");
+    pathvec tag_name_to{requestArena()};
+    auto[tag_vec_to, status_to] = tagFS.parseTags(to, &tag_name_to);
+
+    // directory is a tag, it gets new name whatever tags are around it in both paths
+    if (tag_vec_from.back().type == TAG_TYPE_REGULAR) {
+        if (tagFS.renameRegularTag(tag_vec_from.back().name, std::string{tag_name_to.back()}) != 0)
+            return -errno;
+        return 0;
+    }
 
-    auto inodes_from = tagFS.getInodesFromTags(tag_vec_from);
+    auto &inodes_from = resolved_from.inodes;
     if (inodes_from.size() > 1) {
         errno = ENOENT;
         return -errno;
     }
-    if (inodes_from.empty() && tag_vec_from.size() == tag_name_to.size()) {
-        // Rename tags one by one
-        return 0;
+    if (inodes_from.empty()) {
+        errno = ENOENT;
+        return -errno;
     }
 //    if ((status_to == 0 && !(tag_vec_to.back() == tag_vec_from.back())) || (status_to != 0 && tag_vec_to.size() < tag_name_to.size() - 1)) {
 //        errno = EEXIST;
@@ -364,6 +470,11 @@ static int ucutag_rename(const char *from, const char *to) {
         errno = EEXIST;
         return -errno;
     }
+    // time tags are derived from the file itself and can't be assigned
+    if (tagFS.hasVirtualTags(tag_vec_to)) {
+        errno = EPERM;
+        return -errno;
+    }
     if (status_to == 0 && !(tag_vec_to.back() == tag_vec_from.back())) {
 #ifdef DEBUG
         std::cout << " >>> rename: using great idea" << std::endl;
@@ -374,28 +485,30 @@ static int ucutag_rename(const char *from, const char *to) {
                 errno = ENOENT;
                 return -errno;
             }
-            num_t file_inode_from = tagFS.getFileInode(tag_vec_from);
-            if (file_inode_from == num_t(-1)) {
-                errno = ENOENT;
-                return -errno;
-            }
-            std::string file_path_to = tagFS.getFileRealPath(tag_vec_to);
-            std::string file_path_from = tagFS.getFileRealPath(tag_vec_from);
+            num_t file_inode_from = resolved_from.inode;
+            std::string file_path_to = std::to_string(file_inode_to);
+            std::string file_path_from = std::to_string(file_inode_from);
+            num_t size_to = tagFS.getFileSize(file_inode_to);
+            num_t size_delta = tagFS.getFileSize(file_inode_from) - size_to;
 
             if (tagFS.deleteFileMetaData(tag_vec_from, file_inode_from) != 0) {
                 errno = ENOENT;
                 return -errno;
             }
 
-            auto res = unlink(file_path_to.c_str());
+            tagFS.fdCache.forget(file_inode_to);
+            tagFS.fdCache.forget(file_inode_from);
+            auto res = unlinkat(files_dir(), file_path_to.c_str(), 0);
             if (res == -1)
                 return -errno;
-            res = link(file_path_from.c_str(), file_path_to.c_str());
+            res = linkat(files_dir(), file_path_from.c_str(), files_dir(), file_path_to.c_str(), 0);
             if (res == -1)
                 return -errno;
-            res = unlink(file_path_from.c_str());
+            res = unlinkat(files_dir(), file_path_from.c_str(), 0);
             if (res == -1)
                 return -errno;
+            tagFS.dataResize(size_to, 0);
+            tagFS.tagStatsUpdate(tagFS.inodeToTagGet(file_inode_to), 0, size_delta);
 #ifdef DEBUG
             std::cout << " >>> rename: done great idea" << std::endl;
 #endif
@@ -408,27 +521,16 @@ static int ucutag_rename(const char *from, const char *to) {
     }
 
     auto inode_from = *inodes_from.begin();
-
     if (tag_vec_to.size() == tag_name_to.size() - 1) {
-        tagFS.renameFileTag(inode_from, tag_vec_from.back().name, tag_name_to.back());
-    }
-    tagFS.tagToInodeDeleteInodes({inode_from});
-    tag_vec_to.push_back({TAG_TYPE_FILE, tag_name_to.back()});
-    for (auto &tag: tag_vec_to) {
-        auto tagId = tagFS.tagNameToTagid(tag.name);
-        if (tagFS.tagToInodeFind(tagId)) {
-            tagFS.tagToInodeAddInode(tagId, inode_from);
-        }
-        else {
-            tagFS.tagToInodeInsert(tagId, inode_from);
-        }
-
-        if (tagFS.inodeToTagFind(inode_from))
-            tagFS.inodeToTagAddTagId(inode_from, tagId);
-        else
-            tagFS.inodeToTagInsert(inode_from, tagId);
+        if (tagFS.renameFileTag(inode_from, tag_vec_from.back().name, std::string{tag_name_to.back()}) != 0)
+            return -EIO;
+        tag_vec_to.push_back({TAG_TYPE_FILE, std::string{tag_name_to.back()}});
     }
 
+    // file leaves tags it no longer has and joins new ones, other tags are untouched
+    if (tagFS.retagFile(inode_from, tag_vec_to) != 0)
+        return -EIO;
+
     return 0;
 }
 
@@ -439,30 +541,33 @@ static int ucutag_link(const char *from, const char *to) {
 
     int res;
 
-    auto [tag_vec_to, status_to] = tagFS.prepareFileCreation(to);
+    pathvec components_to{requestArena()};
+    auto [tag_vec_to, status_to] = tagFS.prepareFileCreation(to, &components_to);
     if (status_to != 0) return status_to;
 
-    auto[tag_vec_from, status_from] = tagFS.parseTags(from);
-    if (status_from != 0) return -errno;
+    auto resolved_from = tagFS.resolve(from);
+    if (resolved_from.status != 0) return -errno;
 
-    tag_vec_to.push_back({TAG_TYPE_FILE, split(to, "/").back()});
+    tag_vec_to.push_back({TAG_TYPE_FILE, std::string{components_to.back()}});
 
 #ifdef DEBUG
     std::cout << " >>> link tag_vec_to: " << tag_vec_to << std::endl;
-    std::cout << " >>> link tag_vec_from: " << tag_vec_from << std::endl;
+    std::cout << " >>> link tag_vec_from: " << resolved_from.tags << std::endl;
 #endif
 
-    std::string link_file_path = tagFS.getFileRealPath(tag_vec_from);
+    std::string link_file_path = std::to_string(resolved_from.inode);
 
     num_t new_inode = tagFS.getNewInode();
+    if (new_inode == -1)
+        return -errno;
     std::string new_path = std::to_string(new_inode);
 
-    res = link(link_file_path.c_str(), new_path.c_str());
+    res = linkat(files_dir(), link_file_path.c_str(), files_dir(), new_path.c_str(), 0);
     if (res == -1)
         return -errno;
 
     if (tagFS.createNewFileMetaData(tag_vec_to, new_inode) != 0) {
-        unlink(new_path.c_str());
+        unlinkat(files_dir(), new_path.c_str(), 0);
         errno = EEXIST;
         return -errno;
     }
@@ -476,11 +581,12 @@ static int ucutag_chmod(const char *path, mode_t mode) {
 #endif
 
     int res;
-    auto[tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    std::string file_path = std::to_string(resolved.inode);
 
-    res = chmod(file_path.c_str(), mode);
+    // O_PATH descriptors can not be chmod-ed
+    res = fchmodat(files_dir(), file_path.c_str(), mode, 0);
     if (res == -1)
         return -errno;
 
@@ -493,11 +599,12 @@ static int ucutag_chown(const char *path, uid_t uid, gid_t gid) {
 #endif
 
     int res;
-    auto[tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    auto file_fd = get_file_fd(resolved.inode);
+    if (!file_fd) return -errno;
 
-    res = lchown(file_path.c_str(), uid, gid);
+    res = fchownat(file_fd->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
     if (res == -1)
         return -errno;
 
@@ -510,50 +617,170 @@ static int ucutag_truncate(const char *path, off_t size) {
 #endif
 
     int res;
-    auto[tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    num_t file_inode = resolved.inode;
+    std::string file_path = std::to_string(file_inode);
+    num_t old_size = tagFS.getFileSize(file_inode);
+    if (tagFS.dataResize(old_size, size) == -1)
+        return -errno;
 
-    res = truncate(file_path.c_str(), size);
+    int fd = openat(files_dir(), file_path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -errno;
+    res = ftruncate(fd, size);
+    close(fd);
 
     if (res == -1)
         return -errno;
 
+    tagFS.tagStatsUpdate(tagFS.inodeToTagGet(file_inode), 0, size - old_size);
+    tagFS.inodeToTimeRefresh(file_inode);
     return 0;
 }
 
-static int ucutag_open(const char *path, struct fuse_file_info *fi) {
+// opens backing file into the handle, operations on handle need no path lookups afterwards
+static int open_handle(num_t file_inode, int flags, mode_t mode, struct fuse_file_info *fi) {
+    if (file_inode == num_t(-1))
+        return -ENOENT;
+    std::string file_path = std::to_string(file_inode);
+    int fd = openat(files_dir(), file_path.c_str(), flags, mode);
+    if (fd == -1)
+        return -errno;
+
+    struct stat st{};
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -errno;
+    }
+
+    tag_filep* f;
+    try {
+        f = new tag_filep{fd, file_inode, st.st_size, st.st_mtime, ioEngine.registerFile(fd)};
+    } catch (std::bad_alloc& err) {
+        close(fd);
+        return -ENOMEM;
+    }
+    fi->fh = (uintptr_t) f;
+    return 0;
+}
+
+static int ucutag_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 #ifdef DEBUG
-    std::cout << " >>> open: " << path << std::endl;
+    std::cout << " >>> create: " << path << std::endl;
 #endif
 
-    int fd;
-    std::string file_path;
-    num_t new_inode;
-    inodeset file_inode_set;
+    // path is resolved once for both creation and opening
+    pathvec splitted{requestArena()};
+    auto[tag_vec, status] = tagFS.prepareFileCreation(path, &splitted);
+    if (status != 0)
+        return status;
+    if (tag_vec.size() < splitted.size())
+        tag_vec.push_back({TAG_TYPE_FILE, std::string{splitted.back()}});
+    else if (tag_vec.back().type != TAG_TYPE_FILE)
+        return -EISDIR;
 
-    if (fi->flags & O_CREAT) {
-        auto[tag_vec, status] = tagFS.prepareFileCreation(path);
-        if (status != 0)
-            return status;
-        new_inode = tagFS.getNewInode();
-        file_path = std::to_string(new_inode);
-        if (tagFS.createNewFileMetaData(tag_vec, new_inode) != 0) {
-            errno = EEXIST;
-            return -errno;
-        }
-    } else {
-        auto[tag_vec, status] = tagFS.parseTags(path);
-        if (status != 0) return -errno;
-        file_inode_set = tagFS.getInodesFromTags(tag_vec);
-        file_path = tagFS.getFileRealPath(tag_vec);
+    num_t file_inode = tagFS.getNewInode();
+    if (file_inode == -1)
+        return -errno;
+    int res = open_handle(file_inode, fi->flags | O_CREAT | O_EXCL, mode, fi);
+    if (res != 0)
+        return res;
+    if (tagFS.createNewFileMetaData(tag_vec, file_inode) != 0) {
+        tag_filep *f = get_filep(fi);
+        ioEngine.unregisterFile(f->slot);
+        close(f->fd);
+        delete f;
+        unlinkat(files_dir(), std::to_string(file_inode).c_str(), 0);
+        return -EEXIST;
     }
+    return 0;
+}
+
+// facets of directory with numbers of files, most frequent first, in anonymous file read like a backing one
+static int open_facets(const std::string &dir, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    auto resolved = tagFS.resolve(dir.c_str(), true);
+    if (resolved.status != 0)
+        return -errno;
+    if (!resolved.tags.empty() && resolved.tags.back().type == TAG_TYPE_FILE)
+        return -ENOTDIR;
 
-    fd = open(file_path.c_str(), fi->flags);
+    auto facets = tagFS.tagFacets(resolved.tags, resolved.inodes);
+    std::vector<std::pair<num_t, std::string>> ordered;
+    for (auto &[name, files]: facets) {
+        ordered.emplace_back(-files, name);
+    }
+    std::sort(ordered.begin(), ordered.end());
+    std::string contents;
+    for (auto &[files, name]: ordered) {
+        contents += std::to_string(-files) + "\t" + name + "\n";
+    }
+
+    int fd = memfd_create("ucutag-facets", MFD_CLOEXEC);
     if (fd == -1)
         return -errno;
+    struct stat st{};
+    if (pwrite(fd, contents.data(), contents.size(), 0) != static_cast<ssize_t>(contents.size()) ||
+        fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    tag_filep* f;
+    try {
+        f = new tag_filep{fd, -1, st.st_size, st.st_mtime, -1};
+    } catch (std::bad_alloc& err) {
+        close(fd);
+        return -ENOMEM;
+    }
+    fi->fh = (uintptr_t) f;
+    fi->direct_io = 1;
+    return 0;
+}
 
-    fi->fh = fd;
+static int ucutag_open(const char *path, struct fuse_file_info *fi) {
+#ifdef DEBUG
+    std::cout << " >>> open: " << path << std::endl;
+#endif
+
+    std::string dir;
+    if (facets_dir(path, dir))
+        return open_facets(dir, fi);
+
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    return open_handle(resolved.inode, fi->flags, 0644, fi);
+}
+
+static int ucutag_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+#ifdef DEBUG
+    std::cout << " >>> fgetattr: " << path << std::endl;
+#endif
+
+    (void) path;
+    tag_filep *f = get_filep(fi);
+    if (ioEngine.stat(f->fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW, stbuf) == -1)
+        return -errno;
+    return 0;
+}
+
+static int ucutag_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+#ifdef DEBUG
+    std::cout << " >>> ftruncate: " << path << std::endl;
+#endif
+
+    (void) path;
+    tag_filep *f = get_filep(fi);
+    struct stat st{};
+    if (fstat(f->fd, &st) == -1)
+        return -errno;
+    if (tagFS.dataResize(st.st_size, size) == -1)
+        return -errno;
+    // like writes, change of size and time is accounted on release
+    if (ftruncate(f->fd, size) == -1)
+        return -errno;
     return 0;
 }
 
@@ -566,7 +793,8 @@ static int ucutag_read(const char *path, char *buf, size_t size, off_t offset,
     int res;
 
     (void) path;
-    res = pread(fi->fh, buf, size, offset);
+    tag_filep *f = get_filep(fi);
+    res = ioEngine.read(f->fd, f->slot, buf, size, offset);
     if (res == -1)
         res = -errno;
 
@@ -589,8 +817,27 @@ static int ucutag_read_buf(const char *path, struct fuse_bufvec **bufp,
 
     *src = FUSE_BUFVEC_INIT(size);
 
+    // without splice fuse would read from descriptor itself, let the engine do it instead
+    if (ioEngine.available()) {
+        src->buf[0].mem = malloc(size);
+        if (src->buf[0].mem == nullptr) {
+            free(src);
+            return -ENOMEM;
+        }
+        tag_filep *f = get_filep(fi);
+        ssize_t res = ioEngine.read(f->fd, f->slot, src->buf[0].mem, size, offset);
+        if (res == -1) {
+            free(src->buf[0].mem);
+            free(src);
+            return -errno;
+        }
+        src->buf[0].size = res;
+        *bufp = src;
+        return 0;
+    }
+
     src->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-    src->buf[0].fd = fi->fh;
+    src->buf[0].fd = get_filep(fi)->fd;
     src->buf[0].pos = offset;
 
     *bufp = src;
@@ -598,6 +845,12 @@ static int ucutag_read_buf(const char *path, struct fuse_bufvec **bufp,
     return 0;
 }
 
+// writes are not serialized, only accounting of the space they take is done under the lock of TagFS
+static int reserve_data(int fd, num_t end) {
+    std::lock_guard<std::mutex> lock{tagFS.apiMutex};
+    return tagFS.dataReserve(fd, end);
+}
+
 static int ucutag_write(const char *path, const char *buf, size_t size,
                      off_t offset, struct fuse_file_info *fi) {
 #ifdef DEBUG
@@ -607,7 +860,10 @@ static int ucutag_write(const char *path, const char *buf, size_t size,
     int res;
 
     (void) path;
-    res = pwrite(fi->fh, buf, size, offset);
+    tag_filep *f = get_filep(fi);
+    if (reserve_data(f->fd, offset + size) == -1)
+        return -errno;
+    res = ioEngine.write(f->fd, f->slot, buf, size, offset);
     if (res == -1)
         res = -errno;
 
@@ -623,9 +879,20 @@ static int ucutag_write_buf(const char *path, struct fuse_bufvec *buf,
     struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
 
     (void) path;
+    if (reserve_data(get_filep(fi)->fd, offset + fuse_buf_size(buf)) == -1)
+        return -errno;
+
+    // data in memory goes through the engine, spliced data is copied by fuse
+    if (ioEngine.available() && buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        tag_filep *f = get_filep(fi);
+        ssize_t res = ioEngine.write(f->fd, f->slot, buf->buf[0].mem, buf->buf[0].size, offset);
+        if (res == -1)
+            return -errno;
+        return static_cast<int>(res);
+    }
 
     dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
-    dst.buf[0].fd = fi->fh;
+    dst.buf[0].fd = get_filep(fi)->fd;
     dst.buf[0].pos = offset;
 
     return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
@@ -637,14 +904,24 @@ static int ucutag_statfs(const char *path, struct statvfs *stbuf) {
 #endif
 
     int res;
-    auto[tag_vec, status] = tagFS.parseTags(path);
-    if (status != 0) return -errno;
-    std::string file_path = tagFS.getFileRealPath(tag_vec);
-
-    res = statvfs(file_path.c_str(), stbuf);
+    res = fstatvfs(files_dir(), stbuf);
     if (res == -1)
         return -errno;
 
+    if (strcmp(path, "/") == 0) {
+        stbuf->f_files = tagFS.filesCount();
+        return 0;
+    }
+
+    auto[tag_vec, status] = tagFS.parseTags(path);
+    if (status != 0) return -errno;
+    if (tag_vec.back().type == TAG_TYPE_FILE)
+        return 0;
+
+    // files and used blocks of tag set, free space is the one of storage
+    auto stats = tagFS.tagSetStats(tag_vec);
+    stbuf->f_files = stats.files;
+    stbuf->f_blocks = stbuf->f_bfree + (stats.bytes + stbuf->f_frsize - 1) / stbuf->f_frsize;
     return 0;
 }
 
@@ -661,7 +938,7 @@ static int ucutag_flush(const char *path, struct fuse_file_info *fi) {
        called multiple times for an open file, this must not really
        close the file.  This is important if used on a network
        filesystem like NFS which flush the data/metadata on close() */
-    res = close(dup(fi->fh));
+    res = close(dup(get_filep(fi)->fd));
     if (res == -1)
         return -errno;
 
@@ -674,7 +951,18 @@ static int ucutag_release(const char *path, struct fuse_file_info *fi) {
 #endif
 
     (void) path;
-    close(fi->fh);
+    tag_filep *f = get_filep(fi);
+
+    struct stat st{};
+    if (fstat(f->fd, &st) == 0) {
+        if (st.st_size != f->size)
+            tagFS.tagStatsUpdate(tagFS.inodeToTagGet(f->inode), 0, st.st_size - f->size);
+        if (st.st_mtime != f->mtime)
+            tagFS.inodeToTimeUpdate(f->inode, st.st_mtime);
+    }
+    ioEngine.unregisterFile(f->slot);
+    close(f->fd);
+    delete f;
 
     return 0;
 }
@@ -687,9 +975,9 @@ static int ucutag_fsync(const char *path, int isdatasync,
 
     int res;
     (void) path;
-    (void) isdatasync;
 
-    res = fsync(fi->fh);
+    tag_filep *f = get_filep(fi);
+    res = ioEngine.fsync(f->fd, f->slot, isdatasync != 0);
     if (res == -1)
         return -errno;
 
@@ -704,68 +992,375 @@ static int ucutag_flock(const char *path, struct fuse_file_info *fi, int op) {
     int res;
     (void) path;
 
-    res = flock(fi->fh, op);
+    res = flock(get_filep(fi)->fd, op);
     if (res == -1)
         return -errno;
 
     return 0;
 }
 
+static int ucutag_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+#ifdef DEBUG
+    std::cout << " >>> fallocate: " << path << std::endl;
+#endif
+
+    (void) path;
+    tag_filep *f = get_filep(fi);
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && reserve_data(f->fd, offset + length) == -1)
+        return -errno;
+    // like writes, change of size is accounted on release
+    if (fallocate(f->fd, mode, offset, length) == -1)
+        return -errno;
+    return 0;
+}
+
+// replaces contents of backing file dst by those of src: reflink if backing file system can share extents,
+// otherwise copy inside the kernel, data never passes through fuse
+static int clone_backing(int src, int dst, off_t size) {
+    if (ioctl(dst, FICLONE, src) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EXDEV && errno != EINVAL)
+        return -1;
+    if (ftruncate(dst, 0) == -1)
+        return -1;
+    loff_t in = 0, out = 0;
+    while (in < size) {
+        ssize_t res = copy_file_range(src, &in, dst, &out, std::min<off_t>(size - in, CLONE_CHUNK_SIZE), 0);
+        if (res == -1)
+            return -1;
+        if (res == 0)
+            break;
+    }
+    return 0;
+}
+
+static int clone_file(const char *path, const std::string &source) {
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    if (resolved.tags.back().type != TAG_TYPE_FILE)
+        return -EISDIR;
+    auto from = tagFS.resolve(source.c_str());
+    if (from.status != 0) return -errno;
+    if (from.tags.back().type != TAG_TYPE_FILE)
+        return -EISDIR;
+    if (resolved.inode == num_t(-1) || from.inode == num_t(-1))
+        return -ENOENT;
+    if (resolved.inode == from.inode)
+        return 0;
+
+    int src = openat(files_dir(), std::to_string(from.inode).c_str(), O_RDONLY | O_CLOEXEC);
+    if (src == -1)
+        return -errno;
+    int dst = openat(files_dir(), std::to_string(resolved.inode).c_str(), O_WRONLY | O_CLOEXEC);
+    if (dst == -1) {
+        close(src);
+        return -errno;
+    }
+    struct stat src_st{}, dst_st{};
+    int res = fstat(src, &src_st) == -1 || fstat(dst, &dst_st) == -1 ? -1 : 0;
+    if (res == 0 && (!S_ISREG(src_st.st_mode) || !S_ISREG(dst_st.st_mode))) {
+        errno = EINVAL;
+        res = -1;
+    }
+    if (res == 0)
+        res = tagFS.dataResize(dst_st.st_size, src_st.st_size);
+    if (res == 0 && (res = clone_backing(src, dst, src_st.st_size)) == -1) {
+        int clone_errno = errno;
+        tagFS.dataResize(src_st.st_size, dst_st.st_size);
+        errno = clone_errno;
+    }
+    int err = errno;
+    close(src);
+    close(dst);
+    if (res == -1)
+        return -err;
+
+    tagFS.tagStatsUpdate(tagFS.inodeToTagGet(resolved.inode), 0, src_st.st_size - dst_st.st_size);
+    tagFS.inodeToTimeRefresh(resolved.inode);
+    return 0;
+}
+
+// key of typed tag in name of attribute, empty if it is not a value attribute
+static std::string value_xattr_key(const char *name) {
+    size_t prefix = strlen(UCUTAG_XATTR_VALUE);
+    if (strncmp(name, UCUTAG_XATTR_VALUE, prefix) != 0)
+        return {};
+    return name + prefix;
+}
+
+static int copy_xattr(const std::string &attr, char *value, size_t size) {
+    if (size == 0)
+        return static_cast<int>(attr.size());
+    if (size < attr.size())
+        return -ERANGE;
+    memcpy(value, attr.data(), attr.size());
+    return static_cast<int>(attr.size());
+}
+
+static int ucutag_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+#ifdef DEBUG
+    std::cout << " >>> setxattr: " << path << " " << name << std::endl;
+#endif
+
+    auto key = value_xattr_key(name);
+    if (!key.empty()) {
+        if (!isValueKey(key) || size == 0)
+            return -EINVAL;
+        auto resolved = tagFS.resolve(path);
+        if (resolved.status != 0) return -errno;
+        // typed tags belong to files, directories are tags themselves
+        if (resolved.tags.back().type != TAG_TYPE_FILE)
+            return -ENOTSUP;
+        if (resolved.inode == num_t(-1))
+            return -ENOENT;
+        bool exists = tagFS.inodeToValueGet(resolved.inode).count(key) > 0;
+        if ((flags & XATTR_CREATE) && exists)
+            return -EEXIST;
+        if ((flags & XATTR_REPLACE) && !exists)
+            return -ENODATA;
+        if (tagFS.inodeToValueSet(resolved.inode, key, parseTagValue(std::string(value, size))) != 0)
+            return -EIO;
+        return 0;
+    }
+
+    if (strcmp(name, UCUTAG_XATTR_CLONE) == 0) {
+        if (size == 0)
+            return -EINVAL;
+        return clone_file(path, std::string(value, size));
+    }
+
+    if (strcmp(name, UCUTAG_XATTR_IMPLIES) != 0)
+        return -ENOTSUP;
+    auto [tag_vec, status] = tagFS.parseTags(path);
+    if (status != 0) return -errno;
+    if (tag_vec.back().type != TAG_TYPE_REGULAR)
+        return -ENOTDIR;
+    if ((flags & XATTR_CREATE) && !tag_vec.back().parents.empty())
+        return -EEXIST;
+    if ((flags & XATTR_REPLACE) && tag_vec.back().parents.empty())
+        return -ENODATA;
+
+    auto parentNames = split(std::string(value, size), ",");
+    if (tagFS.setTagParents(tag_vec.back().name, parentNames) != 0)
+        return -errno;
+    return 0;
+}
+
+static int ucutag_getxattr(const char *path, const char *name, char *value, size_t size) {
+#ifdef DEBUG
+    std::cout << " >>> getxattr: " << path << " " << name << std::endl;
+#endif
+
+    auto key = value_xattr_key(name);
+    if (!key.empty()) {
+        auto resolved = tagFS.resolve(path);
+        if (resolved.status != 0) return -errno;
+        if (resolved.tags.back().type != TAG_TYPE_FILE || resolved.inode == num_t(-1))
+            return -ENODATA;
+        auto values = tagFS.inodeToValueGet(resolved.inode);
+        auto it = values.find(key);
+        if (it == values.end())
+            return -ENODATA;
+        return copy_xattr(it->second, value, size);
+    }
+
+    bool implies = strcmp(name, UCUTAG_XATTR_IMPLIES) == 0;
+    if (!implies && strcmp(name, UCUTAG_XATTR_STATS) != 0)
+        return -ENODATA;
+    auto [tag_vec, status] = tagFS.parseTags(path);
+    if (status != 0) return -errno;
+    auto &tag = tag_vec.back();
+    if (tag.type != TAG_TYPE_REGULAR || (implies && tag.parents.empty()))
+        return -ENODATA;
+
+    std::string attr;
+    if (implies) {
+        for (auto parentId: tag.parents) {
+            if (!attr.empty())
+                attr += ",";
+            attr += tagFS.tagsGet(parentId).name;
+        }
+    } else {
+        attr = "files=" + std::to_string(tag.stats.files) + ",bytes=" + std::to_string(tag.stats.bytes) +
+               ",mtime=" + std::to_string(tag.stats.mtime);
+    }
+    return copy_xattr(attr, value, size);
+}
+
+static int ucutag_listxattr(const char *path, char *list, size_t size) {
+#ifdef DEBUG
+    std::cout << " >>> listxattr: " << path << std::endl;
+#endif
+
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    auto &tag = resolved.tags.back();
+
+    // names are separated by '\0'
+    std::string names;
+    if (tag.type == TAG_TYPE_FILE && resolved.inode != num_t(-1)) {
+        for (auto &[key, text]: tagFS.inodeToValueGet(resolved.inode)) {
+            names += UCUTAG_XATTR_VALUE + key;
+            names.push_back('\0');
+        }
+    } else if (tag.type == TAG_TYPE_REGULAR) {
+        names.append(UCUTAG_XATTR_STATS, sizeof(UCUTAG_XATTR_STATS));
+        if (!tag.parents.empty())
+            names.append(UCUTAG_XATTR_IMPLIES, sizeof(UCUTAG_XATTR_IMPLIES));
+    }
+    return copy_xattr(names, list, size);
+}
+
+static int ucutag_removexattr(const char *path, const char *name) {
+#ifdef DEBUG
+    std::cout << " >>> removexattr: " << path << " " << name << std::endl;
+#endif
+
+    auto key = value_xattr_key(name);
+    if (!key.empty()) {
+        auto resolved = tagFS.resolve(path);
+        if (resolved.status != 0) return -errno;
+        if (resolved.tags.back().type != TAG_TYPE_FILE || resolved.inode == num_t(-1))
+            return -ENODATA;
+        int res = tagFS.inodeToValueDelete(resolved.inode, key);
+        if (res < 0)
+            return -EIO;
+        return res == 0 ? -ENODATA : 0;
+    }
+
+    if (strcmp(name, UCUTAG_XATTR_IMPLIES) != 0)
+        return -ENODATA;
+    auto [tag_vec, status] = tagFS.parseTags(path);
+    if (status != 0) return -errno;
+    if (tag_vec.back().parents.empty())
+        return -ENODATA;
+    if (tagFS.setTagParents(tag_vec.back().name, {}) != 0)
+        return -errno;
+    return 0;
+}
+
 void *ucutag_init(struct fuse_conn_info *conn) {
-    tagFS.new_inode_counter = tagFS.getMaximumInode();
+    // after daemonization, threads do not survive fork
+    // batches of the engine are only formed by concurrent requests, single thread uses syscalls
+    if (multithreaded)
+        ioEngine.start();
+    tagFS.startCompaction();
+    // one thread has no concurrent requests to gather mutations of
+    tagFS.startCommitter(multithreaded ? commit_window : 0, commit_batch);
+    if (!query_socket.empty() && queryService.start(tagFS, query_socket) == -1)
+        std::cerr << "Error: could not listen on " << query_socket << ": " << strerror(errno) << std::endl;
+    num_t maximum_inode = tagFS.getMaximumInode();
+    if (tagFS.inodeCounterInit(maximum_inode) == -1)
+        std::cerr << "Error: could not set counter of inodes in store" << std::endl;
     // chec if @ already exists
-    if (tagFS.new_inode_counter == 0) {
+    if (maximum_inode == 0) {
         int fd;
         auto tag_vec = tagvec(1, {TAG_TYPE_REGULAR, "@"});
         num_t new_inode = tagFS.getNewInode();
         std::string new_path = std::to_string(new_inode);
-        fd = open(new_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        fd = openat(files_dir(), new_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
         if (tagFS.createNewFileMetaData(tag_vec, new_inode) != 0) {
-            unlink(new_path.c_str());
+            unlinkat(files_dir(), new_path.c_str(), 0);
         }
         close(fd);
     }
-
+    tagFS.startWatching();
 
     return nullptr;
 }
 
-int ucutag_utimens(const char *, const struct timespec tv[2]) {
+int ucutag_utimens(const char *path, const struct timespec tv[2]) {
+#ifdef DEBUG
+    std::cout << " >>> utimens: " << path << std::endl;
+#endif
+
+    auto resolved = tagFS.resolve(path);
+    if (resolved.status != 0) return -errno;
+    // directories are tags, they have no times to set
+    if (resolved.tags.back().type != TAG_TYPE_FILE)
+        return 0;
+
+    num_t file_inode = resolved.inode;
+    if (file_inode == num_t(-1))
+        return -ENOENT;
+    std::string file_path = std::to_string(file_inode);
+    if (utimensat(files_dir(), file_path.c_str(), tv, AT_SYMLINK_NOFOLLOW) == -1)
+        return -errno;
+
+    tagFS.inodeToTimeRefresh(file_inode);
     return 0;
 }
 
-void ucutag_destroy(void *userdata) {}
+void ucutag_destroy(void *userdata) {
+    queryService.stop();
+    tagFS.stopWatching();
+    ioEngine.stop();
+    tagFS.stopCommitter();
+    tagFS.stopCompaction();
+    if (tagFS.isEphemeral())
+        tagFS.dropFS();
+}
+
+// handlers using TagFS run one at a time under its lock, so that query service can use it between them,
+// and wait for group commit of their mutations without it; handlers only touching the descriptor of an
+// open file are not serialized, a blocking read or flock must not stall the file system
+template<auto handler>
+struct serialized;
+
+template<typename R, typename... Args, R (*handler)(Args...)>
+struct serialized<handler> {
+    static R call(Args... args) {
+        R res;
+        {
+            std::lock_guard<std::mutex> lock{tagFS.apiMutex};
+            RequestScope scope;
+            res = handler(args...);
+        }
+        // queued mutations of request are written while next requests run
+        if (tagFS.commitWait() == -1 && res >= 0)
+            return -errno;
+        return res;
+    }
+};
 
 static struct fuse_operations ucutag_oper = {
-        .getattr    = ucutag_getattr,
-        .readlink   = ucutag_readlink,
-        .mknod      = ucutag_mknod,
-        .mkdir      = ucutag_mkdir,
-        .unlink     = ucutag_unlink,
-        .rmdir      = ucutag_rmdir,
-        .symlink    = ucutag_symlink,
-        .rename     = ucutag_rename,
-        .link       = ucutag_link,
-        .chmod      = ucutag_chmod,
-        .chown      = ucutag_chown,
-        .truncate   = ucutag_truncate,
-        .open       = ucutag_open,
+        .getattr    = serialized<ucutag_getattr>::call,
+        .readlink   = serialized<ucutag_readlink>::call,
+        .mknod      = serialized<ucutag_mknod>::call,
+        .mkdir      = serialized<ucutag_mkdir>::call,
+        .unlink     = serialized<ucutag_unlink>::call,
+        .rmdir      = serialized<ucutag_rmdir>::call,
+        .symlink    = serialized<ucutag_symlink>::call,
+        .rename     = serialized<ucutag_rename>::call,
+        .link       = serialized<ucutag_link>::call,
+        .chmod      = serialized<ucutag_chmod>::call,
+        .chown      = serialized<ucutag_chown>::call,
+        .truncate   = serialized<ucutag_truncate>::call,
+        .open       = serialized<ucutag_open>::call,
         .read       = ucutag_read,
         .write      = ucutag_write,
-        .statfs     = ucutag_statfs,
+        .statfs     = serialized<ucutag_statfs>::call,
         .flush      = ucutag_flush,
-        .release    = ucutag_release,
+        .release    = serialized<ucutag_release>::call,
         .fsync      = ucutag_fsync,
-        .opendir    = ucutag_opendir,
-        .readdir    = ucutag_readdir,
-        .releasedir = ucutag_releasedir,
+        .setxattr   = serialized<ucutag_setxattr>::call,
+        .getxattr   = serialized<ucutag_getxattr>::call,
+        .listxattr  = serialized<ucutag_listxattr>::call,
+        .removexattr= serialized<ucutag_removexattr>::call,
+        .opendir    = serialized<ucutag_opendir>::call,
+        .readdir    = serialized<ucutag_readdir>::call,
+        .releasedir = serialized<ucutag_releasedir>::call,
         .init       = ucutag_init,
         .destroy	= ucutag_destroy,
-        .access     = ucutag_access,
-        .utimens    = ucutag_utimens,
+        .access     = serialized<ucutag_access>::call,
+        .create     = serialized<ucutag_create>::call,
+        .ftruncate  = serialized<ucutag_ftruncate>::call,
+        .fgetattr   = ucutag_fgetattr,
+        .utimens    = serialized<ucutag_utimens>::call,
         .write_buf  = ucutag_write_buf,
         .read_buf   = ucutag_read_buf,
-        .flock      = ucutag_flock
+        .flock      = ucutag_flock,
+        .fallocate  = ucutag_fallocate
 };
 
 
@@ -801,15 +1396,45 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     std::string fs_files_dir = std::string(home_p) + "/.ucutag/";
-    if (!args["remove"].empty()) {
+    num_t memory_limit = 0;
+    if (args["backend"] == "memory") {
+        // files of ephemeral file system are in tmpfs, so in memory too
+        std::string tmp_dir = std::filesystem::exists("/dev/shm") ? "/dev/shm" : std::filesystem::temp_directory_path().string();
+        std::string tmp_template = tmp_dir + "/ucutag." + args["name"] + ".XXXXXX";
+        if (mkdtemp(tmp_template.data()) == nullptr) {
+            std::cerr << "Error: could not create directory for files in " << tmp_dir << std::endl;
+            return 1;
+        }
+        fs_files_dir = tmp_template;
+        try {
+            memory_limit = std::stoll(args["memory-limit"]);
+        } catch (std::exception &e) {
+            std::cerr << "Error: invalid memory limit: " << args["memory-limit"] << std::endl;
+            return 1;
+        }
+    } else if (!args["remove"].empty()) {
         fs_files_dir += args["remove"];
+    } else if (!args["fsck"].empty()) {
+        fs_files_dir += args["fsck"];
+    } else if (!args["dump"].empty()) {
+        fs_files_dir += args["dump"];
+    } else if (!args["restore"].empty()) {
+        fs_files_dir += args["restore"];
     } else {
         fs_files_dir += args["name"];
     }
     if (fs_files_dir.back() == '/') {
         fs_files_dir.pop_back();
     }
-    tagFS.initialize(fs_files_dir);
+    try {
+        commit_window = std::stoll(args["commit-window"]);
+        commit_batch = std::stoll(args["commit-batch"]);
+    } catch (std::exception &e) {
+        std::cerr << "Error: invalid --commit-window or --commit-batch" << std::endl;
+        return 1;
+    }
+    strvec stores = args["store"].empty() ? strvec{} : split(args["store"], "\n");
+    tagFS.initialize(fs_files_dir, args["backend"] == "memory", memory_limit, stores);
 #ifdef DEBUG
     std::cout << "Directory to store files: " << fs_files_dir  << std::endl;
 #endif
@@ -819,8 +1444,29 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (!args["fsck"].empty()) {
+        return tagFS.checkFS(args["repair"] == "true") == 0 ? 0 : 1;
+    }
+
+    query_socket = args["query-socket"];
+    if (!query_socket.empty() && query_socket.front() != '/')
+        query_socket = (fs::current_path() / query_socket).string();
+
+    if (!args["dump"].empty()) {
+        return tagFS.dumpFS(args["archive"], args["with-data"] == "true") == 0 ? 0 : 1;
+    }
+
+    if (!args["restore"].empty()) {
+        return tagFS.restoreFS(args["archive"]) == 0 ? 0 : 1;
+    }
+
     // create new argv for fuse
-    std::vector<std::string> argv_new_vec = {std::string(argv[0]), "-s", args["mount"]};
+    // requests run in several threads unless asked otherwise, they wait for group commit
+    // and I/O of open files runs concurrently; threading does not depend on commit window or backend
+    std::vector<std::string> argv_new_vec = {std::string(argv[0]), args["mount"]};
+    multithreaded = args["single-thread"] != "true";
+    if (!multithreaded)
+        argv_new_vec.push_back("-s");
      if (args["debug"] == "true") {
         argv_new_vec.push_back("-f");
     }